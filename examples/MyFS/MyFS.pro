@@ -20,12 +20,23 @@ SOURCES += main.cpp\
     sfuse/simplifier.cpp \
     sfuse/qsimplefuse.cpp \
     sfuse/qdaemon.cpp \
+    sfuse/lowlevel.cpp \
+    sfuse/workerpool.cpp \
+    sfuse/opstats.cpp \
+    dentrycache.cpp \
+    inodecache.cpp \
     myfs.cpp
 
 HEADERS  += mainwindow.h \
     sfuse/simplifier.h \
     sfuse/qsimplefuse.h \
     sfuse/qdaemon.h \
+    sfuse/lowlevel.h \
+    sfuse/workerpool.h \
+    sfuse/opstats.h \
+    dentrycache.h \
+    inodecache.h \
+    lrucache.h \
     myfs.h
 
 FORMS    += mainwindow.ui
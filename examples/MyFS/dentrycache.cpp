@@ -0,0 +1,71 @@
+#include "dentrycache.h"
+
+#include <string.h>
+
+#include <QMutexLocker>
+
+bool Dentry::matches(const DentryKey &key) const
+{
+    return (parent == key.parent) && (name.size() == key.len) && (memcmp(name.constData(), key.name, key.len) == 0);
+}
+
+void Dentry::setKey(const DentryKey &key)
+{
+    parent = key.parent;
+    name = QByteArray(key.name, key.len);
+}
+
+DentryCache::DentryCache(quint32 capacity) : LruCache<Dentry, DentryKey>(capacity)
+{
+}
+
+/* FNV-1a hash of the parent address followed by the name */
+quint32 DentryCache::hashOf(quint64 parent, const char *name, int len)
+{
+    quint32 hash = 0x811C9DC5;
+    for (int i = 0; i < 8; ++i)
+    {
+        hash ^= (parent >> (8 * i)) & 0xFF;
+        hash *= 0x01000193;
+    }
+    for (int i = 0; i < len; ++i)
+    {
+        hash ^= (quint8) name[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+/* Looks for the entry name (of length len) of the directory parent, and puts its address into node */
+bool DentryCache::lookup(quint64 parent, const char *name, int len, quint64 &node)
+{
+    QMutexLocker locker(&lock);
+    DentryKey key = { parent, name, len };
+    Dentry *entry = lookupEntry(hashOf(parent, name, len), key);
+    if (!entry)
+        return false;
+    node = entry->node;
+    return true;
+}
+
+/* Adds (or updates) the entry name (of length len) of the directory parent, dropping the least recently used entry if full */
+void DentryCache::insert(quint64 parent, const char *name, int len, quint64 node)
+{
+    QMutexLocker locker(&lock);
+    DentryKey key = { parent, name, len };
+    insertEntry(hashOf(parent, name, len), key)->node = node;
+}
+
+/* Forgets the entry name (of length len) of the directory parent */
+void DentryCache::remove(quint64 parent, const char *name, int len)
+{
+    QMutexLocker locker(&lock);
+    DentryKey key = { parent, name, len };
+    removeEntry(hashOf(parent, name, len), key);
+}
+
+void DentryCache::clear()
+{
+    QMutexLocker locker(&lock);
+    clearEntries();
+}
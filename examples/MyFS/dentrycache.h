@@ -0,0 +1,44 @@
+#ifndef DENTRYCACHE_H
+#define DENTRYCACHE_H
+
+#include <QByteArray>
+
+#include "lrucache.h"
+
+/*
+    Cache of the directory entries, mapping a (parent directory, name) pair to the address of the node.
+    It holds at most a given number of entries, the least recently used one being dropped first.
+    Looking up an entry does not allocate anything.
+    It may be used by several threads at once.
+*/
+
+struct DentryKey
+{
+    quint64 parent;
+    const char *name;
+    int len;
+};
+
+struct Dentry : LruLink<Dentry>
+{
+    quint64 parent;
+    quint64 node;
+    QByteArray name;
+
+    bool matches(const DentryKey &key) const;
+    void setKey(const DentryKey &key);
+};
+
+class DentryCache : private LruCache<Dentry, DentryKey>
+{
+public:
+    explicit DentryCache(quint32 capacity);
+    bool lookup(quint64 parent, const char *name, int len, quint64 &node);
+    void insert(quint64 parent, const char *name, int len, quint64 node);
+    void remove(quint64 parent, const char *name, int len);
+    void clear();
+private:
+    static quint32 hashOf(quint64 parent, const char *name, int len);
+};
+
+#endif // DENTRYCACHE_H
@@ -0,0 +1,60 @@
+#include "inodecache.h"
+
+#include <QMutexLocker>
+
+InodeCache::InodeCache(quint32 capacity) : LruCache<Inode, quint64>(capacity), hits(0), misses(0)
+{
+}
+
+/* The addresses of the nodes are spread over the whole container, mix all their bits into the lower ones */
+quint32 InodeCache::hashOf(quint64 addr)
+{
+    quint32 hash = (quint32) (addr ^ (addr >> 32));
+    hash ^= hash >> 16;
+    hash *= 0x45D9F3B;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/* Looks for the header of the node addr, and puts it into header */
+bool InodeCache::lookup(quint64 addr, NodeHeader &header)
+{
+    QMutexLocker locker(&lock);
+    Inode *entry = lookupEntry(hashOf(addr), addr);
+    if (!entry)
+    {
+        ++misses;
+        return false;
+    }
+    ++hits;
+    header = entry->header;
+    return true;
+}
+
+/* Adds (or updates) the header of the node addr, dropping the least recently used header if full */
+void InodeCache::insert(quint64 addr, const NodeHeader &header)
+{
+    QMutexLocker locker(&lock);
+    insertEntry(hashOf(addr), addr)->header = header;
+}
+
+/* Forgets the header of the node addr */
+void InodeCache::remove(quint64 addr)
+{
+    QMutexLocker locker(&lock);
+    removeEntry(hashOf(addr), addr);
+}
+
+void InodeCache::clear()
+{
+    QMutexLocker locker(&lock);
+    clearEntries();
+}
+
+/* Puts into hits and misses the number of lookups which found (or did not find) their header */
+void InodeCache::stats(quint64 &hits, quint64 &misses)
+{
+    QMutexLocker locker(&lock);
+    hits = this->hits;
+    misses = this->misses;
+}
@@ -0,0 +1,47 @@
+#ifndef INODECACHE_H
+#define INODECACHE_H
+
+#include "lrucache.h"
+
+/*
+    Cache of the node headers, mapping the address of a node to the decoded header of its first part.
+    It holds at most a given number of headers, the least recently used one being dropped first.
+    A header has to be removed whenever it is changed in the container or its node is freed.
+    It may be used by several threads at once.
+*/
+
+struct NodeHeader
+{
+    quint64 length; /* Length of the first part */
+    quint64 next; /* Address of the next part (or of the index) */
+    quint64 mtime;
+    quint16 nlink;
+    quint16 mode; /* With the MODE_INDEXED flag */
+    quint64 size; /* Only used in regular files */
+};
+
+struct Inode : LruLink<Inode>
+{
+    quint64 addr;
+    NodeHeader header;
+
+    bool matches(quint64 key) const { return addr == key; }
+    void setKey(quint64 key) { addr = key; }
+};
+
+class InodeCache : private LruCache<Inode, quint64>
+{
+public:
+    explicit InodeCache(quint32 capacity);
+    bool lookup(quint64 addr, NodeHeader &header);
+    void insert(quint64 addr, const NodeHeader &header);
+    void remove(quint64 addr);
+    void clear();
+    void stats(quint64 &hits, quint64 &misses);
+private:
+    static quint32 hashOf(quint64 addr);
+private:
+    quint64 hits, misses;
+};
+
+#endif // INODECACHE_H
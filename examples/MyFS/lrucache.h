@@ -0,0 +1,179 @@
+#ifndef LRUCACHE_H
+#define LRUCACHE_H
+
+#include <string.h>
+
+#include <QMutex>
+
+/*
+    Hash table of at most a given number of entries, the least recently used one being dropped first.
+    The entries are linked in place, so that looking one up does not allocate anything.
+    Entry has to derive from LruLink<Entry> and to provide bool matches(const Key &) const and void setKey(const Key &).
+    The caches built on it hold lock while they use it.
+*/
+
+template <class Entry>
+struct LruLink
+{
+    Entry *hashNext; /* Next entry of the same bucket */
+    Entry *lruPrev; /* More recently used entry */
+    Entry *lruNext; /* Less recently used entry */
+    quint32 hash;
+};
+
+template <class Entry, class Key>
+class LruCache
+{
+public:
+    explicit LruCache(quint32 capacity);
+    ~LruCache();
+protected:
+    Entry *lookupEntry(quint32 hash, const Key &key);
+    Entry *insertEntry(quint32 hash, const Key &key);
+    void removeEntry(quint32 hash, const Key &key);
+    void clearEntries();
+private:
+    Entry **find(quint32 hash, const Key &key);
+    void unlinkLru(Entry *entry);
+    void pushLru(Entry *entry);
+protected:
+    QMutex lock;
+private:
+    quint32 capacity, count, mask;
+    Entry **buckets;
+    Entry *lruFirst, *lruLast;
+};
+
+/* The number of buckets is the capacity rounded up to a power of two */
+template <class Entry, class Key>
+LruCache<Entry, Key>::LruCache(quint32 capacity) : capacity(capacity ? capacity : 1), count(0), lruFirst(0), lruLast(0)
+{
+    mask = 1;
+    while ((mask < this->capacity) && (mask < 0x80000000))
+        mask <<= 1;
+    buckets = new Entry*[mask];
+    memset(buckets, 0, mask * sizeof(Entry*));
+    --mask;
+}
+
+template <class Entry, class Key>
+LruCache<Entry, Key>::~LruCache()
+{
+    clearEntries();
+    delete[] buckets;
+}
+
+/* Returns the pointer to the entry (or to the end of its bucket if it is not cached) */
+template <class Entry, class Key>
+Entry **LruCache<Entry, Key>::find(quint32 hash, const Key &key)
+{
+    Entry **current = &buckets[hash & mask];
+    while (*current && (((*current)->hash != hash) || !(*current)->matches(key)))
+        current = &(*current)->hashNext;
+    return current;
+}
+
+template <class Entry, class Key>
+void LruCache<Entry, Key>::unlinkLru(Entry *entry)
+{
+    if (entry->lruPrev)
+        entry->lruPrev->lruNext = entry->lruNext;
+    else
+        lruFirst = entry->lruNext;
+    if (entry->lruNext)
+        entry->lruNext->lruPrev = entry->lruPrev;
+    else
+        lruLast = entry->lruPrev;
+}
+
+template <class Entry, class Key>
+void LruCache<Entry, Key>::pushLru(Entry *entry)
+{
+    entry->lruPrev = 0;
+    entry->lruNext = lruFirst;
+    if (lruFirst)
+        lruFirst->lruPrev = entry;
+    else
+        lruLast = entry;
+    lruFirst = entry;
+}
+
+/* Returns the entry of key (NULL if it is not cached), which becomes the most recently used one */
+template <class Entry, class Key>
+Entry *LruCache<Entry, Key>::lookupEntry(quint32 hash, const Key &key)
+{
+    Entry *entry = *find(hash, key);
+    if (entry && (entry != lruFirst))
+    {
+        unlinkLru(entry);
+        pushLru(entry);
+    }
+    return entry;
+}
+
+/* Returns the entry of key, added if it is not cached (dropping the least recently used entry if full), for its value to be set */
+template <class Entry, class Key>
+Entry *LruCache<Entry, Key>::insertEntry(quint32 hash, const Key &key)
+{
+    Entry **place = find(hash, key);
+    if (*place)
+    {
+        unlinkLru(*place);
+        pushLru(*place);
+        return *place;
+    }
+    Entry *entry;
+    if (count >= capacity)
+    {
+        /* Reuse the least recently used entry */
+        entry = lruLast;
+        unlinkLru(entry);
+        Entry **old = &buckets[entry->hash & mask];
+        while (*old != entry)
+            old = &(*old)->hashNext;
+        *old = entry->hashNext;
+        /* The removal may have changed the end of the bucket of the new entry */
+        place = find(hash, key);
+    } else {
+        entry = new Entry;
+        ++count;
+    }
+    entry->hashNext = 0;
+    entry->hash = hash;
+    entry->setKey(key);
+    *place = entry;
+    pushLru(entry);
+    return entry;
+}
+
+/* Forgets the entry of key */
+template <class Entry, class Key>
+void LruCache<Entry, Key>::removeEntry(quint32 hash, const Key &key)
+{
+    Entry **place = find(hash, key);
+    Entry *entry = *place;
+    if (!entry)
+        return;
+    *place = entry->hashNext;
+    unlinkLru(entry);
+    delete entry;
+    --count;
+}
+
+template <class Entry, class Key>
+void LruCache<Entry, Key>::clearEntries()
+{
+    Entry *entry = lruFirst;
+    while (entry)
+    {
+        Entry *next = entry->lruNext;
+        delete entry;
+        entry = next;
+    }
+    memset(buckets, 0, (mask + 1) * sizeof(Entry*));
+    count = 0;
+    lruFirst = 0;
+    lruLast = 0;
+}
+
+#endif // LRUCACHE_H
@@ -30,6 +30,12 @@ void MainWindow::umount()
 #endif
         return;
     }
+#ifndef QT_NO_DEBUG
+    quint64 hits, misses;
+    fs->inodeCacheStats(hits, misses);
+    if (hits + misses)
+        qDebug() << "Inode cache:" << hits << "hits," << misses << "misses (" << (100.0 * hits / (hits + misses)) << "% hit rate)";
+#endif
     delete fs;
     fs = NULL;
     ui->sfUMount->setEnabled(false);
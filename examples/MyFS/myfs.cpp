@@ -9,8 +9,12 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <sys/mman.h>
 
 #include <QByteArray>
+#include <QMutexLocker>
+#include <QReadLocker>
+#include <QWriteLocker>
 
 #define READONLY_FS 0
 
@@ -19,6 +23,62 @@
 
 #define MAX_OPEN_FILES 1000
 
+/* The writes smaller than this are buffered (see bufferWrite()), until the buffer of their file or all of them get larger than these */
+#define BUFFERED_WRITE_SIZE 0x4000
+#define WRITE_BUFFER_SIZE 0x100000
+#define WRITE_BUFFER_TOTAL 0x1000000
+
+/* The runs of zeros at least this large are zeroed with fallocate() (see myWriteB()), the smaller ones are written */
+#define ZERO_RANGE_SIZE 0x10000
+
+/* Signature and version at the beginning of the superblock, followed by the address of the root directory, of the first free block,
+    of the journal and by the size of the container */
+#define MYFS_MAGIC "MyFS"
+#define MYFS_VERSION 2
+#define SUPERBLOCK_SIZE 0x40
+#define SB_ROOT 8
+#define SB_FIRST_BLANK 16
+#define SB_JOURNAL 24
+#define SB_SIZE 32
+
+/* Fields of the journal block, followed by the record of the last commit */
+#define JOURNAL_SEQUENCE 16
+#define JOURNAL_LENGTH 24
+#define JOURNAL_CHECKSUM 32
+#define JOURNAL_RECORD 40
+/* Size of the journal of a new container (it is moved to a larger block when a record does not fit) */
+#define JOURNAL_SIZE 0x20000
+
+/* Each block starts with its size and the address of the next block */
+#define PART_HEADER_SIZE 16
+/* Flag of the size of a part of a regular file (and of the address in its index entry) which is a hole: its data is read as zeros
+    and has no space in the container. The block only holds its header and its real size (HOLE_BLOCK_SIZE). */
+#define PART_HOLE (((quint64) 1) << 63)
+#define HOLE_BLOCK_SIZE 24
+/* When data is written into a hole, that much of the hole around it is allocated too (see fillHole()), so that the file gets fewer parts */
+#define HOLE_FILL_SIZE 0x10000
+/* Offsets of the fields of the first part of a node, followed by its entries (directory) or by its size and its data (regular file) */
+#define NODE_MTIME 16
+#define NODE_NLINK 24
+#define NODE_MODE 26
+#define NODE_ENTRIES 32
+#define NODE_SIZE 32
+#define NODE_DATA 40
+/* Size of a directory entry without its name (address and name length) */
+#define ENTRY_HEADER_SIZE 9
+
+/* Flag of the mode of a regular file whose first part is followed by an extent index,
+    or of a directory whose first part is followed by the header of a hashed index (never reported) */
+#define MODE_INDEXED 0x1000
+/* Minimum size of an extent index block */
+#define INDEX_BLOCK_SIZE 0x400
+/* Size of the header of a directory index, and initial number of slots of its table (a power of two) */
+#define DIR_INDEX_HEADER_SIZE 72
+#define DIR_INDEX_SLOTS 0x40
+
+/* Maximum number of directory entries kept in the cache */
+#define DENTRY_CACHE_SIZE 0x10000
+
 #if DIR_BLOCK_SIZE < REG_BLOCK_SIZE
 #define MIN_BLOCK_SIZE DIR_BLOCK_SIZE
 #else
@@ -27,10 +87,43 @@
 
 #define SEEK_ERROR ((off_t) (-1))
 
-static char str_buffer[0x100];
+/* A directory listing cookie holds the address of a part and the offset of an entry in it.
+    The parts of a directory are smaller than 64 KiB, and the cookie is kept below 2^63. */
+#define DIR_COOKIE_SHIFT 16
+#define DIR_COOKIE(part, offset) ((((quint64) (part)) << DIR_COOKIE_SHIFT) | ((quint64) (offset)))
+
+/* The addresses of the directory parts have to fit in a cookie, so the container never grows beyond this size (128 TiB) */
+#define MAX_CONTAINER_SIZE (((quint64) 1) << (63 - DIR_COOKIE_SHIFT))
 
-/* We will make it single-threaded to avoid any further concurrency issues */
-MyFS::MyFS(QString mountPoint, QString filename) : QSimpleFuse(mountPoint, true), filename(convStr(filename)), fd(-1)
+/* Each thread has its own scratch buffer and its own position in the container (see mySeek()) */
+static __thread char str_buffer[0x100];
+static __thread off_t position;
+
+/* Written where zeros have to be, and read from the holes of the files */
+static const char zeros[ZERO_RANGE_SIZE] = { 0 };
+
+/* The container is only changed through the mount point, so the kernel can keep its caches much longer */
+static sMountOptions myMountOptions()
+{
+    sMountOptions options;
+    options.entry_timeout = 60.0;
+    options.attr_timeout = 60.0;
+    options.negative_timeout = 10.0;
+    options.kernel_cache = true;
+    /* Large requests, whose data goes straight between the kernel and the container */
+    options.max_write = 0x20000;
+    options.big_writes = true;
+    options.splice_read = true;
+    options.splice_write = true;
+    return options;
+}
+
+/* The requests are processed by several threads at once (see the locking rules in myfs.h) */
+MyFS::MyFS(QString mountPoint, QString filename, bool mapped, quint32 inodeCacheSize) : QSimpleFuse(mountPoint, false, true, true, myMountOptions()),
+    filename(convStr(filename)), fd(-1), mapped(mapped), map(NULL), mapSize(0), containerSize(0), journal_address(0), journal_size(0),
+    journalBytes(0), journalSequence(1), committedSequence(0), durabilityMode(DURABILITY_STRICT), flushInterval(DURABILITY_INTERVAL),
+    flusherRunning(false), flusherStop(false), unsynced(0), freeSpace(0), freedSpace(0), dentries(DENTRY_CACHE_SIZE), inodes(inodeCacheSize),
+    bufferedTotal(0)
 {
 }
 
@@ -39,6 +132,27 @@ MyFS::~MyFS()
     delete[] filename;
 }
 
+/* Puts into hits and misses the number of node headers found (or not) in the cache since the creation of the file system */
+void MyFS::inodeCacheStats(quint64 &hits, quint64 &misses)
+{
+    inodes.stats(hits, misses);
+}
+
+/* Chooses when the changes are committed (see MyFSDurability), interval being used by the periodic mode. It may be called while mounted. */
+void MyFS::setDurability(MyFSDurability mode, quint32 interval)
+{
+    QMutexLocker locker(&flushLock);
+    durabilityMode = mode;
+    flushInterval = qMax(interval, (quint32) 1);
+    flushCondition.wakeAll();
+}
+
+MyFSDurability MyFS::durability()
+{
+    QMutexLocker locker(&flushLock);
+    return durabilityMode;
+}
+
 void MyFS::createNewFilesystem(QString filename)
 {
     char *cFilename = convStr(filename);
@@ -55,45 +169,45 @@ void MyFS::createNewFilesystem(QString filename)
         close(fd);
         return;
     }
-    quint32 addr;
+    /* Superblock, root directory, journal (with an empty record) and free block, written at once */
+    QByteArray start(SUPERBLOCK_SIZE + DIR_BLOCK_SIZE + JOURNAL_SIZE + PART_HEADER_SIZE, 0);
+    char *data = start.data();
+    quint32 version = MYFS_VERSION;
+    quint64 addr;
     quint16 mshort;
-    addr = htonl(8);
-    if (write(fd, &addr, 4) != 4) goto abort;
-    addr = htonl(DIR_BLOCK_SIZE + 8);
-    if (write(fd, &addr, 4) != 4) goto abort;
-    addr = htonl(DIR_BLOCK_SIZE);
-    if (write(fd, &addr, 4) != 4) goto abort;
-    addr = 0;
-    if (write(fd, &addr, 4) != 4) goto abort;
-    addr = htonl(time(0));
-    if (write(fd, &addr, 4) != 4) goto abort;
-    mshort = htons(2);
-    if (write(fd, &mshort, 2) != 2) goto abort;
-    mshort = htons(SF_MODE_DIRECTORY | 0777);
-    if (write(fd, &mshort, 2) != 2) goto abort;
-    addr = htonl(8);
-    if (write(fd, &addr, 4) != 4) goto abort;
-    str_buffer[0] = 1;
-    if (write(fd, str_buffer, 1) != 1) goto abort;
-    str_buffer[1] = '.';
-    if (write(fd, str_buffer + 1, 1) != 1) goto abort;
+    memcpy(data, MYFS_MAGIC, 4);
+    memcpy(data + 4, &version, 4);
+    addr = SUPERBLOCK_SIZE;
+    memcpy(data + SB_ROOT, &addr, 8);
+    addr = SUPERBLOCK_SIZE + DIR_BLOCK_SIZE + JOURNAL_SIZE;
+    memcpy(data + SB_FIRST_BLANK, &addr, 8);
+    addr = SUPERBLOCK_SIZE + DIR_BLOCK_SIZE;
+    memcpy(data + SB_JOURNAL, &addr, 8);
+    addr = 0x100000;
+    memcpy(data + SB_SIZE, &addr, 8);
+    data += SUPERBLOCK_SIZE;
+    addr = DIR_BLOCK_SIZE;
+    memcpy(data, &addr, 8);
+    addr = time(0);
+    memcpy(data + NODE_MTIME, &addr, 8);
+    mshort = 2;
+    memcpy(data + NODE_NLINK, &mshort, 2);
+    mshort = SF_MODE_DIRECTORY | 0777;
+    memcpy(data + NODE_MODE, &mshort, 2);
     /* /../ is the same as / (root directory) (overwritten by fuse, but let's do it the right way) */
-    if (write(fd, &addr, 4) != 4) goto abort;
-    str_buffer[0] = 2;
-    if (write(fd, str_buffer, 1) != 1) goto abort;
-    str_buffer[0] = '.';
-    if (write(fd, str_buffer, 2) != 2) goto abort;
-    addr = 0;
-    if (write(fd, &addr, 4) != 4) goto abort;
-    if (lseek(fd, DIR_BLOCK_SIZE + 8, SEEK_SET) != DIR_BLOCK_SIZE + 8) goto abort;
-    addr = htonl(0x100000 - DIR_BLOCK_SIZE - 8);
-    if (write(fd, &addr, 4) != 4) goto abort;
-    addr = 0;
-    if (write(fd, &addr, 4) != 4) goto abort;
-    close(fd);
-    return;
-abort:
-    perror("read");
+    addr = SUPERBLOCK_SIZE;
+    memcpy(data + NODE_ENTRIES, &addr, 8);
+    memcpy(data + NODE_ENTRIES + 8, "\1.", 2);
+    memcpy(data + NODE_ENTRIES + 10, &addr, 8);
+    memcpy(data + NODE_ENTRIES + 18, "\2..", 3);
+    data += DIR_BLOCK_SIZE;
+    addr = JOURNAL_SIZE;
+    memcpy(data, &addr, 8);
+    data += JOURNAL_SIZE;
+    addr = 0x100000 - SUPERBLOCK_SIZE - DIR_BLOCK_SIZE - JOURNAL_SIZE;
+    memcpy(data, &addr, 8);
+    if (write(fd, start.constData(), start.size()) != start.size())
+        perror("write");
     close(fd);
 }
 
@@ -105,21 +219,38 @@ void MyFS::sInit()
         perror("open");
         return;
     }
-    if (read(fd, &root_address, 4) != 4)
-        goto read_error;
-    root_address = ntohl(root_address);
-    if (read(fd, &first_blank, 4) != 4)
-        goto read_error;
-    first_blank = ntohl(first_blank);
-    return;
-read_error:
-    perror("read");
-    close(fd);
-    fd = -1;
-}
-
-void MyFS::sDestroy()
-{
+    char magic[4];
+    int ret_value = -EIO;
+    if (pread(fd, magic, 4, 0) == 4)
+    {
+        if (memcmp(magic, MYFS_MAGIC, 4) == 0)
+        {
+            ret_value = loadContainer();
+        } else {
+            /* Containers of the first version have no superblock */
+            int oldFd = fd;
+            fd = -1;
+            ret_value = upgradeContainer(oldFd);
+            close(oldFd);
+        }
+    }
+    if (ret_value == 0)
+    {
+        startFlusher();
+        return;
+    }
+    if (ret_value == -EIO)
+        perror("read");
+    dentries.clear();
+    inodes.clear();
+    freeByAddr.clear();
+    freeBySize.clear();
+    freed.clear();
+    freedSpace = 0;
+    journal.clear();
+    journalBytes = 0;
+    committing.clear();
+    unmap();
     if (fd >= 0)
     {
         close(fd);
@@ -127,1619 +258,4605 @@ void MyFS::sDestroy()
     }
 }
 
-int MyFS::sGetSize(quint64 &size, quint64 &free)
+/* Maps the container fd, replays its journal, reads its superblock and builds the index of its free blocks, and returns 0 on success */
+int MyFS::loadContainer()
 {
-    if (fd < 0) return -EIO;
-    /* Get total size */
-    off_t length = lseek(fd, 0, SEEK_END);
-    if (length == SEEK_ERROR)
+    struct stat st;
+    if (fstat(fd, &st) != 0)
         return -EIO;
-    size = (quint64) length;
-    /* Get free size */
-    free = 0;
-    if (first_blank)
+    containerSize = (quint64) st.st_size;
+    /* Without a mapping, the container is accessed through fd */
+    if (mapped && (!remap()))
+        fprintf(stderr, "Warning: could not map %s, falling back to read/write\n", filename);
+    char superblock[SUPERBLOCK_SIZE];
+    position = 0;
+    if (myRead(superblock, SUPERBLOCK_SIZE) != SUPERBLOCK_SIZE)
+        return -EIO;
+    quint32 version;
+    memcpy(&version, superblock + 4, 4);
+    if (version != MYFS_VERSION)
     {
-        quint32 current = first_blank, to_add;
-        while (true)
+        /* The version is below 0x100, so it is found in the last byte with the other byte order */
+        if (version == (((quint32) MYFS_VERSION) << 24))
+            fprintf(stderr, "%s was created on a machine with another byte order\n", filename);
+        else
+            fprintf(stderr, "%s has an unknown format version (%u)\n", filename, version);
+        return -EINVAL;
+    }
+    memcpy(&journal_address, superblock + SB_JOURNAL, 8);
+    int ret_value = replayJournal();
+    if (ret_value != 0)
+        return ret_value;
+    /* The last commit may have changed the superblock */
+    position = 0;
+    if (myRead(superblock, SUPERBLOCK_SIZE) != SUPERBLOCK_SIZE)
+        return -EIO;
+    quint64 size;
+    memcpy(&root_address, superblock + SB_ROOT, 8);
+    memcpy(&first_blank, superblock + SB_FIRST_BLANK, 8);
+    memcpy(&size, superblock + SB_SIZE, 8);
+    ret_value = loadFreeIndex();
+#if !READONLY_FS
+    if ((ret_value == 0) && size && (size < containerSize))
+    {
+        /* The container was extended after the last commit: that space is free, but for the journal which may have been moved there */
+        QMutexLocker locker(&allocLock);
+        if (journal_address >= size)
         {
-            if (lseek(fd, current, SEEK_SET) != current)
-                return -EIO;
-            if (read(fd, &to_add, 4) != 4)
-                return -EIO;
-            to_add = ntohl(to_add);
-            if (to_add > 8)
-                free += to_add - 8;
-            if (read(fd, &current, 4) != 4)
-                return -EIO;
-            if (!current)
-                break;
-            current = ntohl(current);
+            if (journal_address > size)
+                ret_value = addFree(size, journal_address - size);
+            size = journal_address + journal_size;
         }
+        if ((ret_value == 0) && (size < containerSize))
+            ret_value = addFree(size, containerSize - size);
     }
-    return 0;
+    if ((ret_value == 0) && (size != containerSize))
+    {
+        if (mySeek(SB_SIZE, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(&containerSize, 8) != 8)
+            return -EIO;
+    }
+    /* The containers made before the journal get one */
+    if ((ret_value == 0) && (!journal_address))
+        ret_value = moveJournal(0);
+    if ((ret_value == 0) && (!journal.isEmpty()))
+        ret_value = commitJournal();
+#endif /* READONLY_FS */
+    return ret_value;
 }
 
-int MyFS::sGetAttr(const lString &pathname, sAttr &attr)
+/* Reads count bytes at the address addr of a container of the first version */
+static bool readOld(int oldFd, quint64 addr, void *buf, size_t count)
 {
-    if (fd < 0) return -EIO;
-    quint32 addr;
-    lString shallowCopy = pathname;
-    int ret_value = getAddress(shallowCopy, addr);
-    if (ret_value != 0)
-        return ret_value;
-    return myGetAttr(addr, attr);
+    return pread(oldFd, buf, count, (off_t) addr) == (ssize_t) count;
 }
 
-int MyFS::sMkFile(const lString &pathname, quint16 mst_mode)
+/* Copies the tree of the container of the first version oldFd into a new container of version 2, which then replaces it.
+    The new container is then the one in use, and 0 is returned on success. */
+int MyFS::upgradeContainer(int oldFd)
 {
 #if READONLY_FS
-    Q_UNUSED(pathname);
-    Q_UNUSED(mst_mode);
+    Q_UNUSED(oldFd);
+    fprintf(stderr, "%s has to be upgraded to a new format version\n", filename);
     return -EROFS;
 #else
-    if (fd < 0) return -EIO;
-    /* Create the file block */
-    quint32 file;
-    int ret_value = getBlock(mst_mode & SF_MODE_DIRECTORY ? DIR_BLOCK_SIZE : REG_BLOCK_SIZE, file);
-    if (ret_value != 0)
-        return ret_value;
-    quint32 addr = htonl(time(0));
-    if (write(fd, &addr, 4) != 4)
+    /* Its root directory always comes right after the two addresses */
+    quint8 root[24];
+    if (!readOld(oldFd, 0, root, 24))
         return -EIO;
-    quint16 mshort = htons((mst_mode & SF_MODE_DIRECTORY) ? 2 : 1);
-    if (write(fd, &mshort, 2) != 2)
-        return -EIO;
-    mshort = htons(mst_mode);
-    if (write(fd, &mshort, 2) != 2)
+    quint32 addr;
+    memcpy(&addr, root, 4);
+    if (ntohl(addr) != 8)
+    {
+        fprintf(stderr, "%s is not a MyFS container\n", filename);
+        return -EINVAL;
+    }
+    fprintf(stderr, "Upgrading %s to version %d of the format\n", filename, MYFS_VERSION);
+    QByteArray newFilename = QByteArray(filename) + ".upgrade";
+    createNewFilesystem(QString::fromLocal8Bit(newFilename.constData()));
+    fd = open(newFilename.constData(), O_RDWR);
+    if (fd < 0)
+    {
+        perror("open");
         return -EIO;
-    if (mst_mode & SF_MODE_DIRECTORY)
+    }
+    int ret_value = loadContainer();
+    if (ret_value == 0)
     {
-        addr = htonl(file);
-        if (write(fd, &addr, 4) != 4)
-            return -EIO;
-        str_buffer[0] = 1;
-        if (write(fd, str_buffer, 1) != 1)
-            return -EIO;
-        str_buffer[1] = '.';
-        if (write(fd, str_buffer + 1, 1) != 1)
-            return -EIO;
-        addr = 0; /* Temporary null address */
-        if (write(fd, &addr, 4) != 4)
-            return -EIO;
-        str_buffer[0] = 2;
-        if (write(fd, str_buffer, 1) != 1)
-            return -EIO;
-        str_buffer[0] = '.';
-        if (write(fd, str_buffer, 2) != 2)
-            return -EIO;
-        addr = 0;
-        if (write(fd, &addr, 4) != 4)
-            return -EIO;
-        /* Link to pathname */
-        ret_value = myLink(file, pathname, &addr);
-        if (ret_value != 0)
-            return ret_value;
-        /* Change reference to parent directory */
-        if (lseek(fd, file + 22, SEEK_SET) == SEEK_ERROR)
-            return -EIO;
-        addr = htonl(addr);
-        if (write(fd, &addr, 4) != 4)
-            return -EIO;
-    } else {
-        quint32 fsize = 0;
-        if (write(fd, &fsize, 4) != 4)
-            return -EIO;
-        /* Link to pathname */
-        return myLink(file, pathname);
+        QHash<quint32, quint64> links;
+        ret_value = upgradeDir(oldFd, 8, root_address, links);
+    }
+    if (ret_value == 0)
+    {
+        quint32 mtime;
+        quint16 mshort;
+        memcpy(&mtime, root + 16, 4);
+        memcpy(&mshort, root + 22, 2);
+        ret_value = myChMod(root_address, ntohs(mshort));
+        if (ret_value == 0)
+            ret_value = myUTime(root_address, ntohl(mtime));
+    }
+    /* The old container is only replaced once the new one is on the disk */
+    if (ret_value == 0)
+        ret_value = commitJournal();
+    if ((ret_value == 0) && (rename(newFilename.constData(), filename) != 0))
+        ret_value = -errno;
+    if (ret_value != 0)
+    {
+        fprintf(stderr, "Could not upgrade %s: %s\n", filename, strerror(-ret_value));
+        unlink(newFilename.constData());
+        return -EINVAL;
     }
     return 0;
 #endif /* READONLY_FS */
 }
 
-int MyFS::sRmFile(const lString &pathname, bool isDir)
-{
-#if READONLY_FS
-    Q_UNUSED(pathname);
-    Q_UNUSED(isDir);
-    return -EROFS;
-#else
-    if (fd < 0) return -EIO;
-    return myUnlink(pathname, isDir);
-#endif /* READONLY_FS */
-}
-
-int MyFS::sMvFile(const lString &pathBefore, const lString &pathAfter)
+/* Copies the entries of the directory oldDir of the container of the first version oldFd into the directory newDir.
+    The regular files with several links are put into links when they are copied, so that their other links only point to the copy. */
+int MyFS::upgradeDir(int oldFd, quint32 oldDir, quint64 newDir, QHash<quint32, quint64> &links)
 {
-#if READONLY_FS
-    Q_UNUSED(pathBefore);
-    Q_UNUSED(pathAfter);
-    return -EROFS;
-#else
-    if (fd < 0) return -EIO;
-    bool isDir;
-    quint32 file;
-    int ret_value = myUnlink(pathBefore, isDir, &file);
-    if (ret_value != 0)
-        return ret_value;
-    if (isDir)
+    /* Read all the entries first (the header of a directory index reads as a part without entries) */
+    QList<QByteArray> names;
+    QList<quint32> nodes;
+    quint32 partAddr = oldDir, pos = 16;
+    while (partAddr)
     {
-        quint32 parentAddr;
-        ret_value = myLink(file, pathAfter, &parentAddr);
-        if (ret_value != 0)
-            return ret_value;
-        /* Change reference to parent directory */
-        quint32 next_block;
-        if (lseek(fd, file + 4, SEEK_SET) == SEEK_ERROR)
+        quint32 partLength;
+        if (!readOld(oldFd, partAddr, &partLength, 4))
             return -EIO;
-        if (read(fd, &next_block, 4) != 4)
+        partLength = ntohl(partLength);
+        if (partLength < pos + 4)
             return -EIO;
-        if (lseek(fd, 8, SEEK_CUR) == SEEK_ERROR)
+        QByteArray part(partLength, 0);
+        if (!readOld(oldFd, partAddr, part.data(), partLength))
             return -EIO;
+        const char *data = part.constData();
+        quint32 addr;
         while (true)
         {
-            quint32 addr;
-            if (read(fd, &addr, 4) != 4)
+            if (pos + 4 > partLength)
                 return -EIO;
+            memcpy(&addr, data + pos, 4);
             if (!addr)
-            {
-                if (!next_block)
-                    return -EIO; /* Corrupted data */
-                next_block = ntohl(next_block) + 4;
-                if (lseek(fd, next_block, SEEK_SET) != next_block)
-                    return -EIO;
-                if (read(fd, &next_block, 4) != 4)
-                    return -EIO;
-                continue;
-            }
-            unsigned char nameLen;
-            if (read(fd, &nameLen, 1) != 1)
+                break;
+            if (pos + 5 > partLength)
                 return -EIO;
-            if (read(fd, &str_buffer, nameLen) != nameLen)
+            quint32 len = (unsigned char) data[pos + 4];
+            if (pos + 5 + len > partLength)
                 return -EIO;
-            if ((nameLen == 2) && (memcmp("..", str_buffer, 2) == 0))
+            QByteArray name(data + pos + 5, len);
+            pos += 5 + len;
+            if ((name != ".") && (name != ".."))
             {
-                if (lseek(fd, -7, SEEK_CUR) == SEEK_ERROR)
-                    return -EIO;
-                parentAddr = htonl(parentAddr);
-                if (write(fd, &parentAddr, 4) != 4)
-                    return -EIO;
-                return 0;
+                names.append(name);
+                nodes.append(ntohl(addr));
             }
         }
-    } else {
-        return myLink(file, pathAfter);
+        memcpy(&addr, data + 4, 4);
+        partAddr = ntohl(addr);
+        pos = 8;
     }
-#endif /* READONLY_FS */
+    /* The new nodes are writable until they are filled, their mode is set afterwards */
+    for (int i = 0; i < names.count(); ++i)
+    {
+        quint8 header[20];
+        if (!readOld(oldFd, nodes.at(i), header, 20))
+            return -EIO;
+        quint32 mtime, size, next;
+        quint16 nlink, mshort;
+        memcpy(&next, header + 4, 4);
+        memcpy(&mtime, header + 8, 4);
+        memcpy(&nlink, header + 12, 2);
+        memcpy(&mshort, header + 14, 2);
+        memcpy(&size, header + 16, 4);
+        mshort = ntohs(mshort);
+        const char *name = names.at(i).constData();
+        int len = names.at(i).size();
+        quint64 file;
+        int ret_value;
+        if (mshort & SF_MODE_DIRECTORY)
+        {
+            ret_value = myMkFile(newDir, name, len, SF_MODE_DIRECTORY | 0700, file);
+            if (ret_value == 0)
+                ret_value = upgradeDir(oldFd, nodes.at(i), file, links);
+        } else if (links.contains(nodes.at(i)))
+        {
+            ret_value = myHardLink(links.value(nodes.at(i)), newDir, name, len);
+            if (ret_value != 0)
+                return ret_value;
+            continue;
+        } else {
+            ret_value = myMkFile(newDir, name, len, SF_MODE_REGULARFILE | 0600, file);
+            if (ret_value == 0)
+            {
+                /* The extent index comes first in the list of parts */
+                next = ntohl(next);
+                if (mshort & MODE_INDEXED)
+                {
+                    if (!readOld(oldFd, next + 4, &next, 4))
+                        return -EIO;
+                    next = ntohl(next);
+                }
+                ret_value = upgradeData(oldFd, nodes.at(i), next, ntohl(size), file);
+            }
+            if (ntohs(nlink) > 1)
+                links.insert(nodes.at(i), file);
+        }
+        if (ret_value == 0)
+            ret_value = myChMod(file, mshort);
+        if (ret_value == 0)
+            ret_value = myUTime(file, ntohl(mtime));
+        if (ret_value != 0)
+            return ret_value;
+        checkJournal();
+    }
+    return 0;
 }
 
-int MyFS::sLink(const lString &pathFrom, const lString &pathTo)
+/* Copies the size bytes of data of the regular file oldAddr of the container of the first version oldFd, whose second part is next,
+    into the regular file file */
+int MyFS::upgradeData(int oldFd, quint32 oldAddr, quint32 next, quint32 size, quint64 file)
 {
-#if READONLY_FS
-    Q_UNUSED(pathFrom);
-    Q_UNUSED(pathTo);
-    return -EROFS;
-#else
-    if (fd < 0) return -EIO;
-    quint32 addrTo;
-    lString shallowCopy = pathTo;
-    int ret_value = getAddress(shallowCopy, addrTo);
+    /* All the space is allocated at once */
+    int ret_value = myTruncate(file, size, false);
     if (ret_value != 0)
         return ret_value;
-    if (lseek(this->fd, addrTo + 12, SEEK_SET) == SEEK_ERROR)
-        return -EIO;
-    quint16 nlink, mshort;
-    if (read(this->fd, &nlink, 2) != 2)
-        return -EIO;
-    nlink = ntohs(nlink);
-    if (nlink == 0xFFFF)
-        return -EMLINK;
-    if (read(this->fd, &mshort, 2) != 2)
-        return -EIO;
-    mshort = ntohs(mshort);
-    if (mshort & SF_MODE_DIRECTORY)
-        return -EPERM;
-    ret_value = myLink(addrTo, pathFrom);
+    quint32 myfd;
+    ret_value = myOpen(file, O_WRONLY, myfd);
     if (ret_value != 0)
         return ret_value;
-    if (lseek(this->fd, addrTo + 12, SEEK_SET) == SEEK_ERROR)
-        return -EIO;
-    nlink = htons(nlink + 1);
-    if (write(this->fd, &nlink, 2) != 2)
-        return -EIO;
-    return 0;
-#endif /* READONLY_FS */
+    QByteArray buffer(0x100000, 0);
+    quint32 partAddr = oldAddr, pos = 20, offset = 0;
+    while (offset < size)
+    {
+        quint32 partLength;
+        if ((!partAddr) || (!readOld(oldFd, partAddr, &partLength, 4)))
+        {
+            ret_value = -EIO;
+            break;
+        }
+        partLength = ntohl(partLength);
+        quint32 available = (partLength > pos) ? qMin(partLength - pos, size - offset) : 0;
+        while (available)
+        {
+            quint32 count = qMin(available, (quint32) buffer.size());
+            if (!readOld(oldFd, partAddr + pos, buffer.data(), count))
+            {
+                ret_value = -EIO;
+                break;
+            }
+            ret_value = sWrite(myfd, buffer.constData(), count, offset);
+            if (ret_value != (int) count)
+            {
+                ret_value = (ret_value < 0) ? ret_value : -EIO;
+                break;
+            }
+            ret_value = 0;
+            pos += count;
+            offset += count;
+            available -= count;
+        }
+        if (ret_value != 0)
+            break;
+        partAddr = next;
+        pos = 8;
+        if (partAddr && (offset < size))
+        {
+            if (!readOld(oldFd, partAddr + 4, &next, 4))
+            {
+                ret_value = -EIO;
+                break;
+            }
+            next = ntohl(next);
+        }
+    }
+    if (ret_value == 0)
+        ret_value = flushBuffer(file);
+    closeOpenFile(myfd);
+    return ret_value;
 }
 
-int MyFS::sChMod(const lString &pathname, quint16 mst_mode)
+/* Loads the record of the last commit into the running transaction and writes it in place again, and returns 0 on success.
+    A record with a wrong checksum was being written when the container was last used: that commit did not happen.
+    Writing a record in place more than once is harmless, so it is left in the journal. */
+int MyFS::replayJournal()
 {
-#if READONLY_FS
-    Q_UNUSED(pathname);
-    Q_UNUSED(mst_mode);
-    return -EROFS;
-#else
-    if (fd < 0) return -EIO;
-    quint32 nodeAddr;
-    quint16 mshort;
-    lString shallowCopy = pathname;
-    int ret_value = getAddress(shallowCopy, nodeAddr);
-    if (ret_value != 0)
-        return ret_value;
-    nodeAddr += 14;
-    if (lseek(fd, nodeAddr, SEEK_SET) != nodeAddr)
-        return -EIO;
-    if (read(fd, &mshort, 2) != 2)
+    if (!journal_address)
+        return 0;
+    quint64 header[JOURNAL_RECORD / 8];
+    if (mySeek(journal_address, SEEK_SET) == SEEK_ERROR)
         return -EIO;
-    mshort = ntohs(mshort);
-    mshort = (mshort & (~0x1FF)) | (mst_mode & 0x1FF);
-    if (lseek(fd, nodeAddr, SEEK_SET) != nodeAddr)
+    if (myRead(header, JOURNAL_RECORD) != JOURNAL_RECORD)
         return -EIO;
-    mshort = htons(mshort);
-    if (write(fd, &mshort, 2) != 2)
+    journal_size = header[0];
+    committedSequence = header[JOURNAL_SEQUENCE / 8];
+    journalSequence = committedSequence + 1;
+    quint64 length = header[JOURNAL_LENGTH / 8];
+    if ((!length) || (journal_size < JOURNAL_RECORD) || (length > journal_size - JOURNAL_RECORD))
+        return 0;
+    QByteArray record(JOURNAL_RECORD - JOURNAL_SEQUENCE + length, 0);
+    memcpy(record.data(), header + JOURNAL_SEQUENCE / 8, JOURNAL_CHECKSUM - JOURNAL_SEQUENCE);
+    char *data = record.data() + (JOURNAL_RECORD - JOURNAL_SEQUENCE);
+    if (myRead(data, length) != (ssize_t) length)
         return -EIO;
+    if (journalChecksum(record) != header[JOURNAL_CHECKSUM / 8])
+    {
+        fprintf(stderr, "Warning: the last commit of %s was interrupted, it is ignored\n", filename);
+        return 0;
+    }
+    quint64 pos = 0, addr, count;
+    while (pos < length)
+    {
+        if (length - pos < 16)
+            return -EIO;
+        memcpy(&addr, data + pos, 8);
+        memcpy(&count, data + pos + 8, 8);
+        pos += 16;
+        if ((count > length - pos) || (addr > containerSize) || (count > containerSize - addr))
+            return -EIO;
+        if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(data + pos, count) != (ssize_t) count)
+            return -EIO;
+        pos += count;
+    }
+#if READONLY_FS
+    /* The changes are only seen through the running transaction */
     return 0;
+#else
+    committing.swap(journal);
+    journalBytes = 0;
+    int ret_value = applyJournal();
+    if ((ret_value == 0) && (fdatasync(fd) != 0))
+        ret_value = -EIO;
+    return ret_value;
 #endif /* READONLY_FS */
 }
 
-int MyFS::sTruncate(const lString &pathname, quint64 newsize)
+/* Commits the running transaction when its record gets larger than half of the journal, or when it frees more space than there is left
+    (so that the container does not grow because of blocks waiting for the commit). nsLock has to be held for writing, between two operations. */
+void MyFS::checkJournal()
 {
-#if READONLY_FS
-    Q_UNUSED(pathname);
-    Q_UNUSED(newsize);
-    return -EROFS;
-#else
-    if (fd < 0) return -EIO;
-    if (newsize > 0xFFFFFFFFL)
-        return -EINVAL;
-    quint32 nodeAddr;
-    quint16 mshort;
-    lString shallowCopy = pathname;
-    int ret_value = getAddress(shallowCopy, nodeAddr);
-    if (ret_value != 0)
-        return ret_value;
-    if (lseek(fd, nodeAddr + 14, SEEK_SET) == SEEK_ERROR)
-        return -EIO;
-    if (read(fd, &mshort, 2) != 2)
-        return -EIO;
-    mshort = ntohs(mshort);
-    if (mshort & SF_MODE_DIRECTORY)
-        return -EISDIR;
-    if (!(mshort & S_IWUSR))
-        return -EACCES;
-    return myTruncate(nodeAddr, (quint32) newsize);
-#endif /* READONLY_FS */
+    if ((JOURNAL_RECORD + journalBytes <= journal_size / 2) && (freedSpace <= freeSpace))
+        return;
+    /* Unless a commit is being flushed (this one comes next) */
+    if (!commitLock.tryLock())
+        return;
+    if (commitJournal() != 0)
+        fprintf(stderr, "Warning: could not commit the journal of %s\n", filename);
+    commitLock.unlock();
 }
 
-int MyFS::sUTime(const lString &pathname, time_t mst_atime, time_t mst_mtime)
+/* Commits the running transaction (see myfs.h) and starts a new one, and returns 0 on success.
+    Once the file system is mounted, commitLock and nsLock (for writing) have to be held. With unlock, nsLock is released while the record
+    is flushed, so that the other operations go on meanwhile. On failure, the transaction goes on and is committed later. */
+int MyFS::commitJournal(bool unlock)
 {
-    Q_UNUSED(mst_atime);
 #if READONLY_FS
-    Q_UNUSED(pathname);
-    Q_UNUSED(mst_mtime);
-    return -EROFS;
+    Q_UNUSED(unlock);
+    return 0;
 #else
-    if (fd < 0) return -EIO;
-    quint32 nodeAddr;
-    quint32 mtime;
-    lString shallowCopy = pathname;
-    int ret_value = getAddress(shallowCopy, nodeAddr);
+    /* The callers of sSync() arriving from now on wait for the next commit */
+    journalLock.lock();
+    quint64 sequence = journalSequence++;
+    journalLock.unlock();
+    /* The data written in place and the previous commit have to be on the disk first (this also writes back the mapping) */
+    if (fdatasync(fd) != 0)
+        return -EIO;
+    int ret_value = releaseFreed();
     if (ret_value != 0)
         return ret_value;
-    nodeAddr += 8;
-    if (lseek(fd, nodeAddr, SEEK_SET) != nodeAddr)
-        return -EIO;
-    mtime = htonl(mst_mtime);
-    if (write(fd, &mtime, 4) != 4)
-        return -EIO;
+    /* Room is left for the changes of the superblock and for freeing the former journal */
+    if (JOURNAL_RECORD + journalBytes + 0x80 > journal_size)
+    {
+        ret_value = moveJournal(JOURNAL_RECORD + journalBytes + 0x80);
+        if (ret_value == 0)
+            ret_value = releaseFreed();
+        if (ret_value != 0)
+            return ret_value;
+    }
+    if (!journal.isEmpty())
+    {
+        QByteArray record(JOURNAL_RECORD - JOURNAL_SEQUENCE + journalBytes, 0);
+        char *data = record.data();
+        memcpy(data, &sequence, 8);
+        memcpy(data + JOURNAL_LENGTH - JOURNAL_SEQUENCE, &journalBytes, 8);
+        data += JOURNAL_RECORD - JOURNAL_SEQUENCE;
+        for (QMap<quint64, QByteArray>::const_iterator it = journal.constBegin(); it != journal.constEnd(); ++it)
+        {
+            quint64 addr = it.key(), count = it.value().size();
+            memcpy(data, &addr, 8);
+            memcpy(data + 8, &count, 8);
+            memcpy(data + 16, it.value().constData(), count);
+            data += 16 + count;
+        }
+        quint64 checksum = journalChecksum(record);
+        memcpy(record.data() + JOURNAL_CHECKSUM - JOURNAL_SEQUENCE, &checksum, 8);
+        if (mySeek(journal_address + JOURNAL_SEQUENCE, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWriteDirect(record.constData(), record.size()) != record.size())
+            return -EIO;
+        /* The next transaction starts while the record is flushed, the changes being committed being seen until they are written in place.
+            Nothing is allocated meanwhile, as the blocks freed by this commit are already among the free blocks. */
+        committing.swap(journal);
+        journalBytes = 0;
+        if (unlock)
+        {
+            allocLock.lock();
+            nsLock.unlock();
+        }
+        if (fdatasync(fd) != 0)
+            ret_value = -EIO;
+        if (unlock)
+        {
+            allocLock.unlock();
+            nsLock.lockForWrite();
+        }
+        /* The transaction is committed, it only has to be written in place (again after a crash) */
+        if (ret_value == 0)
+            ret_value = applyJournal();
+        if (ret_value != 0)
+        {
+            /* Its changes are put back into the running transaction, whose own changes are more recent */
+            QMap<quint64, QByteArray> running;
+            running.swap(journal);
+            for (int pass = 0; pass < 2; ++pass)
+            {
+                const QMap<quint64, QByteArray> &ranges = pass ? running : committing;
+                for (QMap<quint64, QByteArray>::const_iterator it = ranges.constBegin(); it != ranges.constEnd(); ++it)
+                {
+                    if (mySeek(it.key(), SEEK_SET) != SEEK_ERROR)
+                        myWrite(it.value().constData(), it.value().size());
+                }
+            }
+            committing.clear();
+            return ret_value;
+        }
+    }
+    committedSequence = sequence;
     return 0;
 #endif /* READONLY_FS */
 }
 
-int MyFS::sOpen(const lString &pathname, int flags, quint32 &fd)
+/* Adds the blocks freed by the running transaction to the free blocks (they can be reused once it is committed), and returns 0 on success */
+int MyFS::releaseFreed()
 {
-    if (this->fd < 0) return -EIO;
-#if READONLY_FS
-    if (flags & (O_WRONLY | O_RDWR))
-        return -EROFS;
-#endif /* READONLY_FS */
-    OpenFile myFile;
-    lString shallowCopy = pathname;
-    int ret_value = getAddress(shallowCopy, myFile.nodeAddr);
+    QMutexLocker locker(&allocLock);
+    while (!freed.isEmpty())
+    {
+        int ret_value = addFree(freed.first().first, freed.first().second);
+        if (ret_value != 0)
+            return ret_value;
+        if (freed.first().second > PART_HEADER_SIZE)
+            freedSpace -= freed.first().second - PART_HEADER_SIZE;
+        freed.removeFirst();
+    }
+    return 0;
+}
+
+/* Writes the changes being committed in place and forgets them, and returns 0 on success */
+int MyFS::applyJournal()
+{
+    for (QMap<quint64, QByteArray>::const_iterator it = committing.constBegin(); it != committing.constEnd(); ++it)
+    {
+        if (mySeek(it.key(), SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWriteDirect(it.value().constData(), it.value().size()) != it.value().size())
+            return -EIO;
+    }
+    committing.clear();
+    return 0;
+}
+
+/* Moves the journal to a new block at the end of the container, for a record of size bytes, and returns 0 on success.
+    The new block is on the disk and in the superblock before any record is written into it, the former one being freed by the transaction. */
+int MyFS::moveJournal(quint64 size)
+{
+    quint64 newSize = JOURNAL_SIZE;
+    while (newSize < 2 * size)
+        newSize *= 2;
+    quint64 addr = containerSize, oldAddr = journal_address, oldSize = journal_size;
+    if (addr + newSize > MAX_CONTAINER_SIZE)
+        return -ENOSPC;
+    int ret_value = extendContainer(newSize);
     if (ret_value != 0)
         return ret_value;
-    if (lseek(this->fd, myFile.nodeAddr, SEEK_SET) != myFile.nodeAddr)
+    quint64 header[JOURNAL_RECORD / 8] = { newSize, 0, committedSequence, 0, 0 };
+    if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
         return -EIO;
-    if (read(this->fd, &myFile.partLength, 4) != 4)
+    if (myWriteDirect(header, JOURNAL_RECORD) != JOURNAL_RECORD)
         return -EIO;
-    if (read(this->fd, &myFile.nextAddr, 4) != 4)
+    if (fdatasync(fd) != 0)
         return -EIO;
-    if (lseek(this->fd, 6, SEEK_CUR) == SEEK_ERROR)
+    if (mySeek(SB_JOURNAL, SEEK_SET) == SEEK_ERROR)
         return -EIO;
-    quint16 mshort;
-    if (read(this->fd, &mshort, 2) != 2)
+    if (myWriteDirect(&addr, 8) != 8)
         return -EIO;
-    mshort = ntohs(mshort);
-    if (mshort & SF_MODE_DIRECTORY)
-        return -EISDIR;
-    myFile.flags = (flags & O_NOATIME) ? OPEN_FILE_FLAGS_NOATIME : 0;
-    if (!(flags & O_WRONLY))
-    {
-        myFile.flags |= OPEN_FILE_FLAGS_PREAD;
-        if (!(mshort & S_IRUSR))
-            return -EACCES;
-    }
-    if (flags & (O_WRONLY | O_RDWR))
-    {
-        myFile.flags |= OPEN_FILE_FLAGS_PWRITE;
-        if (!(mshort & S_IWUSR))
-            return -EACCES;
-    } else {
-        if (flags & O_TRUNC)
-            return -EACCES;
-    }
-    if (flags & O_TRUNC)
-    {
-        myFile.fileLength = 0;
-        if (write(this->fd, &myFile.fileLength, 4) != 4)
-            return -EIO;
-    } else {
-        if (read(this->fd, &myFile.fileLength, 4) != 4)
-            return -EIO;
-        myFile.fileLength = ntohl(myFile.fileLength);
-    }
-    fd = 0;
-    while ((fd < (quint32) openFiles.count()) && openFiles.at(fd).nodeAddr) ++fd;
-    myFile.partLength = ntohl(myFile.partLength);
-    myFile.nextAddr = ntohl(myFile.nextAddr);
-    myFile.partAddr = myFile.nodeAddr;
-    myFile.partOffset = 0;
-    myFile.isRegular = true;
-    if ((flags & O_APPEND) && !(flags & O_TRUNC))
-    {
-        quint32 available = myFile.partLength - 20;
-        while (available <= (myFile.fileLength - myFile.partOffset))
-        {
-            myFile.partOffset += available;
-            if (lseek(this->fd, myFile.nextAddr, SEEK_SET) != myFile.nextAddr)
-                return -EIO;
-            myFile.partAddr = myFile.nextAddr;
-            if (read(this->fd, &myFile.partLength, 4) != 4)
-                return -EIO;
-            if (read(this->fd, &myFile.nextAddr, 4) != 4)
-                return -EIO;
-            myFile.partLength = ntohl(myFile.partLength);
-            myFile.nextAddr = ntohl(myFile.nextAddr);
-            available = myFile.partLength - 8;
-        }
-        myFile.currentAddr = myFile.partAddr + (myFile.partOffset ? 8 : 20) + (myFile.fileLength - myFile.partOffset);
-    } else {
-        myFile.currentAddr = myFile.nodeAddr + 20;
-    }
-    if (fd == (quint32) openFiles.count())
+    if (fdatasync(fd) != 0)
+        return -EIO;
+    journal_address = addr;
+    journal_size = newSize;
+    /* A crash before the next commit only loses the former journal */
+    if (mySeek(SB_JOURNAL, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&addr, 8) != 8)
+        return -EIO;
+    if (myWrite(&containerSize, 8) != 8)
+        return -EIO;
+    if (oldAddr)
     {
-        if (fd > MAX_OPEN_FILES)
-            return -ENFILE;
-        openFiles.append(myFile);
-    } else {
-        openFiles[fd] = myFile;
+        freed.append(qMakePair(oldAddr, oldSize));
+        freedSpace += oldSize - PART_HEADER_SIZE;
     }
     return 0;
 }
 
-int MyFS::sRead(quint32 fd, void *buf, quint32 count, quint64 offset)
+/* Checksum of a record of the journal (FNV-1a) */
+quint64 MyFS::journalChecksum(const QByteArray &record)
 {
-    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || (!openFiles.at(fd).isRegular))
-        return -EBADF;
-    if (this->fd < 0) return -EIO;
-    OpenFile &myFile = openFiles[fd];
-    if (!(myFile.flags & OPEN_FILE_FLAGS_PREAD))
-        return -EBADF;
-    if (offset > myFile.fileLength)
-        return -EOVERFLOW;
-    if (offset + count > myFile.fileLength)
-        count = myFile.fileLength - offset;
-    if (!setPosition(myFile, offset))
-        return -EIO;
-    quint32 toread = qMin((quint32) count, myFile.partLength - (myFile.currentAddr - myFile.partAddr));
-    if (read(this->fd, buf, toread) != toread)
-        return -EIO;
-    if (toread == (quint32) count)
+    quint64 hash = 0xCBF29CE484222325ULL;
+    const quint8 *data = (const quint8*) record.constData();
+    for (int i = 0; i < record.size(); ++i)
     {
-        myFile.currentAddr += count;
-        return count;
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
     }
-    buf = (void*) (((quint8*) buf) + toread);
-    int original_count = count;
-    count -= toread;
-    quint32 available = myFile.partLength - (myFile.partOffset ? 8 : 20);
-    while (true)
+    return hash;
+}
+
+/* Forgets the changes of the count bytes at address addr, which are not metadata anymore (nsLock has to be held for writing) */
+void MyFS::dropJournal(quint64 addr, quint64 count)
+{
+    for (int pass = 0; pass < 2; ++pass)
     {
-        myFile.partOffset += available;
-        if (lseek(this->fd, myFile.nextAddr, SEEK_SET) != myFile.nextAddr)
-            return -EIO;
-        myFile.partAddr = myFile.nextAddr;
-        if (read(this->fd, &myFile.partLength, 4) != 4)
-            return -EIO;
-        if (read(this->fd, &myFile.nextAddr, 4) != 4)
-            return -EIO;
-        myFile.partLength = ntohl(myFile.partLength);
-        myFile.nextAddr = ntohl(myFile.nextAddr);
-        available = myFile.partLength - 8;
-        toread = qMin((quint32) count, available);
-        if (read(this->fd, buf, toread) != toread)
-            return -EIO;
-        if (toread == (quint32) count)
+        QMap<quint64, QByteArray> &ranges = pass ? committing : journal;
+        QMap<quint64, QByteArray>::iterator it = ranges.upperBound(addr);
+        if (it != ranges.begin())
         {
-            myFile.currentAddr = myFile.partAddr + 8 + count;
-            return original_count;
+            --it;
+            if (it.key() + it.value().size() <= addr)
+                ++it;
+        }
+        QList<QPair<quint64, QByteArray> > kept;
+        while ((it != ranges.end()) && (it.key() < addr + count))
+        {
+            quint64 start = it.key(), end = start + it.value().size();
+            /* The bytes before and after are kept */
+            if (start < addr)
+                kept.append(qMakePair(start, it.value().left(addr - start)));
+            if (end > addr + count)
+                kept.append(qMakePair(addr + count, it.value().mid(addr + count - start)));
+            if (!pass)
+                journalBytes -= 16 + it.value().size();
+            it = ranges.erase(it);
+        }
+        for (int i = 0; i < kept.count(); ++i)
+        {
+            ranges.insert(kept.at(i).first, kept.at(i).second);
+            if (!pass)
+                journalBytes += 16 + kept.at(i).second.size();
         }
-        buf = (void*) (((quint8*) buf) + toread);
-        count -= toread;
-        available = myFile.partLength - 8;
     }
 }
 
-int MyFS::sWrite(quint32 fd, const void *buf, quint32 count, quint64 offset)
+/* Copies into buf the bytes of ranges (changes of a transaction) among the count bytes at address addr */
+void MyFS::readJournal(const QMap<quint64, QByteArray> &ranges, quint64 addr, quint8 *buf, quint64 count)
 {
-    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || (!openFiles.at(fd).isRegular))
-        return -EBADF;
-    if (this->fd < 0) return -EIO;
-    OpenFile &myFile = openFiles[fd];
-    if (!(myFile.flags & OPEN_FILE_FLAGS_PWRITE))
-        return -EBADF;
-    if (offset + count > myFile.fileLength)
+    QMap<quint64, QByteArray>::const_iterator it = ranges.upperBound(addr);
+    if (it != ranges.constBegin())
     {
-        if (offset + count > 0xFFFFFFFFL)
-            return -EFBIG;
-        int ret_value = myTruncate(myFile.nodeAddr, (quint32) (offset + count));
-        if (ret_value != 0)
-            return ret_value;
+        --it;
+        if (it.key() + it.value().size() <= addr)
+            ++it;
     }
-    if (!setPosition(myFile, offset))
-        return -EIO;
-    quint32 towrite = qMin((quint32) count, myFile.partLength - (myFile.currentAddr - myFile.partAddr));
-    if (write(this->fd, buf, towrite) != towrite)
-        return -EIO;
-    myFile.flags |= OPEN_FILE_FLAGS_MODIFIED;
-    if (towrite == (quint32) count)
+    for (; (it != ranges.constEnd()) && (it.key() < addr + count); ++it)
     {
-        myFile.currentAddr += count;
-        return count;
+        quint64 from = qMax(addr, it.key()), to = qMin(addr + count, it.key() + it.value().size());
+        memcpy(buf + (from - addr), it.value().constData() + (from - it.key()), to - from);
     }
-    quint8 *mbuf = (quint8*) buf;
-    mbuf += towrite;
-    int original_count = count;
-    count -= towrite;
-    quint32 available = myFile.partLength - (myFile.partOffset ? 8 : 20);
-    while (true)
+}
+
+/* Commits the running transaction, unless a commit started since the call covers it, and returns 0 on success (no lock has to be held).
+    Group commit: a commit already started may miss the changes of the caller, but all the callers arriving meanwhile are served by the next one. */
+int MyFS::groupCommit()
+{
+    journalLock.lock();
+    quint64 sequence = journalSequence;
+    journalLock.unlock();
+    QMutexLocker commitLocker(&commitLock);
+    if (committedSequence >= sequence)
+        return 0;
+    QWriteLocker locker(&nsLock);
+    if (fd < 0) return -EIO;
+    return commitJournal(true);
+}
+
+/* Starts the writeback of the data written through the open file fd and commits (see groupCommit()), and returns 0 on success */
+int MyFS::syncFile(quint32 fd)
+{
     {
-        myFile.partOffset += available;
-        if (lseek(this->fd, myFile.nextAddr, SEEK_SET) != myFile.nextAddr)
-            return -EIO;
-        myFile.partAddr = myFile.nextAddr;
-        if (read(this->fd, &myFile.partLength, 4) != 4)
-            return -EIO;
-        if (read(this->fd, &myFile.nextAddr, 4) != 4)
-            return -EIO;
-        myFile.partLength = ntohl(myFile.partLength);
-        myFile.nextAddr = ntohl(myFile.nextAddr);
-        available = myFile.partLength - 8;
-        towrite = qMin((quint32) count, available);
-        if (write(this->fd, mbuf, towrite) != towrite)
-            return -EIO;
-        if (towrite == (quint32) count)
+        QReadLocker locker(&nsLock);
+        OpenFile file;
         {
-            myFile.currentAddr = myFile.partAddr + 8 + count;
-            return original_count;
+            QMutexLocker filesLocker(&filesLock);
+            if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || (!openFiles.at(fd).isRegular))
+                return -EBADF;
+            file = openFiles.at(fd);
+            /* The range is forgotten even if the commit fails, as any commit flushes the whole container */
+            openFiles[fd].dirtyStart = openFiles[fd].dirtyEnd = 0;
         }
-        mbuf += towrite;
-        count -= towrite;
-        available = myFile.partLength - 8;
+        if (this->fd < 0) return -EIO;
+        startWriteback(file);
     }
+    return groupCommit();
 }
 
-int MyFS::sSync(quint32 fd)
+/* Starts writing back the data written through file since its last sync, without waiting (nsLock has to be held) */
+void MyFS::startWriteback(OpenFile &file)
 {
-    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || (!openFiles.at(fd).isRegular))
-        return -EBADF;
-    return 0;
+    if ((file.dirtyStart >= file.dirtyEnd) || !loadPartMap(file))
+        return;
+    const PartMap *map = file.parts;
+    for (int i = findPart(map, file.dirtyStart); (i < map->addrs.count()) && (map->offsets.at(i) < file.dirtyEnd); ++i)
+    {
+        if (map->holes.at(i))
+            continue;
+        quint64 dataAddr = map->addrs.at(i) + (i ? PART_HEADER_SIZE : NODE_DATA);
+        quint64 from = qMax(file.dirtyStart, map->offsets.at(i));
+        quint64 to = qMin(file.dirtyEnd, map->offsets.at(i) + map->lengths.at(i) - (i ? PART_HEADER_SIZE : NODE_DATA));
+        /* Only a hint, the commit flushes the container anyway */
+        if (from < to)
+            sync_file_range(fd, dataAddr + (from - map->offsets.at(i)), to - from, SYNC_FILE_RANGE_WRITE);
+    }
 }
 
-int MyFS::sClose(quint32 fd)
+/* Starts the flush thread, once the container is loaded */
+void MyFS::startFlusher()
 {
-    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || (!openFiles.at(fd).isRegular))
-        return -EBADF;
-    OpenFile *file = &openFiles[fd];
-    if (file->flags & OPEN_FILE_FLAGS_MODIFIED)
+    QMutexLocker locker(&flushLock);
+    flusherStop = false;
+    if (pthread_create(&flusher, NULL, flushThread, this) != 0)
     {
-        if (this->fd < 0) return -EIO;
-        if (lseek(this->fd, file->nodeAddr + 8, SEEK_SET) == SEEK_ERROR)
-            return -EIO;
-        quint32 mytime = htonl(time(0));
-        if (write(this->fd, &mytime, 4) != 4)
-            return -EIO;
+        perror("pthread_create");
+        return;
     }
-    file->nodeAddr = 0;
-    while ((!openFiles.isEmpty()) && (!openFiles.last().nodeAddr))
-        openFiles.removeLast();
-    return 0;
+    flusherRunning = true;
 }
 
-int MyFS::sOpenDir(const lString &pathname, quint32 &fd)
+/* Stops the flush thread, before the container is unloaded */
+void MyFS::stopFlusher()
 {
-    if (this->fd < 0) return -EIO;
-    OpenFile myDir;
-    lString shallowCopy = pathname;
-    int ret_value = getAddress(shallowCopy, myDir.nodeAddr);
-    if (ret_value != 0)
-        return ret_value;
-    if (lseek(this->fd, myDir.nodeAddr + 4, SEEK_SET) == SEEK_ERROR)
-        return -EIO;
-    if (read(this->fd, &myDir.nextAddr, 4) != 4)
-        return -EIO;
-    if (lseek(this->fd, 6, SEEK_CUR) == SEEK_ERROR)
-        return -EIO;
-    quint16 mshort;
-    if (read(this->fd, &mshort, 2) != 2)
-        return -EIO;
-    mshort = ntohs(mshort);
-    if (mshort & SF_MODE_REGULARFILE)
-        return -ENOTDIR;
-    if (!(mshort & S_IRUSR))
-        return -EACCES;
-    fd = 0;
-    while ((fd < (quint32) openFiles.count()) && openFiles.at(fd).nodeAddr) ++fd;
-    myDir.currentAddr = myDir.nodeAddr + 16;
-    myDir.nextAddr = ntohl(myDir.nextAddr);
-    myDir.isRegular = false;
-    if (fd == (quint32) openFiles.count())
-    {
-        if (fd > MAX_OPEN_FILES)
-            return -ENFILE;
-        openFiles.append(myDir);
-    } else {
-        openFiles[fd] = myDir;
-    }
-    return 0;
+    flushLock.lock();
+    bool running = flusherRunning;
+    flusherRunning = false;
+    flusherStop = true;
+    flushCondition.wakeAll();
+    flushLock.unlock();
+    if (running)
+        pthread_join(flusher, NULL);
 }
 
-int MyFS::sReadDir(quint32 fd, char *&name)
+void *MyFS::flushThread(void *arg)
 {
-    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || openFiles.at(fd).isRegular)
-        return -EBADF;
-    if (this->fd < 0) return -EIO;
-    OpenFile *file = &openFiles[fd];
-    if (lseek(this->fd, file->currentAddr, SEEK_SET) != file->currentAddr)
-        return -EIO;
-    quint32 addr;
-    while (true)
+    ((MyFS*) arg)->flushLoop();
+    return NULL;
+}
+
+/* Commits the running transaction every flushInterval milliseconds in the periodic mode, if anything changed, until stopFlusher() */
+void MyFS::flushLoop()
+{
+    QMutexLocker locker(&flushLock);
+    while (!flusherStop)
     {
-        if (read(this->fd, &addr, 4) != 4)
-            return -EIO;
-        if (addr == 0)
+        if (durabilityMode != DURABILITY_PERIODIC)
         {
-            if (!file->nextAddr)
+            flushCondition.wait(&flushLock);
+            continue;
+        }
+        /* The interval starts again when the mode changes */
+        if (flushCondition.wait(&flushLock, flushInterval))
+            continue;
+        locker.unlock();
+        {
+            QMutexLocker commitLocker(&commitLock);
+            QWriteLocker nsLocker(&nsLock);
+            if (flushBuffers() != 0)
+                fprintf(stderr, "Warning: could not write the buffered data into %s\n", filename);
+            if (!journal.isEmpty() || unsynced)
             {
-                name = NULL;
-                return 0;
+                if (unsynced)
+                    --unsynced;
+                if (commitJournal(true) != 0)
+                    fprintf(stderr, "Warning: could not commit the journal of %s\n", filename);
             }
-            file->nextAddr += 4;
-            if (lseek(this->fd, file->nextAddr, SEEK_SET) != file->nextAddr)
-                goto ioerror;
-            file->currentAddr = file->nextAddr + 4;
-            if (read(this->fd, &file->nextAddr, 4) != 4)
-                goto ioerror;
-            file->nextAddr = ntohl(file->nextAddr);
-            continue;
         }
-        unsigned char sLen;
-        if (read(this->fd, &sLen, 1) != 1)
-            return -EIO;
-        if (read(this->fd, str_buffer, sLen) != sLen)
-            return -EIO;
-        file->currentAddr += 5;
-        file->currentAddr += sLen;
-        str_buffer[sLen] = 0;
-        name = str_buffer;
-        return 0;
+        locker.relock();
     }
-ioerror:
-    file->nodeAddr = 0;
-    return -EIO;
 }
 
-int MyFS::sCloseDir(quint32 fd)
+void MyFS::sDestroy()
 {
-    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || openFiles.at(fd).isRegular)
-        return -EBADF;
-    OpenFile *file = &openFiles[fd];
-    file->nodeAddr = 0;
-    while ((!openFiles.isEmpty()) && (!openFiles.last().nodeAddr))
-        openFiles.removeLast();
+    stopFlusher();
+    if (fd >= 0)
+    {
+        QMutexLocker commitLocker(&commitLock);
+        QWriteLocker locker(&nsLock);
+        if (flushBuffers() != 0)
+            fprintf(stderr, "Warning: could not write the buffered data into %s\n", filename);
+        if (commitJournal() != 0)
+            fprintf(stderr, "Warning: could not commit the journal of %s\n", filename);
+    }
+    for (int i = 0; i < openFiles.count(); ++i)
+    {
+        if (openFiles.at(i).parts)
+            releasePartMap(openFiles.at(i).parts);
+    }
+    openFiles.clear();
+    dentries.clear();
+    inodes.clear();
+    freeByAddr.clear();
+    freeBySize.clear();
+    freed.clear();
+    freedSpace = 0;
+    journal.clear();
+    journalBytes = 0;
+    committing.clear();
+    unsynced = 0;
+    unmap();
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+}
+
+int MyFS::sGetSize(quint64 &size, quint64 &free)
+{
+    if (fd < 0) return -EIO;
+    QReadLocker locker(&nsLock);
+    size = containerSize;
+    QMutexLocker allocLocker(&allocLock);
+    free = freeSpace;
     return 0;
 }
 
-int MyFS::sAccess(const lString &pathname, quint8 mode)
+int MyFS::sGetAttr(const lString &pathname, sAttr &attr)
 {
     if (fd < 0) return -EIO;
-    quint32 addr;
+    QReadLocker locker(&nsLock);
+    quint64 addr;
     lString shallowCopy = pathname;
     int ret_value = getAddress(shallowCopy, addr);
     if (ret_value != 0)
         return ret_value;
-    if (mode == F_OK)
-        return 0;
+    return myGetAttr(addr, attr);
+}
+
+int MyFS::sMkFile(const lString &pathname, quint16 mst_mode)
+{
 #if READONLY_FS
-    if (mode & W_OK)
-        return -EROFS;
+    Q_UNUSED(pathname);
+    Q_UNUSED(mst_mode);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    lString shallowCopy = pathname;
+    const char *name;
+    int len;
+    int ret_value = splitPath(shallowCopy, name, len);
+    if (ret_value != 0)
+        return ret_value;
+    quint64 dirAddr, file;
+    ret_value = getAddress(shallowCopy, dirAddr);
+    if (ret_value != 0)
+        return ret_value;
+    return myMkFile(dirAddr, name, len, mst_mode, file);
 #endif /* READONLY_FS */
-    if (lseek(fd, addr + 14, SEEK_SET) == SEEK_ERROR)
-        return -EIO;
-    quint16 mshort;
-    if (read(fd, &mshort, 2) != 2)
-        return -EIO;
-    mshort = ntohs(mshort);
-    if ((mode & R_OK) && (!(mshort & S_IRUSR)))
-        return -EACCES;
-    if ((mode & W_OK) && (!(mshort & S_IWUSR)))
-        return -EACCES;
-    if ((mode & X_OK) && (!(mshort & S_IXUSR)))
-        return -EACCES;
-    return 0;
 }
 
-int MyFS::sFTruncate(quint32 fd, quint64 newsize)
+int MyFS::sRmFile(const lString &pathname, bool isDir)
 {
 #if READONLY_FS
-    Q_UNUSED(fd);
-    Q_UNUSED(newsize);
+    Q_UNUSED(pathname);
+    Q_UNUSED(isDir);
     return -EROFS;
 #else
-    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || (!openFiles.at(fd).isRegular))
-        return -EBADF;
-    if (this->fd < 0) return -EIO;
-    if (newsize > 0xFFFFFFFFL)
-        return -EINVAL;
-    OpenFile *file = &openFiles[fd];
-    file->fileLength = (quint32) newsize;
-    return myTruncate(file->nodeAddr, file->fileLength);
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    lString shallowCopy = pathname;
+    const char *name;
+    int len;
+    int ret_value = splitPath(shallowCopy, name, len);
+    if (ret_value != 0)
+        return ret_value;
+    quint64 dirAddr;
+    ret_value = getAddress(shallowCopy, dirAddr);
+    if (ret_value != 0)
+        return ret_value;
+    return myUnlink(dirAddr, name, len, isDir);
 #endif /* READONLY_FS */
 }
 
-int MyFS::sFGetAttr(quint32 fd, sAttr &attr)
+int MyFS::sMvFile(const lString &pathBefore, const lString &pathAfter)
 {
-    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr))
-        return -EBADF;
-    if (this->fd < 0) return -EIO;
-    return myGetAttr(openFiles.at(fd).nodeAddr, attr);
+#if READONLY_FS
+    Q_UNUSED(pathBefore);
+    Q_UNUSED(pathAfter);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    lString copyBefore = pathBefore, copyAfter = pathAfter;
+    const char *nameBefore, *nameAfter;
+    int lenBefore, lenAfter;
+    int ret_value = splitPath(copyBefore, nameBefore, lenBefore);
+    if (ret_value != 0)
+        return ret_value;
+    ret_value = splitPath(copyAfter, nameAfter, lenAfter);
+    if (ret_value != 0)
+        return ret_value;
+    quint64 dirBefore, dirAfter;
+    ret_value = getAddress(copyBefore, dirBefore);
+    if (ret_value != 0)
+        return ret_value;
+    ret_value = getAddress(copyAfter, dirAfter);
+    if (ret_value != 0)
+        return ret_value;
+    return myMove(dirBefore, nameBefore, lenBefore, dirAfter, nameAfter, lenAfter);
+#endif /* READONLY_FS */
 }
 
-/* Links the regular file pointed by file to pathname, WITHOUT updating the nlink field */
-int MyFS::myLink(quint32 file, const lString &pathname, quint32 *parentAddr)
+int MyFS::sLink(const lString &pathFrom, const lString &pathTo)
 {
-    /* Get the last part of the path */
+#if READONLY_FS
+    Q_UNUSED(pathFrom);
+    Q_UNUSED(pathTo);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    quint64 addrTo;
+    lString shallowCopy = pathTo;
+    int ret_value = getAddress(shallowCopy, addrTo);
+    if (ret_value != 0)
+        return ret_value;
+    shallowCopy = pathFrom;
+    const char *name;
+    int len;
+    ret_value = splitPath(shallowCopy, name, len);
+    if (ret_value != 0)
+        return ret_value;
+    quint64 dirAddr;
+    ret_value = getAddress(shallowCopy, dirAddr);
+    if (ret_value != 0)
+        return ret_value;
+    return myHardLink(addrTo, dirAddr, name, len);
+#endif /* READONLY_FS */
+}
+
+int MyFS::sChMod(const lString &pathname, quint16 mst_mode)
+{
+#if READONLY_FS
+    Q_UNUSED(pathname);
+    Q_UNUSED(mst_mode);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    quint64 nodeAddr;
     lString shallowCopy = pathname;
-    if (shallowCopy.str_len == 0)
-        return -ENOENT;
-    while ((shallowCopy.str_len > 0) && (shallowCopy.str_value[shallowCopy.str_len - 1] == '/'))
-        --shallowCopy.str_len;
-    if (shallowCopy.str_len == 0)
-        return -EEXIST;
-    int len = shallowCopy.str_len;
-    while (shallowCopy.str_value[shallowCopy.str_len - 1] != '/')
-        --shallowCopy.str_len;
-    len -= shallowCopy.str_len;
-    int start = shallowCopy.str_len;
-    if (len > 0xFF)
-        return -ENAMETOOLONG;
-    /* Get the address of the parent directory */
-    quint32 dirAddr;
-    int ret_value = getAddress(shallowCopy, dirAddr);
+    int ret_value = getAddress(shallowCopy, nodeAddr);
     if (ret_value != 0)
         return ret_value;
-    /* Check whether or not this is indeed a directory */
-    if (lseek(fd, dirAddr, SEEK_SET) != dirAddr)
-        return -EIO;
-    quint32 block_size;
-    if (read(fd, &block_size, 4) != 4)
-        return -EIO;
-    block_size = ntohl(block_size);
-    quint32 next_block;
-    if (read(fd, &next_block, 4) != 4)
-        return -EIO;
-    if (read(fd, str_buffer, 4) != 4)
-        return -EIO;
-    quint16 mshort, nlink;
-    if (read(fd, &nlink, 2) != 2)
-        return -EIO;
-    if (read(fd, &mshort, 2) != 2)
-        return -EIO;
-    mshort = ntohs(mshort);
-    if (mshort & SF_MODE_REGULARFILE)
-        return -ENOTDIR;
-    /* Check the permissions */
-    if (!(mshort & S_IWUSR))
-        return -EACCES;
-    /* Modify the last modification time */
-    if (lseek(fd, dirAddr + 8, SEEK_SET) == SEEK_ERROR)
+    return myChMod(nodeAddr, mst_mode);
+#endif /* READONLY_FS */
+}
+
+int MyFS::sTruncate(const lString &pathname, quint64 newsize)
+{
+#if READONLY_FS
+    Q_UNUSED(pathname);
+    Q_UNUSED(newsize);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    quint64 nodeAddr;
+    lString shallowCopy = pathname;
+    int ret_value = getAddress(shallowCopy, nodeAddr);
+    if (ret_value != 0)
+        return ret_value;
+    return mySetSize(nodeAddr, newsize);
+#endif /* READONLY_FS */
+}
+
+int MyFS::sUTime(const lString &pathname, time_t mst_atime, time_t mst_mtime)
+{
+    Q_UNUSED(mst_atime);
+#if READONLY_FS
+    Q_UNUSED(pathname);
+    Q_UNUSED(mst_mtime);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    quint64 nodeAddr;
+    lString shallowCopy = pathname;
+    int ret_value = getAddress(shallowCopy, nodeAddr);
+    if (ret_value != 0)
+        return ret_value;
+    return myUTime(nodeAddr, mst_mtime);
+#endif /* READONLY_FS */
+}
+
+int MyFS::sOpen(const lString &pathname, int flags, quint32 &fd)
+{
+    if (this->fd < 0) return -EIO;
+    /* Truncating the file changes the container */
+    if (flags & O_TRUNC)
+    {
+        nsLock.lockForWrite();
+        checkJournal();
+    } else {
+        nsLock.lockForRead();
+    }
+    quint64 nodeAddr;
+    lString shallowCopy = pathname;
+    int ret_value = getAddress(shallowCopy, nodeAddr);
+    if (ret_value == 0)
+        ret_value = myOpen(nodeAddr, flags, fd);
+    nsLock.unlock();
+    return ret_value;
+}
+
+int MyFS::sRead(quint32 fd, void *buf, quint32 count, quint64 offset)
+{
+    QReadLocker locker(&nsLock);
+    /* Other threads may use the same file meanwhile, so a copy of it is used */
+    OpenFile myFile;
+    if (!getOpenFile(fd, true, myFile))
+        return -EBADF;
+    if (this->fd < 0) return -EIO;
+    if (!myFile.parts->buffered.isEmpty())
+    {
+        /* The buffered data has to be in the container first */
+        locker.unlock();
+        int ret_value = flushFile(fd);
+        if (ret_value != 0)
+            return ret_value;
+        locker.relock();
+        if (!getOpenFile(fd, true, myFile))
+            return -EBADF;
+    }
+    if (!(myFile.flags & OPEN_FILE_FLAGS_PREAD))
+        return -EBADF;
+    if (offset > myFile.fileLength)
+        return -EOVERFLOW;
+    if (offset + count > myFile.fileLength)
+        count = (quint32) (myFile.fileLength - offset);
+    if (!setPosition(myFile, offset))
         return -EIO;
-    quint32 linkDate = htonl(time(0));
-    if (write(fd, &linkDate, 4) != 4)
+    quint32 toread = (quint32) qMin((quint64) count, myFile.partLength - (myFile.currentAddr - myFile.partAddr));
+    if (myFile.partHole)
+        memset(buf, 0, toread);
+    else if (myRead(buf, toread) != toread)
         return -EIO;
-    /* Add new entry */
-    quint32 currentPart = dirAddr;
-    quint32 addr;
-    if (parentAddr)
+    if (toread == (quint32) count)
     {
-        *parentAddr = dirAddr;
-        addr = dirAddr + 12;
-        if (lseek(fd, addr, SEEK_SET) != addr)
-            return -EIO;
-        if (nlink == 0xFFFF)
-            return -EMLINK;
-        nlink = htons(ntohs(nlink) + 1);
-        if (write(fd, &nlink, 2) != 2)
-            return -EIO;
-        if (read(fd, &mshort, 2) != 2)
-            return -EIO;
-    } else {
-        addr = dirAddr + 16;
-        if (lseek(fd, addr, SEEK_SET) != addr)
-            return -EIO;
+        myFile.currentAddr += count;
+        putOpenFile(fd, myFile);
+        return count;
     }
+    buf = (void*) (((quint8*) buf) + toread);
+    int original_count = count;
+    count -= toread;
     while (true)
     {
-        if (read(fd, &addr, 4) != 4)
+        if (!nextPart(myFile))
             return -EIO;
-        if (addr == 0)
+        toread = (quint32) qMin((quint64) count, myFile.partLength - PART_HEADER_SIZE);
+        if (myFile.partHole)
+            memset(buf, 0, toread);
+        else if (myRead(buf, toread) != toread)
+            return -EIO;
+        if (toread == (quint32) count)
         {
-            off_t currentPos = lseek(fd, 0, SEEK_CUR);
-            if (currentPos == SEEK_ERROR)
-                return -EIO;
-            quint32 used = (quint32) currentPos;
-            used -= currentPart;
-            if (block_size - used >= (quint32) len + 5)
-            {
-                /* Add entry to the existing list */
-                currentPos -= 4;
-                if (lseek(fd, currentPos, SEEK_SET) != currentPos)
-                    return -EIO;
-                file = htonl(file);
-                if (write(fd, &file, 4) != 4)
-                    return -EIO;
-                unsigned char sLen = (unsigned char) len;
-                if (write(fd, &sLen, 1) != 1)
-                    return -EIO;
-                if (write(fd, pathname.str_value + start, len) != len)
-                    return -EIO;
-                if (write(fd, &addr, 4) != 4)
-                    return -EIO;
-            } else if (next_block != 0)
-            {
-                /* Go to the next part */
-                next_block = ntohl(next_block);
-                if (lseek(fd, next_block, SEEK_SET) != next_block)
-                    return -EIO;
-                currentPart = next_block;
-                if (read(fd, &block_size, 4) != 4)
-                    return -EIO;
-                block_size = ntohl(block_size);
-                if (read(fd, &next_block, 4) != 4)
-                    return -EIO;
-                continue;
-            } else {
-                /* Create a new part to add the entry */
-                ret_value = getBlock(DIR_BLOCK_SIZE, next_block);
-                if (ret_value != 0)
-                {
-                    freeBlock(file);
-                    return ret_value;
-                }
-                file = htonl(file);
-                if (write(fd, &file, 4) != 4)
-                    return -EIO;
-                unsigned char sLen = (unsigned char) len;
-                if (write(fd, &sLen, 1) != 1)
-                    return -EIO;
-                if (write(fd, pathname.str_value + start, len) != len)
-                    return -EIO;
-                if (write(fd, &addr, 4) != 4)
-                    return -EIO;
-                currentPart += 4;
-                if (lseek(fd, currentPart, SEEK_SET) != currentPart)
-                    return -EIO;
-                next_block = htonl(next_block);
-                if (write(fd, &next_block, 4) != 4)
-                    return -EIO;
-            }
-            return 0;
-        } else {
-            unsigned char sLen;
-            if (read(fd, &sLen, 1) != 1)
-                return -EIO;
-            if (read(fd, str_buffer, sLen) != sLen)
-                return -EIO;
-            if ((sLen == len) && (memcmp(str_buffer, pathname.str_value + start, len) == 0))
-            {
-                freeBlock(file);
-                return -EEXIST;
-            }
+            myFile.currentAddr = myFile.partAddr + PART_HEADER_SIZE + count;
+            putOpenFile(fd, myFile);
+            return original_count;
         }
+        buf = (void*) (((quint8*) buf) + toread);
+        count -= toread;
     }
 }
 
-int MyFS::myUnlink(const lString &pathname, bool &isDir, quint32 *nodeAddr)
+int MyFS::sWrite(quint32 fd, const void *buf, quint32 count, quint64 offset)
 {
-    /* Get the last part of the path */
-    lString shallowCopy = pathname;
-    if (shallowCopy.str_len == 0)
-        return -ENOENT;
-    while ((shallowCopy.str_len > 0) && (shallowCopy.str_value[shallowCopy.str_len - 1] == '/'))
-        --shallowCopy.str_len;
-    if (shallowCopy.str_len == 0)
-        return -EEXIST;
-    int len = shallowCopy.str_len;
-    while (shallowCopy.str_value[shallowCopy.str_len - 1] != '/')
-        --shallowCopy.str_len;
-    len -= shallowCopy.str_len;
-    int start = shallowCopy.str_len;
-    /* Get the address of the parent directory */
-    quint32 dirAddr, beforeAddr = 0, currentAddr;
-    int ret_value = getAddress(shallowCopy, dirAddr);
+    QWriteLocker locker(&nsLock);
+    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || (!openFiles.at(fd).isRegular))
+        return -EBADF;
+    if (this->fd < 0) return -EIO;
+    checkJournal();
+    OpenFile &myFile = openFiles[fd];
+    if (!(myFile.flags & OPEN_FILE_FLAGS_PWRITE))
+        return -EBADF;
+    if (offset + count > MAX_CONTAINER_SIZE)
+        return -EFBIG;
+    markWritten(myFile, offset, count);
+    if (count < BUFFERED_WRITE_SIZE)
+    {
+        int ret_value = bufferWrite(myFile, buf, count, offset);
+        if (ret_value != 0)
+            return ret_value;
+        return count;
+    }
+    /* The buffered data is older */
+    int ret_value = flushBuffer(myFile.nodeAddr);
     if (ret_value != 0)
         return ret_value;
-    /* Check whether or not this is indeed a directory */
-    currentAddr = dirAddr + 4;
-    if (lseek(fd, currentAddr, SEEK_SET) != currentAddr)
-        return -EIO;
-    quint32 next_block;
-    if (read(fd, &next_block, 4) != 4)
-        return -EIO;
-    if (read(fd, str_buffer, 4) != 4)
-        return -EIO;
-    quint16 mshort;
-    if (read(fd, &mshort, 2) != 2)
-        return -EIO;
-    quint16 nlink = ntohs(mshort);
-    if (read(fd, &mshort, 2) != 2)
-        return -EIO;
-    mshort = ntohs(mshort);
-    if (mshort & SF_MODE_REGULARFILE)
-        return -ENOTDIR;
-    /* Check the permissions */
-    if (!(mshort & S_IWUSR))
-        return -EACCES;
-    /* Look for the pathname entry */
-    while (true)
+    /* A gap before the data is left as a hole */
+    if (offset > myFile.fileLength)
+        ret_value = myTruncate(myFile.nodeAddr, offset);
+    if ((ret_value == 0) && (offset + count > myFile.fileLength))
+        ret_value = myTruncate(myFile.nodeAddr, offset + count, false);
+    if (ret_value != 0)
+        return ret_value;
+    ret_value = writeAt(myFile, buf, count, offset);
+    if (ret_value != 0)
+        return ret_value;
+    return count;
+}
+
+int MyFS::sReadBuf(quint32 fd, quint32 count, quint64 offset, QList<sDataBuf> &bufs)
+{
+    QReadLocker locker(&nsLock);
+    OpenFile myFile;
+    if (!getOpenFile(fd, true, myFile))
+        return -EBADF;
+    if (this->fd < 0) return -EIO;
+    if (!myFile.parts->buffered.isEmpty())
     {
-        quint32 addr;
-        if (read(fd, &addr, 4) != 4)
+        /* The buffered data has to be in the container first */
+        locker.unlock();
+        int ret_value = flushFile(fd);
+        if (ret_value != 0)
+            return ret_value;
+        locker.relock();
+        if (!getOpenFile(fd, true, myFile))
+            return -EBADF;
+    }
+    if (!(myFile.flags & OPEN_FILE_FLAGS_PREAD))
+        return -EBADF;
+    if (offset > myFile.fileLength)
+        return -EOVERFLOW;
+    if (offset + count > myFile.fileLength)
+        count = (quint32) (myFile.fileLength - offset);
+    int ret_value = getParts(myFile, count, offset, bufs);
+    if (ret_value != 0)
+        return ret_value;
+    putOpenFile(fd, myFile);
+    return count;
+}
+
+int MyFS::sWriteBuf(quint32 fd, quint32 count, quint64 offset, QList<sDataBuf> &bufs)
+{
+    QWriteLocker locker(&nsLock);
+    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || (!openFiles.at(fd).isRegular))
+        return -EBADF;
+    if (this->fd < 0) return -EIO;
+    checkJournal();
+    OpenFile &myFile = openFiles[fd];
+    if (!(myFile.flags & OPEN_FILE_FLAGS_PWRITE))
+        return -EBADF;
+    /* The buffered data is older */
+    int ret_value = flushBuffer(myFile.nodeAddr);
+    if (ret_value != 0)
+        return ret_value;
+    if (offset + count > myFile.fileLength)
+    {
+        if (offset + count > MAX_CONTAINER_SIZE)
+            return -EFBIG;
+        /* A gap before the data is left as a hole */
+        if (offset > myFile.fileLength)
+            ret_value = myTruncate(myFile.nodeAddr, offset);
+        if (ret_value == 0)
+            ret_value = myTruncate(myFile.nodeAddr, offset + count, false);
+        if (ret_value != 0)
+            return ret_value;
+    }
+    /* The data is written into the container after nsLock is released, so it needs its space now */
+    ret_value = fillHoles(myFile, offset, count);
+    if (ret_value != 0)
+        return ret_value;
+    ret_value = getParts(myFile, count, offset, bufs);
+    if (ret_value != 0)
+        return ret_value;
+    markWritten(myFile, offset, count);
+    return count;
+}
+
+int MyFS::sSync(quint32 fd)
+{
+    /* The buffered data is written whatever the durability mode */
+    int ret_value = flushFile(fd);
+    if (ret_value != 0)
+        return ret_value;
+    if (durability() == DURABILITY_STRICT)
+        return syncFile(fd);
+    /* The changes are committed later (see MyFSDurability) */
+    return 0;
+}
+
+int MyFS::sClose(quint32 fd)
+{
+    MyFSDurability mode = durability();
+    QReadLocker locker(&nsLock);
+    OpenFile file;
+    if (!getOpenFile(fd, true, file))
+        return -EBADF;
+    if (file.flags & OPEN_FILE_FLAGS_MODIFIED)
+    {
+        /* Its modification time has to be changed */
+        locker.unlock();
+        QWriteLocker writeLocker(&nsLock);
+        if (this->fd < 0) return -EIO;
+        checkJournal();
+        /* Its buffered data is written first */
+        int ret_value = flushBuffer(file.nodeAddr);
+        if (ret_value != 0)
+        {
+            closeOpenFile(fd);
+            return ret_value;
+        }
+        if (mySeek(file.nodeAddr + NODE_MTIME, SEEK_SET) == SEEK_ERROR)
             return -EIO;
-        if (!addr)
+        quint64 mytime = time(0);
+        if (myWrite(&mytime, 8) != 8)
+            return -EIO;
+        inodes.remove(file.nodeAddr);
+        if ((mode != DURABILITY_ON_CLOSE) && (mode != DURABILITY_STRICT))
         {
-            if (!next_block)
-                return -ENOENT;
-            beforeAddr = currentAddr;
-            currentAddr = ntohl(next_block) + 4;
-            if (lseek(fd, currentAddr, SEEK_SET) != currentAddr)
+            closeOpenFile(fd);
+            return 0;
+        }
+        startWriteback(file);
+        closeOpenFile(fd);
+        writeLocker.unlock();
+        return groupCommit();
+    }
+    closeOpenFile(fd);
+    return 0;
+}
+
+int MyFS::sOpenDir(const lString &pathname, quint32 &fd)
+{
+    if (this->fd < 0) return -EIO;
+    QReadLocker locker(&nsLock);
+    quint64 nodeAddr;
+    lString shallowCopy = pathname;
+    int ret_value = getAddress(shallowCopy, nodeAddr);
+    if (ret_value != 0)
+        return ret_value;
+    return myOpenDir(nodeAddr, fd);
+}
+
+int MyFS::sReadDir(quint32 fd, char *&name)
+{
+    QReadLocker locker(&nsLock);
+    quint64 addr;
+    return myReadDir(fd, name, addr);
+}
+
+int MyFS::sReadDirPlus(quint32 fd, char *&name, sAttr &attr)
+{
+    QReadLocker locker(&nsLock);
+    quint64 addr;
+    int ret_value = myReadDir(fd, name, addr);
+    if ((ret_value != 0) || (!name))
+        return ret_value;
+    return myGetAttr(addr, attr);
+}
+
+int MyFS::sReadDirBatch(quint32 fd, quint64 cookie, quint32 count, QList<sDirEntry> &entries)
+{
+    QReadLocker locker(&nsLock);
+    OpenFile dir;
+    if (!getOpenFile(fd, false, dir))
+        return -EBADF;
+    if (this->fd < 0) return -EIO;
+    quint64 partAddr, pos;
+    if (cookie)
+    {
+        partAddr = cookie >> DIR_COOKIE_SHIFT;
+        pos = cookie & ((((quint64) 1) << DIR_COOKIE_SHIFT) - 1);
+    } else {
+        partAddr = dir.nodeAddr;
+        pos = NODE_ENTRIES;
+    }
+    /* Each part is read at once, its entries are then parsed from memory */
+    QByteArray part;
+    quint64 partLength = 0;
+    bool resumed = (cookie != 0);
+    while (count)
+    {
+        if (part.isEmpty())
+        {
+            if (mySeek(partAddr, SEEK_SET) == SEEK_ERROR)
                 return -EIO;
-            if (read(fd, &next_block, 4) != 4)
+            if (myRead(&partLength, 8) != 8)
                 return -EIO;
+            if ((partLength < PART_HEADER_SIZE + 8) || (partLength > (((quint64) 1) << DIR_COOKIE_SHIFT)) ||
+                (pos < PART_HEADER_SIZE) || (pos > partLength - 8))
+                return resumed ? -EINVAL : -EIO;
+            resumed = false;
+            part.resize(partLength);
+            if (mySeek(partAddr, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myRead(part.data(), partLength) != (ssize_t) partLength)
+                return -EIO;
+        }
+        const char *data = part.constData();
+        quint64 addr;
+        if (pos > partLength - 8)
+            return -EIO;
+        memcpy(&addr, data + pos, 8);
+        if (!addr)
+        {
+            memcpy(&addr, data + 8, 8);
+            if (!addr)
+                break;
+            partAddr = addr;
+            pos = PART_HEADER_SIZE;
+            part.clear();
             continue;
         }
-        unsigned char nameLen;
-        if (read(fd, &nameLen, 1) != 1)
+        if (pos + ENTRY_HEADER_SIZE > partLength)
+            return -EIO;
+        quint64 len = (unsigned char) data[pos + 8];
+        if (pos + ENTRY_HEADER_SIZE + len > partLength)
             return -EIO;
-        if (read(fd, &str_buffer, nameLen) != nameLen)
+        sDirEntry entry;
+        entry.name = QByteArray(data + pos + ENTRY_HEADER_SIZE, len);
+        pos += ENTRY_HEADER_SIZE + len;
+        entry.next = DIR_COOKIE(partAddr, pos);
+        int ret_value = myGetAttr(addr, entry.attr);
+        if (ret_value != 0)
+            return ret_value;
+        entries.append(entry);
+        --count;
+    }
+    return 0;
+}
+
+int MyFS::myReadDir(quint32 fd, char *&name, quint64 &entryAddr)
+{
+    OpenFile myDir;
+    if (!getOpenFile(fd, false, myDir))
+        return -EBADF;
+    if (this->fd < 0) return -EIO;
+    OpenFile *file = &myDir;
+    if (mySeek(file->currentAddr, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    quint64 addr;
+    while (true)
+    {
+        if (myRead(&addr, 8) != 8)
             return -EIO;
-        if ((nameLen == len) && (memcmp(pathname.str_value + start, str_buffer, len) == 0))
+        if (addr == 0)
         {
-            /* Found it. */
-            addr = ntohl(addr);
-            off_t nextEntry = lseek(fd, 0, SEEK_CUR);
-            if (nextEntry == SEEK_ERROR)
-                return -EIO;
-            /* Check if the file is opened. */
-            for (int i = 0; i < openFiles.count(); ++i)
-            {
-                if (openFiles.at(i).nodeAddr == addr)
-                    return -EBUSY;
-            }
-            /* Check if isDir has the right value. */
-            if (lseek(fd, addr + 14, SEEK_SET) != addr + 14)
-                return -EIO;
-            if (read(fd, &mshort, 2) != 2)
-                return -EIO;
-            mshort = ntohs(mshort);
-            if (nodeAddr)
+            if (!file->nextAddr)
             {
-                isDir = (bool) (mshort & SF_MODE_DIRECTORY);
-                *nodeAddr = addr;
-            } else {
-                if (isDir ^ ((bool) (mshort & SF_MODE_DIRECTORY)))
-                    return isDir ? -ENOTDIR : -EISDIR;
-                /* Remove addr (or just decrease the link counter) */
-                if (!isDir)
-                {
-                    if (lseek(fd, addr + 12, SEEK_SET) == SEEK_ERROR)
-                        return -EIO;
-                    if (read(fd, &mshort, 2) != 2)
-                        return -EIO;
-                    mshort = ntohs(mshort) - 1;
-                    if (mshort)
-                    {
-                        if (lseek(fd, -2, SEEK_CUR) == SEEK_ERROR)
-                            return -EIO;
-                        mshort = htons(mshort);
-                        if (write(fd, &mshort, 2) != 2)
-                            return -EIO;
-                    } else {
-                        ret_value = freeBlocks(addr);
-                        if (ret_value != 0)
-                            return ret_value;
-                    }
-                } else {
-                    /* If this is a directory, check if it is empty */
-                    quint32 myfd;
-                    char *entryName;
-                    ret_value = sOpenDir(pathname, myfd);
-                    if (ret_value != 0)
-                        return ret_value;
-                    while (true)
-                    {
-                        ret_value = sReadDir(myfd, entryName);
-                        if (ret_value != 0)
-                            return ret_value;
-                        if (entryName == NULL)
-                            break;
-                        if (strcmp(entryName, ".") == 0)
-                            continue;
-                        if (strcmp(entryName, "..") == 0)
-                            continue;
-                        sCloseDir(myfd);
-                        return -ENOTEMPTY;
-                    }
-                    sCloseDir(myfd);
-                    /* Remove addr */
-                    ret_value = freeBlocks(addr);
-                    if (ret_value != 0)
-                        return ret_value;
-                }
+                name = NULL;
+                putOpenFile(fd, myDir);
+                return 0;
             }
-            /* Remove the corresponding entry in the parent */
-            if (lseek(fd, nextEntry, SEEK_SET) != nextEntry)
-                return -EIO;
-            if (read(fd, &addr, 4) != 4)
-                return -EIO;
-            if ((!addr) && (((quint32) nextEntry) == currentAddr + 4))
+            file->nextAddr += 8;
+            if (mySeek(file->nextAddr, SEEK_SET) == SEEK_ERROR)
+                goto ioerror;
+            file->currentAddr = file->nextAddr + 8;
+            if (myRead(&file->nextAddr, 8) != 8)
+                goto ioerror;
+            continue;
+        }
+        unsigned char sLen;
+        if (myRead(&sLen, 1) != 1)
+            return -EIO;
+        if (myRead(str_buffer, sLen) != sLen)
+            return -EIO;
+        file->currentAddr += ENTRY_HEADER_SIZE;
+        file->currentAddr += sLen;
+        str_buffer[sLen] = 0;
+        name = str_buffer;
+        entryAddr = addr;
+        putOpenFile(fd, myDir);
+        return 0;
+    }
+ioerror:
+    file->nodeAddr = 0;
+    putOpenFile(fd, myDir);
+    return -EIO;
+}
+
+int MyFS::sCloseDir(quint32 fd)
+{
+    QReadLocker locker(&nsLock);
+    OpenFile dir;
+    if (!getOpenFile(fd, false, dir))
+        return -EBADF;
+    closeOpenFile(fd);
+    return 0;
+}
+
+int MyFS::sAccess(const lString &pathname, quint8 mode)
+{
+    if (fd < 0) return -EIO;
+    QReadLocker locker(&nsLock);
+    quint64 addr;
+    lString shallowCopy = pathname;
+    int ret_value = getAddress(shallowCopy, addr);
+    if (ret_value != 0)
+        return ret_value;
+    return myAccess(addr, mode);
+}
+
+int MyFS::sFTruncate(quint32 fd, quint64 newsize)
+{
+#if READONLY_FS
+    Q_UNUSED(fd);
+    Q_UNUSED(newsize);
+    return -EROFS;
+#else
+    QWriteLocker locker(&nsLock);
+    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || (!openFiles.at(fd).isRegular))
+        return -EBADF;
+    if (this->fd < 0) return -EIO;
+    checkJournal();
+    if (newsize > MAX_CONTAINER_SIZE)
+        return -EINVAL;
+    OpenFile *file = &openFiles[fd];
+    int ret_value = flushBuffer(file->nodeAddr);
+    if (ret_value != 0)
+        return ret_value;
+    file->fileLength = newsize;
+    return myTruncate(file->nodeAddr, file->fileLength);
+#endif /* READONLY_FS */
+}
+
+int MyFS::sFGetAttr(quint32 fd, sAttr &attr)
+{
+    QReadLocker locker(&nsLock);
+    OpenFile file;
+    if ((!getOpenFile(fd, true, file)) && (!getOpenFile(fd, false, file)))
+        return -EBADF;
+    if (this->fd < 0) return -EIO;
+    return myGetAttr(file.nodeAddr, attr);
+}
+
+int MyFS::sLookup(quint64 parent, const lString &name, quint64 &node, sAttr &attr)
+{
+    if (fd < 0) return -EIO;
+    QReadLocker locker(&nsLock);
+    quint64 addr;
+    int ret_value = lookupEntry(toAddress(parent), name.str_value, name.str_len, addr);
+    if (ret_value != 0)
+        return ret_value;
+    ret_value = myGetAttr(addr, attr);
+    if (ret_value != 0)
+        return ret_value;
+    node = toNode(addr);
+    QMutexLocker filesLocker(&filesLock);
+    ++lookups[addr];
+    return 0;
+}
+
+void MyFS::sForget(quint64 node, quint64 nlookup)
+{
+    quint64 addr = toAddress(node);
+    filesLock.lock();
+    QHash<quint64, quint64>::iterator it = lookups.find(addr);
+    if (it == lookups.end())
+    {
+        filesLock.unlock();
+        return;
+    }
+    if (it.value() > nlookup)
+    {
+        it.value() -= nlookup;
+        filesLock.unlock();
+        return;
+    }
+    lookups.erase(it);
+    /* Removed nodes are only freed once the kernel has forgotten about them */
+    bool orphan = orphans.remove(addr);
+    filesLock.unlock();
+    if (orphan && (fd >= 0))
+    {
+        /* Nothing else can reach an orphan, which is only freed here */
+        QWriteLocker locker(&nsLock);
+        checkJournal();
+        inodes.remove(addr);
+        freeBlocks(addr);
+    }
+}
+
+int MyFS::sIGetAttr(quint64 node, sAttr &attr)
+{
+    if (fd < 0) return -EIO;
+    QReadLocker locker(&nsLock);
+    return myGetAttr(toAddress(node), attr);
+}
+
+int MyFS::sIMkFile(quint64 parent, const lString &name, quint16 mst_mode, quint64 &node, sAttr &attr)
+{
+#if READONLY_FS
+    Q_UNUSED(parent);
+    Q_UNUSED(name);
+    Q_UNUSED(mst_mode);
+    Q_UNUSED(node);
+    Q_UNUSED(attr);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    quint64 file;
+    int ret_value = myMkFile(toAddress(parent), name.str_value, name.str_len, mst_mode, file);
+    if (ret_value != 0)
+        return ret_value;
+    ret_value = myGetAttr(file, attr);
+    if (ret_value != 0)
+        return ret_value;
+    node = toNode(file);
+    QMutexLocker filesLocker(&filesLock);
+    ++lookups[file];
+    return 0;
+#endif /* READONLY_FS */
+}
+
+int MyFS::sIRmFile(quint64 parent, const lString &name, bool isDir)
+{
+#if READONLY_FS
+    Q_UNUSED(parent);
+    Q_UNUSED(name);
+    Q_UNUSED(isDir);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    return myUnlink(toAddress(parent), name.str_value, name.str_len, isDir);
+#endif /* READONLY_FS */
+}
+
+int MyFS::sIMvFile(quint64 parentBefore, const lString &nameBefore, quint64 parentAfter, const lString &nameAfter)
+{
+#if READONLY_FS
+    Q_UNUSED(parentBefore);
+    Q_UNUSED(nameBefore);
+    Q_UNUSED(parentAfter);
+    Q_UNUSED(nameAfter);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    return myMove(toAddress(parentBefore), nameBefore.str_value, nameBefore.str_len,
+                  toAddress(parentAfter), nameAfter.str_value, nameAfter.str_len);
+#endif /* READONLY_FS */
+}
+
+int MyFS::sILink(quint64 node, quint64 newParent, const lString &newName, sAttr &attr)
+{
+#if READONLY_FS
+    Q_UNUSED(node);
+    Q_UNUSED(newParent);
+    Q_UNUSED(newName);
+    Q_UNUSED(attr);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    quint64 addr = toAddress(node);
+    int ret_value = myHardLink(addr, toAddress(newParent), newName.str_value, newName.str_len);
+    if (ret_value != 0)
+        return ret_value;
+    ret_value = myGetAttr(addr, attr);
+    if (ret_value != 0)
+        return ret_value;
+    QMutexLocker filesLocker(&filesLock);
+    ++lookups[addr];
+    return 0;
+#endif /* READONLY_FS */
+}
+
+int MyFS::sIChMod(quint64 node, quint16 mst_mode)
+{
+#if READONLY_FS
+    Q_UNUSED(node);
+    Q_UNUSED(mst_mode);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    return myChMod(toAddress(node), mst_mode);
+#endif /* READONLY_FS */
+}
+
+int MyFS::sITruncate(quint64 node, quint64 newsize)
+{
+#if READONLY_FS
+    Q_UNUSED(node);
+    Q_UNUSED(newsize);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    return mySetSize(toAddress(node), newsize);
+#endif /* READONLY_FS */
+}
+
+int MyFS::sIUTime(quint64 node, time_t mst_atime, time_t mst_mtime)
+{
+    Q_UNUSED(mst_atime);
+#if READONLY_FS
+    Q_UNUSED(node);
+    Q_UNUSED(mst_mtime);
+    return -EROFS;
+#else
+    if (fd < 0) return -EIO;
+    QWriteLocker locker(&nsLock);
+    checkJournal();
+    return myUTime(toAddress(node), mst_mtime);
+#endif /* READONLY_FS */
+}
+
+int MyFS::sIOpen(quint64 node, int flags, quint32 &fd)
+{
+    if (this->fd < 0) return -EIO;
+    /* Truncating the file changes the container */
+    if (flags & O_TRUNC)
+    {
+        nsLock.lockForWrite();
+        checkJournal();
+    } else {
+        nsLock.lockForRead();
+    }
+    int ret_value = myOpen(toAddress(node), flags, fd);
+    nsLock.unlock();
+    return ret_value;
+}
+
+int MyFS::sIOpenDir(quint64 node, quint32 &fd)
+{
+    if (this->fd < 0) return -EIO;
+    QReadLocker locker(&nsLock);
+    return myOpenDir(toAddress(node), fd);
+}
+
+int MyFS::sIAccess(quint64 node, quint8 mode)
+{
+    if (fd < 0) return -EIO;
+    QReadLocker locker(&nsLock);
+    return myAccess(toAddress(node), mode);
+}
+
+/* The root directory is given the node SF_ROOT_NODE, the other nodes are simply identified by their address */
+quint64 MyFS::toNode(quint64 addr) const
+{
+    return (addr == root_address) ? SF_ROOT_NODE : addr;
+}
+
+quint64 MyFS::toAddress(quint64 node) const
+{
+    return (node == SF_ROOT_NODE) ? root_address : node;
+}
+
+/* Splits pathname into its parent directory (pathname is shortened accordingly) and its last component (name, of length len) */
+int MyFS::splitPath(lString &pathname, const char *&name, int &len)
+{
+    if (pathname.str_len == 0)
+        return -ENOENT;
+    while ((pathname.str_len > 0) && (pathname.str_value[pathname.str_len - 1] == '/'))
+        --pathname.str_len;
+    if (pathname.str_len == 0)
+        return -EEXIST;
+    len = pathname.str_len;
+    while ((pathname.str_len > 0) && (pathname.str_value[pathname.str_len - 1] != '/'))
+        --pathname.str_len;
+    len -= pathname.str_len;
+    name = pathname.str_value + pathname.str_len;
+    return 0;
+}
+
+int MyFS::myChMod(quint64 nodeAddr, quint16 mst_mode)
+{
+    NodeHeader header;
+    int ret_value = readHeader(nodeAddr, header);
+    if (ret_value != 0)
+        return ret_value;
+    quint16 mshort = header.mode;
+    inodes.remove(nodeAddr);
+    /* The cached entries skip the permission check of their directory */
+    if (mshort & SF_MODE_DIRECTORY)
+        dentries.clear();
+    mshort = (mshort & (~0x1FF)) | (mst_mode & 0x1FF);
+    if (mySeek(nodeAddr + NODE_MODE, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&mshort, 2) != 2)
+        return -EIO;
+    return 0;
+}
+
+int MyFS::mySetSize(quint64 nodeAddr, quint64 newsize)
+{
+    if (newsize > MAX_CONTAINER_SIZE)
+        return -EINVAL;
+    NodeHeader header;
+    int ret_value = readHeader(nodeAddr, header);
+    if (ret_value != 0)
+        return ret_value;
+    if (header.mode & SF_MODE_DIRECTORY)
+        return -EISDIR;
+    if (!(header.mode & S_IWUSR))
+        return -EACCES;
+    ret_value = flushBuffer(nodeAddr);
+    if (ret_value != 0)
+        return ret_value;
+    return myTruncate(nodeAddr, newsize);
+}
+
+int MyFS::myUTime(quint64 nodeAddr, time_t mst_mtime)
+{
+    quint64 mtime = mst_mtime;
+    if (mySeek(nodeAddr + NODE_MTIME, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&mtime, 8) != 8)
+        return -EIO;
+    inodes.remove(nodeAddr);
+    return 0;
+}
+
+int MyFS::myOpen(quint64 nodeAddr, int flags, quint32 &fd)
+{
+#if READONLY_FS
+    if (flags & (O_WRONLY | O_RDWR))
+        return -EROFS;
+#endif /* READONLY_FS */
+    OpenFile myFile;
+    myFile.nodeAddr = nodeAddr;
+    NodeHeader header;
+    int ret_value = readHeader(nodeAddr, header);
+    if (ret_value != 0)
+        return ret_value;
+    quint16 mshort = header.mode;
+    if (mshort & SF_MODE_DIRECTORY)
+        return -EISDIR;
+    myFile.partLength = header.length;
+    myFile.nextAddr = header.next;
+    if (mshort & MODE_INDEXED)
+    {
+        /* The header only gives the address of the index */
+        quint64 indexAddr;
+        ret_value = readFirstPart(nodeAddr, myFile.partLength, myFile.nextAddr, indexAddr);
+        if (ret_value != 0)
+            return ret_value;
+    }
+    myFile.flags = (flags & O_NOATIME) ? OPEN_FILE_FLAGS_NOATIME : 0;
+    if (!(flags & O_WRONLY))
+    {
+        myFile.flags |= OPEN_FILE_FLAGS_PREAD;
+        if (!(mshort & S_IRUSR))
+            return -EACCES;
+    }
+    if (flags & (O_WRONLY | O_RDWR))
+    {
+        myFile.flags |= OPEN_FILE_FLAGS_PWRITE;
+        if (!(mshort & S_IWUSR))
+            return -EACCES;
+    } else {
+        if (flags & O_TRUNC)
+            return -EACCES;
+    }
+    if (flags & O_TRUNC)
+    {
+        /* The data buffered through the other handles is older */
+        ret_value = flushBuffer(nodeAddr);
+        if (ret_value != 0)
+            return ret_value;
+        myFile.fileLength = 0;
+        if (mySeek(nodeAddr + NODE_SIZE, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(&myFile.fileLength, 8) != 8)
+            return -EIO;
+        inodes.remove(nodeAddr);
+    } else {
+        myFile.fileLength = header.size;
+    }
+    myFile.partAddr = myFile.nodeAddr;
+    myFile.partHole = false;
+    myFile.partOffset = 0;
+    myFile.dirtyStart = 0;
+    myFile.dirtyEnd = 0;
+    myFile.isRegular = true;
+    filesLock.lock();
+    myFile.parts = usePartMap(nodeAddr);
+    filesLock.unlock();
+    if ((flags & O_APPEND) && !(flags & O_TRUNC))
+    {
+        if (!setPosition(myFile, myFile.fileLength))
+            ret_value = -EIO;
+    } else {
+        myFile.currentAddr = myFile.nodeAddr + NODE_DATA;
+    }
+    QMutexLocker filesLocker(&filesLock);
+    fd = 0;
+    while ((fd < (quint32) openFiles.count()) && openFiles.at(fd).nodeAddr) ++fd;
+    if ((ret_value == 0) && (fd > MAX_OPEN_FILES))
+        ret_value = -ENFILE;
+    if (ret_value != 0)
+    {
+        releasePartMap(myFile.parts);
+        return ret_value;
+    }
+    if (fd == (quint32) openFiles.count())
+        openFiles.append(myFile);
+    else
+        openFiles[fd] = myFile;
+    return 0;
+}
+
+int MyFS::myOpenDir(quint64 nodeAddr, quint32 &fd)
+{
+    OpenFile myDir;
+    myDir.nodeAddr = nodeAddr;
+    NodeHeader header;
+    int ret_value = readHeader(nodeAddr, header);
+    if (ret_value != 0)
+        return ret_value;
+    if (header.mode & SF_MODE_REGULARFILE)
+        return -ENOTDIR;
+    if (!(header.mode & S_IRUSR))
+        return -EACCES;
+    myDir.currentAddr = myDir.nodeAddr + NODE_ENTRIES;
+    myDir.nextAddr = header.next;
+    myDir.isRegular = false;
+    myDir.parts = NULL;
+    QMutexLocker filesLocker(&filesLock);
+    fd = 0;
+    while ((fd < (quint32) openFiles.count()) && openFiles.at(fd).nodeAddr) ++fd;
+    if (fd == (quint32) openFiles.count())
+    {
+        if (fd > MAX_OPEN_FILES)
+            return -ENFILE;
+        openFiles.append(myDir);
+    } else {
+        openFiles[fd] = myDir;
+    }
+    return 0;
+}
+
+int MyFS::myAccess(quint64 addr, quint8 mode)
+{
+    if (mode == F_OK)
+        return 0;
+#if READONLY_FS
+    if (mode & W_OK)
+        return -EROFS;
+#endif /* READONLY_FS */
+    NodeHeader header;
+    int ret_value = readHeader(addr, header);
+    if (ret_value != 0)
+        return ret_value;
+    quint16 mshort = header.mode;
+    if ((mode & R_OK) && (!(mshort & S_IRUSR)))
+        return -EACCES;
+    if ((mode & W_OK) && (!(mshort & S_IWUSR)))
+        return -EACCES;
+    if ((mode & X_OK) && (!(mshort & S_IXUSR)))
+        return -EACCES;
+    return 0;
+}
+
+/* Adds a new (hard) link named name (of length len) in the directory dirAddr to the regular file nodeAddr */
+int MyFS::myHardLink(quint64 nodeAddr, quint64 dirAddr, const char *name, int len)
+{
+    NodeHeader header;
+    int ret_value = readHeader(nodeAddr, header);
+    if (ret_value != 0)
+        return ret_value;
+    if (header.nlink == 0xFFFF)
+        return -EMLINK;
+    if (header.mode & SF_MODE_DIRECTORY)
+        return -EPERM;
+    ret_value = myLink(dirAddr, nodeAddr, name, len, false);
+    if (ret_value != 0)
+        return ret_value;
+    if (mySeek(nodeAddr + NODE_NLINK, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    quint16 nlink = header.nlink + 1;
+    if (myWrite(&nlink, 2) != 2)
+        return -EIO;
+    inodes.remove(nodeAddr);
+    return 0;
+}
+
+/* Creates the file name (of length len) in the directory dirAddr, and puts its address into file */
+int MyFS::myMkFile(quint64 dirAddr, const char *name, int len, quint16 mst_mode, quint64 &file)
+{
+    if (len > 0xFF)
+        return -ENAMETOOLONG;
+    /* Create the file block */
+    int ret_value = getBlock(mst_mode & SF_MODE_DIRECTORY ? DIR_BLOCK_SIZE : REG_BLOCK_SIZE, file);
+    if (ret_value != 0)
+        return ret_value;
+    quint64 addr = time(0);
+    if (myWrite(&addr, 8) != 8)
+        return -EIO;
+    quint16 mshort = (mst_mode & SF_MODE_DIRECTORY) ? 2 : 1;
+    if (myWrite(&mshort, 2) != 2)
+        return -EIO;
+    mshort = mst_mode & (~MODE_INDEXED);
+    if (myWrite(&mshort, 2) != 2)
+        return -EIO;
+    quint32 reserved = 0;
+    if (myWrite(&reserved, 4) != 4)
+        return -EIO;
+    if (mst_mode & SF_MODE_DIRECTORY)
+    {
+        if (myWrite(&file, 8) != 8)
+            return -EIO;
+        str_buffer[0] = 1;
+        if (myWrite(str_buffer, 1) != 1)
+            return -EIO;
+        str_buffer[1] = '.';
+        if (myWrite(str_buffer + 1, 1) != 1)
+            return -EIO;
+        if (myWrite(&dirAddr, 8) != 8)
+            return -EIO;
+        str_buffer[0] = 2;
+        if (myWrite(str_buffer, 1) != 1)
+            return -EIO;
+        str_buffer[0] = '.';
+        if (myWrite(str_buffer, 2) != 2)
+            return -EIO;
+        addr = 0;
+        if (myWrite(&addr, 8) != 8)
+            return -EIO;
+    } else {
+        quint64 fsize = 0;
+        if (myWrite(&fsize, 8) != 8)
+            return -EIO;
+    }
+    /* Link to its parent directory */
+    ret_value = myLink(dirAddr, file, name, len, (bool) (mst_mode & SF_MODE_DIRECTORY));
+    if (ret_value != 0)
+        freeBlock(file);
+    return ret_value;
+}
+
+/* Renames the entry nameBefore of the directory dirBefore as the entry nameAfter of the directory dirAfter */
+int MyFS::myMove(quint64 dirBefore, const char *nameBefore, int lenBefore, quint64 dirAfter, const char *nameAfter, int lenAfter)
+{
+    if (lenAfter > 0xFF)
+        return -ENAMETOOLONG;
+    quint64 file, target;
+    int ret_value = lookupEntry(dirBefore, nameBefore, lenBefore, file);
+    if (ret_value != 0)
+        return ret_value;
+    /* Replace the target if it exists */
+    ret_value = lookupEntry(dirAfter, nameAfter, lenAfter, target);
+    if (ret_value == 0)
+    {
+        if (target == file)
+            return 0;
+        sAttr fileAttr, targetAttr;
+        ret_value = myGetAttr(file, fileAttr);
+        if (ret_value != 0)
+            return ret_value;
+        ret_value = myGetAttr(target, targetAttr);
+        if (ret_value != 0)
+            return ret_value;
+        bool isDir = (bool) (targetAttr.mst_mode & SF_MODE_DIRECTORY);
+        if (isDir ^ ((bool) (fileAttr.mst_mode & SF_MODE_DIRECTORY)))
+            return isDir ? -EISDIR : -ENOTDIR;
+        ret_value = myUnlink(dirAfter, nameAfter, lenAfter, isDir);
+        if (ret_value != 0)
+            return ret_value;
+    } else if (ret_value != -ENOENT)
+    {
+        return ret_value;
+    }
+    bool isDir;
+    ret_value = myUnlink(dirBefore, nameBefore, lenBefore, isDir, &file);
+    if (ret_value != 0)
+        return ret_value;
+    ret_value = myLink(dirAfter, file, nameAfter, lenAfter, isDir);
+    if (ret_value != 0)
+    {
+        /* Put the file back where it was */
+        myLink(dirBefore, file, nameBefore, lenBefore, isDir);
+        return ret_value;
+    }
+    if (isDir)
+    {
+        /* Change reference to parent directory (second entry of the first part, after ".") */
+        if (mySeek(file + NODE_ENTRIES + ENTRY_HEADER_SIZE + 1, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(&dirAfter, 8) != 8)
+            return -EIO;
+    }
+    return 0;
+}
+
+/* Frees the node at address addr, unless the kernel still has to be able to access it (inode mode) */
+int MyFS::releaseNode(quint64 addr)
+{
+    filesLock.lock();
+    if (lookups.contains(addr))
+    {
+        orphans.insert(addr);
+        filesLock.unlock();
+        return 0;
+    }
+    filesLock.unlock();
+    inodes.remove(addr);
+    dropBuffer(addr);
+    return freeBlocks(addr);
+}
+
+/* Adds the entry name (of length len) to the directory dirAddr, pointing to file, WITHOUT updating the nlink field of file
+    (the nlink field of the directory is updated if file is a subdirectory, as specified by isDir) */
+int MyFS::myLink(quint64 dirAddr, quint64 file, const char *name, int len, bool isDir)
+{
+    if (len > 0xFF)
+        return -ENAMETOOLONG;
+    /* Its header is about to change (the cache is not used below) */
+    inodes.remove(dirAddr);
+    /* Check whether or not this is indeed a directory */
+    quint8 header[NODE_ENTRIES];
+    if (mySeek(dirAddr, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(header, NODE_ENTRIES) != NODE_ENTRIES)
+        return -EIO;
+    quint64 block_size, next_block;
+    quint16 mshort, nlink;
+    memcpy(&block_size, header, 8);
+    memcpy(&next_block, header + 8, 8);
+    memcpy(&nlink, header + NODE_NLINK, 2);
+    memcpy(&mshort, header + NODE_MODE, 2);
+    if (mshort & SF_MODE_REGULARFILE)
+        return -ENOTDIR;
+    /* Check the permissions */
+    if (!(mshort & S_IWUSR))
+        return -EACCES;
+    if (isDir && (nlink == 0xFFFF))
+        return -EMLINK;
+    quint64 currentPart = dirAddr, entryPart = 0, indexAddr = 0;
+    quint64 addr;
+    int ret_value;
+    if (mshort & MODE_INDEXED)
+    {
+        /* Only the index is searched for the name, and the entry is added where the index finds room for it */
+        indexAddr = next_block;
+        ret_value = findIndexedEntry(dirAddr, indexAddr, name, len, currentPart, addr);
+        if (ret_value == 0)
+            return -EEXIST;
+        if (ret_value != -ENOENT)
+            return ret_value;
+        ret_value = findDirRoom(indexAddr, (quint64) len + ENTRY_HEADER_SIZE, currentPart);
+        if (ret_value != 0)
+            return ret_value;
+        if (mySeek(currentPart, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(&block_size, 8) != 8)
+            return -EIO;
+        if (myRead(&next_block, 8) != 8)
+            return -EIO;
+    }
+    /* Add new entry */
+    bool newPart = false;
+    while (true)
+    {
+        if (myRead(&addr, 8) != 8)
+            return -EIO;
+        if (addr == 0)
+        {
+            off_t currentPos = mySeek(0, SEEK_CUR);
+            if (currentPos == SEEK_ERROR)
+                return -EIO;
+            quint64 used = (quint64) currentPos;
+            used -= currentPart;
+            if (block_size - used >= (quint64) len + ENTRY_HEADER_SIZE)
+            {
+                /* Add entry to the existing list */
+                currentPos -= 8;
+                if (mySeek(currentPos, SEEK_SET) != currentPos)
+                    return -EIO;
+                if (myWrite(&file, 8) != 8)
+                    return -EIO;
+                unsigned char sLen = (unsigned char) len;
+                if (myWrite(&sLen, 1) != 1)
+                    return -EIO;
+                if (myWrite(name, len) != len)
+                    return -EIO;
+                if (myWrite(&addr, 8) != 8)
+                    return -EIO;
+                entryPart = currentPart;
+            } else if (next_block != 0)
+            {
+                /* Go to the next part */
+                if (mySeek(next_block, SEEK_SET) == SEEK_ERROR)
+                    return -EIO;
+                currentPart = next_block;
+                if (myRead(&block_size, 8) != 8)
+                    return -EIO;
+                if (myRead(&next_block, 8) != 8)
+                    return -EIO;
+                continue;
+            } else {
+                /* Create a new part to add the entry */
+                ret_value = getBlock(DIR_BLOCK_SIZE, next_block);
+                if (ret_value != 0)
+                    return ret_value;
+                entryPart = next_block;
+                newPart = true;
+                if (myWrite(&file, 8) != 8)
+                    return -EIO;
+                unsigned char sLen = (unsigned char) len;
+                if (myWrite(&sLen, 1) != 1)
+                    return -EIO;
+                if (myWrite(name, len) != len)
+                    return -EIO;
+                if (myWrite(&addr, 8) != 8)
+                    return -EIO;
+                if (mySeek(currentPart + 8, SEEK_SET) == SEEK_ERROR)
+                    return -EIO;
+                if (myWrite(&next_block, 8) != 8)
+                    return -EIO;
+            }
+            break;
+        } else {
+            unsigned char sLen;
+            if (myRead(&sLen, 1) != 1)
+                return -EIO;
+            if (myRead(str_buffer, sLen) != sLen)
+                return -EIO;
+            if ((sLen == len) && (memcmp(str_buffer, name, len) == 0))
+                return -EEXIST;
+        }
+    }
+    if (indexAddr)
+    {
+        if (newPart)
+        {
+            ret_value = setDirTail(indexAddr, entryPart);
+            if (ret_value != 0)
+                return ret_value;
+        }
+        ret_value = addDirSlot(indexAddr, entryHash(name, len), entryPart);
+        if (ret_value == -ENOSPC)
+        {
+            /* Without room for a larger table, the directory is read linearly again */
+            ret_value = dropDirIndex(dirAddr, indexAddr);
+        }
+        if (ret_value != 0)
+            return ret_value;
+    } else if (entryPart != dirAddr)
+    {
+        /* The directory now has several parts: index it, unless there is no room for that */
+        ret_value = buildDirIndex(dirAddr, indexAddr);
+        if ((ret_value != 0) && (ret_value != -ENOSPC))
+            return ret_value;
+    }
+    /* Modify the last modification time (and the number of hard links if need be) */
+    if (mySeek(dirAddr + NODE_MTIME, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    quint64 linkDate = time(0);
+    if (myWrite(&linkDate, 8) != 8)
+        return -EIO;
+    if (isDir)
+    {
+        nlink = nlink + 1;
+        if (myWrite(&nlink, 2) != 2)
+            return -EIO;
+    }
+    return 0;
+}
+
+/* Removes the entry name (of length len) from the directory dirAddr.
+    If nodeAddr is not null, the entry is only detached: its address is put into nodeAddr and isDir is set accordingly. */
+int MyFS::myUnlink(quint64 dirAddr, const char *name, int len, bool &isDir, quint64 *nodeAddr)
+{
+    quint64 beforeAddr = 0, currentAddr;
+    int ret_value;
+    /* Its header is about to change (the cache is only used below for its subdirectories) */
+    inodes.remove(dirAddr);
+    /* Check whether or not this is indeed a directory */
+    quint8 header[NODE_ENTRIES];
+    if (mySeek(dirAddr, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(header, NODE_ENTRIES) != NODE_ENTRIES)
+        return -EIO;
+    currentAddr = dirAddr + 8;
+    quint64 next_block;
+    quint16 mshort, nlink;
+    memcpy(&next_block, header + 8, 8);
+    memcpy(&nlink, header + NODE_NLINK, 2);
+    memcpy(&mshort, header + NODE_MODE, 2);
+    if (mshort & SF_MODE_REGULARFILE)
+        return -ENOTDIR;
+    /* Check the permissions */
+    if (!(mshort & S_IWUSR))
+        return -EACCES;
+    quint64 indexAddr = 0, entrySize = (quint64) len + ENTRY_HEADER_SIZE;
+    quint32 hash = 0;
+    if (mshort & MODE_INDEXED)
+    {
+        /* Only the part found through the index is searched */
+        indexAddr = next_block;
+        hash = entryHash(name, len);
+        quint64 partAddr, found;
+        ret_value = findIndexedEntry(dirAddr, indexAddr, name, len, partAddr, found);
+        if (ret_value != 0)
+            return ret_value;
+        currentAddr = partAddr + 8;
+        if (mySeek(currentAddr, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(&next_block, 8) != 8)
+            return -EIO;
+        if ((partAddr == dirAddr) && (mySeek(NODE_ENTRIES - PART_HEADER_SIZE, SEEK_CUR) == SEEK_ERROR))
+            return -EIO;
+    }
+    /* Look for the entry */
+    while (true)
+    {
+        quint64 addr;
+        if (myRead(&addr, 8) != 8)
+            return -EIO;
+        if (!addr)
+        {
+            if (!next_block)
+                return -ENOENT;
+            beforeAddr = currentAddr;
+            currentAddr = next_block + 8;
+            if (mySeek(currentAddr, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myRead(&next_block, 8) != 8)
+                return -EIO;
+            continue;
+        }
+        unsigned char nameLen;
+        if (myRead(&nameLen, 1) != 1)
+            return -EIO;
+        if (myRead(&str_buffer, nameLen) != nameLen)
+            return -EIO;
+        if ((nameLen == len) && (memcmp(name, str_buffer, len) == 0))
+        {
+            /* Found it. */
+            off_t nextEntry = mySeek(0, SEEK_CUR);
+            if (nextEntry == SEEK_ERROR)
+                return -EIO;
+            /* Check if the file is opened. */
+            for (int i = 0; i < openFiles.count(); ++i)
+            {
+                if (openFiles.at(i).nodeAddr == addr)
+                    return -EBUSY;
+            }
+            /* Check if isDir has the right value. */
+            if (mySeek(addr + NODE_MODE, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myRead(&mshort, 2) != 2)
+                return -EIO;
+            if (nodeAddr)
+            {
+                isDir = (bool) (mshort & SF_MODE_DIRECTORY);
+                *nodeAddr = addr;
+            } else {
+                if (isDir ^ ((bool) (mshort & SF_MODE_DIRECTORY)))
+                    return isDir ? -ENOTDIR : -EISDIR;
+                /* Remove addr (or just decrease the link counter) */
+                if (!isDir)
+                {
+                    quint16 nlinkLeft;
+                    if (mySeek(addr + NODE_NLINK, SEEK_SET) == SEEK_ERROR)
+                        return -EIO;
+                    if (myRead(&nlinkLeft, 2) != 2)
+                        return -EIO;
+                    --nlinkLeft;
+                    if (mySeek(-2, SEEK_CUR) == SEEK_ERROR)
+                        return -EIO;
+                    if (myWrite(&nlinkLeft, 2) != 2)
+                        return -EIO;
+                    inodes.remove(addr);
+                    if (!nlinkLeft)
+                    {
+                        ret_value = releaseNode(addr);
+                        if (ret_value != 0)
+                            return ret_value;
+                    }
+                } else {
+                    /* If this is a directory, check if it is empty */
+                    quint32 myfd;
+                    quint64 entryAddr;
+                    char *entryName;
+                    ret_value = myOpenDir(addr, myfd);
+                    if (ret_value != 0)
+                        return ret_value;
+                    while (true)
+                    {
+                        ret_value = myReadDir(myfd, entryName, entryAddr);
+                        if (ret_value != 0)
+                            return ret_value;
+                        if (entryName == NULL)
+                            break;
+                        if (strcmp(entryName, ".") == 0)
+                            continue;
+                        if (strcmp(entryName, "..") == 0)
+                            continue;
+                        closeOpenFile(myfd);
+                        return -ENOTEMPTY;
+                    }
+                    closeOpenFile(myfd);
+                    /* Its index is useless from now on (the kernel may still read it if it is not freed) */
+                    if (mshort & MODE_INDEXED)
+                    {
+                        quint64 dirIndex;
+                        if (mySeek(addr + 8, SEEK_SET) == SEEK_ERROR)
+                            return -EIO;
+                        if (myRead(&dirIndex, 8) != 8)
+                            return -EIO;
+                        ret_value = dropDirIndex(addr, dirIndex);
+                        if (ret_value != 0)
+                            return ret_value;
+                    }
+                    /* Remove addr */
+                    ret_value = releaseNode(addr);
+                    if (ret_value != 0)
+                        return ret_value;
+                }
+            }
+            /* Forget the entry (renaming a directory does not change the entries below it) */
+            dentries.remove(dirAddr, name, len);
+            /* Remove the corresponding entry in the parent */
+            if (mySeek(nextEntry, SEEK_SET) != nextEntry)
+                return -EIO;
+            if (myRead(&addr, 8) != 8)
+                return -EIO;
+            if ((!addr) && (((quint64) nextEntry) == currentAddr + 8))
+            {
+                /* Empty part to remove */
+                if (mySeek(beforeAddr, SEEK_SET) == SEEK_ERROR)
+                    return -EIO;
+                if (myWrite(&next_block, 8) != 8)
+                    return -EIO;
+                ret_value = freeBlock(currentAddr - 8);
+                if (ret_value != 0)
+                    return ret_value;
+            } else {
+                /* Move following entries */
+                len += ENTRY_HEADER_SIZE;
+                if (mySeek(-(len + 8), SEEK_CUR) == SEEK_ERROR)
+                    return -EIO;
+                if (myWrite(&addr, 8) != 8)
+                    return -EIO;
+                while (addr)
+                {
+                    if (mySeek(len, SEEK_CUR) == SEEK_ERROR)
+                        return -EIO;
+                    if (myRead(&nameLen, 1) != 1)
+                        return -EIO;
+                    if (myRead(&str_buffer, nameLen) != nameLen)
+                        return -EIO;
+                    if (myRead(&addr, 8) != 8)
+                        return -EIO;
+                    if (mySeek(-(len + ENTRY_HEADER_SIZE + (int) nameLen), SEEK_CUR) == SEEK_ERROR)
+                        return -EIO;
+                    if (myWrite(&nameLen, 1) != 1)
+                        return -EIO;
+                    if (myWrite(&str_buffer, nameLen) != nameLen)
+                        return -EIO;
+                    if (myWrite(&addr, 8) != 8)
+                        return -EIO;
+                }
+            }
+            if (indexAddr)
+            {
+                ret_value = removeDirSlot(indexAddr, hash, currentAddr - 8, entrySize);
+                if (ret_value != 0)
+                    return ret_value;
+            }
+            /* Change the last modification time */
+            if (mySeek(dirAddr + NODE_MTIME, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            addr = time(0);
+            if (myWrite(&addr, 8) != 8)
+                return -EIO;
+            /* And the number of hard links if need be */
+            if (isDir)
+            {
+                nlink = nlink - 1;
+                if (myWrite(&nlink, 2) != 2)
+                    return -EIO;
+            }
+            return 0;
+        }
+    }
+}
+
+int MyFS::myGetAttr(quint64 addr, sAttr &attr)
+{
+    NodeHeader header;
+    int ret_value = readHeader(addr, header);
+    if (ret_value != 0)
+        return ret_value;
+    attr.mst_atime = (time_t) header.mtime;
+    attr.mst_mtime = attr.mst_atime;
+    attr.mst_nlink = (quint32) header.nlink;
+    attr.mst_mode = header.mode & (~MODE_INDEXED);
+    if (attr.mst_mode & SF_MODE_REGULARFILE)
+    {
+        attr.mst_size = header.size;
+        /* The data written beyond its end may still be buffered */
+        if (bufferedTotal)
+        {
+            QMutexLocker locker(&filesLock);
+            const PartMap *map = partMaps.value(addr);
+            if (map && !map->buffered.isEmpty())
+                attr.mst_size = map->bufferedLength;
+        }
+    }
+    return 0;
+}
+
+/* Puts into header the header of the first part of the node addr, from the cache if it is there */
+int MyFS::readHeader(quint64 addr, NodeHeader &header)
+{
+    if (inodes.lookup(addr, header))
+        return 0;
+    quint8 data[NODE_DATA];
+    if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(data, NODE_DATA) != NODE_DATA)
+        return -EIO;
+    memcpy(&header.length, data, 8);
+    memcpy(&header.next, data + 8, 8);
+    memcpy(&header.mtime, data + NODE_MTIME, 8);
+    memcpy(&header.nlink, data + NODE_NLINK, 2);
+    memcpy(&header.mode, data + NODE_MODE, 2);
+    /* The size of a regular file is where the first entry of a directory is */
+    header.size = 0;
+    if (header.mode & SF_MODE_REGULARFILE)
+        memcpy(&header.size, data + NODE_SIZE, 8);
+    inodes.insert(addr, header);
+    return 0;
+}
+
+/* Sets the size of the regular file addr, the data added being zeros (a hole where no part has space for it yet)
+    unless fill is false: the space is then allocated, and the caller writes all of it */
+int MyFS::myTruncate(quint64 addr, quint64 newsize, bool fill)
+{
+#if READONLY_FS
+    Q_UNUSED(addr);
+    Q_UNUSED(newsize);
+    Q_UNUSED(fill);
+    return -EROFS;
+#else
+    quint64 block_size, next_block, file_size, mytime, indexAddr;
+    quint64 modifNodeAddr = addr, modifNodeSize = newsize, modifNodePart = 0;
+    /* Its header is about to change (the cache is not used below) */
+    inodes.remove(addr);
+    int ret_value = readFirstPart(addr, block_size, next_block, indexAddr);
+    if (ret_value != 0)
+        return ret_value;
+    if (mySeek(addr + NODE_MTIME, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    mytime = time(0);
+    if (myWrite(&mytime, 8) != 8)
+        return -EIO;
+    if (mySeek(addr + NODE_SIZE, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(&file_size, 8) != 8)
+        return -EIO;
+    if (file_size == newsize)
+        return 0;
+    if (file_size < newsize)
+    {
+        /* We have to increase the size of the file, by appending zeros at the end */
+        bool isFistBlock = true, hole = false;
+        quint64 partOffset = 0; /* Offset in the file of the data of the part addr */
+        block_size -= NODE_DATA;
+        if (indexAddr && (block_size < file_size))
+        {
+            /* Go straight to the part where the data ends */
+            quint64 partAddr, count;
+            ret_value = findExtent(indexAddr, file_size, false, partAddr, partOffset, count);
+            if (ret_value != 0)
+                return ret_value;
+            if (partAddr)
+            {
+                addr = partAddr;
+                if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+                    return -EIO;
+                if (myRead(&block_size, 8) != 8)
+                    return -EIO;
+                if (myRead(&next_block, 8) != 8)
+                    return -EIO;
+                isFistBlock = false;
+                hole = (block_size & PART_HOLE) != 0;
+                block_size = (block_size & ~PART_HOLE) - PART_HEADER_SIZE;
+                file_size -= partOffset;
+                newsize -= partOffset;
+            }
+        }
+        while (block_size < file_size)
+        {
+            file_size -= block_size;
+            newsize -= block_size;
+            partOffset += block_size;
+            if (!next_block)
+                return -EIO; /* Corrupted data */
+            addr = next_block;
+            if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myRead(&block_size, 8) != 8)
+                return -EIO;
+            isFistBlock = false;
+            hole = (block_size & PART_HOLE) != 0;
+            block_size = (block_size & ~PART_HOLE) - PART_HEADER_SIZE;
+            if (myRead(&next_block, 8) != 8)
+                return -EIO;
+        }
+        if ((block_size > file_size) && !hole)
+        {
+            if (mySeek(addr + (isFistBlock ? NODE_DATA : PART_HEADER_SIZE) + file_size, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (fill && !myWriteB(qMin(block_size - file_size, newsize - file_size)))
+                return -EIO;
+        }
+        if (hole && fill && (!next_block) && (newsize > block_size))
+        {
+            /* The last part is a hole, which only gets longer */
+            quint64 length = newsize + PART_HEADER_SIZE, value = PART_HOLE | length;
+            if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myWrite(&value, 8) != 8)
+                return -EIO;
+            block_size = newsize;
+            PartMap *map = partMaps.value(modifNodeAddr);
+            if (map && map->built)
+                map->lengths.last() = length;
+            for (int i = 0; i < openFiles.count(); ++i)
+            {
+                if ((openFiles.at(i).nodeAddr == modifNodeAddr) && (openFiles.at(i).partAddr == addr))
+                    openFiles[i].partLength = length;
+            }
+        }
+        while (newsize > block_size)
+        {
+            newsize -= block_size;
+            partOffset += block_size;
+            if (!next_block)
+            {
+                hole = fill;
+                if (hole)
+                {
+                    /* All the rest is a single hole */
+                    ret_value = getHole(newsize, next_block);
+                    if (ret_value != 0)
+                        return ret_value;
+                    block_size = newsize;
+                } else {
+                    ret_value = getBlock(newsize + PART_HEADER_SIZE, next_block);
+                    if ((ret_value != 0) && (ret_value != -ENOSPC))
+                        return ret_value;
+                    if (ret_value == -ENOSPC)
+                    {
+                        if (next_block <= PART_HEADER_SIZE)
+                            return -ENOSPC;
+                        block_size = next_block - PART_HEADER_SIZE;
+                        ret_value = getBlock(next_block, next_block);
+                        if (ret_value != 0)
+                            return ret_value;
+                    } else {
+                        block_size = newsize;
+                    }
+                }
+                /* The first part of an indexed file is followed by its index */
+                quint64 link = ((addr == modifNodeAddr) && indexAddr) ? indexAddr : addr;
+                if (mySeek(link + 8, SEEK_SET) == SEEK_ERROR)
+                    return -EIO;
+                addr = next_block;
+                if (myWrite(&next_block, 8) != 8)
+                    return -EIO;
+                ret_value = indexPart(modifNodeAddr, partOffset, hole ? (addr | PART_HOLE) : addr);
+                if (ret_value != 0)
+                    return ret_value;
+                PartMap *map = partMaps.value(modifNodeAddr);
+                if (map && map->built)
+                {
+                    quint64 length;
+                    if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+                        return -EIO;
+                    if (myRead(&length, 8) != 8)
+                        return -EIO;
+                    map->offsets.append(partOffset);
+                    map->addrs.append(addr);
+                    map->lengths.append(length & ~PART_HOLE);
+                    map->holes.append(hole);
+                    map->holeCount += hole;
+                }
+                if (!modifNodePart)
+                {
+                    /* The file descriptors in the former last part now have a next part */
+                    modifNodePart = addr;
+                    for (int i = 0; i < openFiles.count(); ++i)
+                    {
+                        if ((openFiles.at(i).nodeAddr == modifNodeAddr) && (!openFiles.at(i).nextAddr))
+                            openFiles[i].nextAddr = modifNodePart;
+                    }
+                }
+                next_block = 0;
+                if (mySeek(addr + PART_HEADER_SIZE, SEEK_SET) == SEEK_ERROR)
+                    return -EIO;
+            } else {
+                addr = next_block;
+                if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+                    return -EIO;
+                if (myRead(&block_size, 8) != 8)
+                    return -EIO;
+                hole = (block_size & PART_HOLE) != 0;
+                block_size = (block_size & ~PART_HOLE) - PART_HEADER_SIZE;
+                if (myRead(&next_block, 8) != 8)
+                    return -EIO;
+            }
+            if (fill && !hole && !myWriteB(qMin(block_size, newsize)))
+                return -EIO;
+        }
+        /* The new size is only written once the space has been allocated */
+        if (mySeek(modifNodeAddr + NODE_SIZE, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(&modifNodeSize, 8) != 8)
+            return -EIO;
+        /* Update the file descriptors */
+        for (int i = 0; i < openFiles.count(); ++i)
+        {
+            if (openFiles.at(i).nodeAddr == modifNodeAddr)
+                openFiles[i].fileLength = modifNodeSize;
+        }
+        return 0;
+    } else {
+        /* We have to reduce the size of the file */
+        if (mySeek(-8, SEEK_CUR) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(&newsize, 8) != 8)
+            return -EIO;
+        /* Find the last part still needed */
+        quint64 available = block_size - NODE_DATA, count = 0;
+        if (indexAddr && (newsize > available))
+        {
+            quint64 partAddr, partOffset;
+            ret_value = findExtent(indexAddr, newsize, true, partAddr, partOffset, count);
+            if (ret_value != 0)
+                return ret_value;
+            if (partAddr)
+            {
+                addr = partAddr;
+                if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+                    return -EIO;
+                if (myRead(&block_size, 8) != 8)
+                    return -EIO;
+                if (myRead(&next_block, 8) != 8)
+                    return -EIO;
+                available = (block_size & ~PART_HOLE) - PART_HEADER_SIZE;
+                newsize -= partOffset;
+            }
+        }
+        while (next_block && (newsize > available))
+        {
+            newsize -= available;
+            addr = next_block;
+            if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myRead(&block_size, 8) != 8)
+                return -EIO;
+            if (myRead(&next_block, 8) != 8)
+                return -EIO;
+            available = (block_size & ~PART_HOLE) - PART_HEADER_SIZE;
+        }
+        if (next_block)
+        {
+            /* Free the following parts (a single part needs no index) */
+            if (indexAddr)
+            {
+                if (addr == modifNodeAddr)
+                {
+                    ret_value = dropIndex(modifNodeAddr, indexAddr);
+                    if (ret_value != 0)
+                        return ret_value;
+                } else {
+                    if (mySeek(indexAddr + 16, SEEK_SET) == SEEK_ERROR)
+                        return -EIO;
+                    if (myWrite(&count, 8) != 8)
+                        return -EIO;
+                }
+            }
+            if (mySeek(addr + 8, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            addr = 0;
+            if (myWrite(&addr, 8) != 8)
+                return -EIO;
+            ret_value = freeBlocks(next_block);
+            if (ret_value != 0)
+                return ret_value;
+            /* The part map is built again when needed */
+            PartMap *map = partMaps.value(modifNodeAddr);
+            if (map)
+                map->built = false;
+        }
+        /* Update the file descriptors */
+        for (int i = 0; i < openFiles.count(); ++i)
+        {
+            if (openFiles.at(i).nodeAddr == modifNodeAddr)
+            {
+                if (!resetPosition(openFiles[i]))
+                    return -EIO;
+                openFiles[i].fileLength = modifNodeSize;
+            }
+        }
+        return 0;
+    }
+#endif /* READONLY_FS */
+}
+
+/* Reads the header of the first part of the regular file nodeAddr: its length, the address of the next part of the file
+    and the address of its extent index (0 if it has none) */
+int MyFS::readFirstPart(quint64 nodeAddr, quint64 &partLength, quint64 &nextAddr, quint64 &indexAddr)
+{
+    quint8 header[NODE_ENTRIES];
+    if (mySeek(nodeAddr, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(header, NODE_ENTRIES) != NODE_ENTRIES)
+        return -EIO;
+    quint16 mshort;
+    memcpy(&partLength, header, 8);
+    memcpy(&nextAddr, header + 8, 8);
+    memcpy(&mshort, header + NODE_MODE, 2);
+    indexAddr = 0;
+    if (mshort & MODE_INDEXED)
+    {
+        /* The index comes first in the list of parts */
+        indexAddr = nextAddr;
+        if (mySeek(indexAddr + 8, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(&nextAddr, 8) != 8)
+            return -EIO;
+    }
+    return 0;
+}
+
+/* Looks in the extent index indexAddr for the last part whose data starts at offset or before (strictly before if strict is true).
+    Puts its address (without PART_HOLE) and the offset of its data into partAddr and partOffset (partAddr being 0 for the first part),
+    and the number of index entries up to this part into count. */
+int MyFS::findExtent(quint64 indexAddr, quint64 offset, bool strict, quint64 &partAddr, quint64 &partOffset, quint64 &count)
+{
+    quint64 entries;
+    if (mySeek(indexAddr + 16, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(&entries, 8) != 8)
+        return -EIO;
+    /* Binary search of the first entry past offset */
+    quint64 low = 0, high = entries;
+    while (low < high)
+    {
+        quint64 middle = low + (high - low) / 2, entryOffset;
+        if (mySeek(indexAddr + 24 + 16 * middle, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(&entryOffset, 8) != 8)
+            return -EIO;
+        if ((entryOffset < offset) || ((!strict) && (entryOffset == offset)))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    count = low;
+    partAddr = 0;
+    partOffset = 0;
+    if (!count)
+        return 0;
+    quint64 entry[2];
+    if (mySeek(indexAddr + 24 + 16 * (count - 1), SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(entry, 16) != 16)
+        return -EIO;
+    partOffset = entry[0];
+    partAddr = entry[1] & ~PART_HOLE;
+    return 0;
+}
+
+/* Adds the part partAddr (with PART_HOLE if it is a hole), whose data starts at offset partOffset, at the end of the extent index
+    of the regular file nodeAddr (the part being already linked to the previous one). The index is created or moved to a larger block if need be. */
+int MyFS::indexPart(quint64 nodeAddr, quint64 partOffset, quint64 partAddr)
+{
+    quint64 partLength, nextAddr, indexAddr, count = 0;
+    int ret_value = readFirstPart(nodeAddr, partLength, nextAddr, indexAddr);
+    if (ret_value != 0)
+        return ret_value;
+    QByteArray entries;
+    if (indexAddr)
+    {
+        quint64 size;
+        if (mySeek(indexAddr, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(&size, 8) != 8)
+            return -EIO;
+        if (mySeek(indexAddr + 16, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(&count, 8) != 8)
+            return -EIO;
+        quint64 entry[2] = { partOffset, partAddr };
+        if (24 + 16 * (count + 1) <= size)
+        {
+            /* There is room left in the index */
+            if (mySeek(indexAddr + 24 + 16 * count, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myWrite(entry, 16) != 16)
+                return -EIO;
+            if (mySeek(indexAddr + 16, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            ++count;
+            if (myWrite(&count, 8) != 8)
+                return -EIO;
+            return 0;
+        }
+        entries.resize(16 * count);
+        if (mySeek(indexAddr + 24, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(entries.data(), 16 * count) != (ssize_t) (16 * count))
+            return -EIO;
+        entries.append((const char*) entry, 16);
+    } else {
+        /* Index all the parts of the file (including the new one) */
+        quint64 offset = partLength - NODE_DATA, addr = nextAddr;
+        while (addr)
+        {
+            quint64 header[2];
+            if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myRead(header, 16) != 16)
+                return -EIO;
+            quint64 entry[2] = { offset, addr | (header[0] & PART_HOLE) };
+            entries.append((const char*) entry, 16);
+            offset += (header[0] & ~PART_HOLE) - PART_HEADER_SIZE;
+            addr = header[1];
+        }
+    }
+    return moveIndex(nodeAddr, indexAddr, nextAddr, entries);
+}
+
+/* Writes entries (all the entries of the extent index of the regular file nodeAddr, whose second part is nextAddr) to a new block,
+    twice as large as needed, which replaces the index indexAddr (0 if there is none yet) */
+int MyFS::moveIndex(quint64 nodeAddr, quint64 indexAddr, quint64 nextAddr, const QByteArray &entries)
+{
+    quint64 size = INDEX_BLOCK_SIZE, newIndex;
+    while (size < 24 + 2 * (quint64) entries.size())
+        size *= 2;
+    int ret_value = getBlock(size, newIndex);
+    if (ret_value == -ENOSPC)
+    {
+        /* The parts remain linked together, which is enough */
+        return indexAddr ? dropIndex(nodeAddr, indexAddr) : 0;
+    }
+    if (ret_value != 0)
+        return ret_value;
+    if (mySeek(newIndex + 8, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    quint64 header[2] = { nextAddr, (quint64) (entries.size() / 16) };
+    if (myWrite(header, 16) != 16)
+        return -EIO;
+    if (myWrite(entries.constData(), entries.size()) != (ssize_t) entries.size())
+        return -EIO;
+    if (mySeek(nodeAddr + 8, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&newIndex, 8) != 8)
+        return -EIO;
+    inodes.remove(nodeAddr);
+    if (indexAddr)
+        return freeBlock(indexAddr);
+    quint16 mshort;
+    if (mySeek(nodeAddr + NODE_MODE, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(&mshort, 2) != 2)
+        return -EIO;
+    mshort |= MODE_INDEXED;
+    if (mySeek(nodeAddr + NODE_MODE, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&mshort, 2) != 2)
+        return -EIO;
+    return 0;
+}
+
+/* Removes the index indexAddr following the first part of nodeAddr (extent index of a regular file or header of a directory index),
+    whose parts are then only linked together */
+int MyFS::dropIndex(quint64 nodeAddr, quint64 indexAddr)
+{
+    quint64 nextAddr;
+    if (mySeek(indexAddr + 8, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(&nextAddr, 8) != 8)
+        return -EIO;
+    if (mySeek(nodeAddr + 8, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&nextAddr, 8) != 8)
+        return -EIO;
+    quint16 mshort;
+    if (mySeek(nodeAddr + NODE_MODE, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(&mshort, 2) != 2)
+        return -EIO;
+    mshort &= ~MODE_INDEXED;
+    if (mySeek(nodeAddr + NODE_MODE, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&mshort, 2) != 2)
+        return -EIO;
+    inodes.remove(nodeAddr);
+    return freeBlock(indexAddr);
+}
+
+/* Appends to bufs the location in the container of count bytes of file, starting at offset (within the file length).
+    The data is only moved once nsLock has been released, the blocks of a file being freed only when it is truncated or forgotten by the kernel. */
+int MyFS::getParts(OpenFile &file, quint32 count, quint64 offset, QList<sDataBuf> &bufs)
+{
+    if (!count)
+        return 0;
+    if (!setPosition(file, offset))
+        return -EIO;
+    quint64 available = file.partLength - (file.currentAddr - file.partAddr);
+    while (true)
+    {
+        quint32 size = (quint32) qMin((quint64) count, available);
+        sDataBuf buf;
+        buf.mem = NULL;
+        buf.fd = fd;
+        buf.pos = file.currentAddr;
+        buf.size = size;
+        if (file.partHole)
+        {
+            /* A hole is read from the buffer of zeros (only the reads meet holes, see fillHoles()) */
+            buf.mem = (void*) zeros;
+            buf.fd = -1;
+            buf.pos = 0;
+            for (; buf.size > sizeof(zeros); buf.size -= sizeof(zeros))
+            {
+                sDataBuf chunk = buf;
+                chunk.size = sizeof(zeros);
+                bufs.append(chunk);
+            }
+        }
+        bufs.append(buf);
+        count -= size;
+        if (!count)
+        {
+            file.currentAddr += size;
+            return 0;
+        }
+        /* Go to the next part */
+        if (!nextPart(file))
+            return -EIO;
+        available = file.partLength - PART_HEADER_SIZE;
+    }
+}
+
+/* Moves file back to its first part */
+bool MyFS::resetPosition(OpenFile &file)
+{
+    quint64 indexAddr;
+    if (readFirstPart(file.nodeAddr, file.partLength, file.nextAddr, indexAddr) != 0)
+        return false;
+    file.partAddr = file.nodeAddr;
+    file.partHole = false;
+    file.currentAddr = file.nodeAddr + NODE_DATA;
+    file.partOffset = 0;
+    return true;
+}
+
+bool MyFS::setPosition(OpenFile &file, quint64 offset)
+{
+    if (!loadPartMap(file))
+        return false;
+    quint64 available = file.partLength - (file.partOffset ? PART_HEADER_SIZE : NODE_DATA);
+    if ((offset < file.partOffset) || ((offset >= file.partOffset + available) && file.nextAddr))
+    {
+        /* The part map gives the right part at once */
+        const PartMap *map = file.parts;
+        int i = findPart(map, offset);
+        file.partAddr = map->addrs.at(i);
+        file.partLength = map->lengths.at(i);
+        file.partHole = map->holes.at(i);
+        file.nextAddr = (i + 1 < map->addrs.count()) ? map->addrs.at(i + 1) : 0;
+        file.partOffset = map->offsets.at(i);
+        available = file.partLength - (file.partOffset ? PART_HEADER_SIZE : NODE_DATA);
+    }
+    /* Scan the file until the right offset range (the end of the last part being a valid position) */
+    while ((offset >= file.partOffset + available) && file.nextAddr)
+    {
+        if (!nextPart(file))
+            return false;
+        available = file.partLength - PART_HEADER_SIZE;
+    }
+    file.currentAddr = file.partAddr + (file.partOffset ? PART_HEADER_SIZE : NODE_DATA) + (offset - file.partOffset);
+    if (mySeek(file.currentAddr, SEEK_SET) == SEEK_ERROR)
+        return false;
+    return true;
+}
+
+/* Moves file to the beginning of the data of its next part */
+bool MyFS::nextPart(OpenFile &file)
+{
+    if (!file.nextAddr)
+        return false; /* Corrupted data */
+    file.partOffset += file.partLength - (file.partOffset ? PART_HEADER_SIZE : NODE_DATA);
+    file.partAddr = file.nextAddr;
+    file.currentAddr = file.partAddr + PART_HEADER_SIZE;
+    const PartMap *map = file.parts;
+    int i = (map && map->built) ? findPart(map, file.partOffset) : -1;
+    if ((i >= 0) && (map->addrs.at(i) == file.partAddr))
+    {
+        file.partLength = map->lengths.at(i);
+        file.partHole = map->holes.at(i);
+        file.nextAddr = (i + 1 < map->addrs.count()) ? map->addrs.at(i + 1) : 0;
+        return (mySeek(file.currentAddr, SEEK_SET) != SEEK_ERROR);
+    }
+    if (mySeek(file.partAddr, SEEK_SET) == SEEK_ERROR)
+        return false;
+    if (myRead(&file.partLength, 8) != 8)
+        return false;
+    if (myRead(&file.nextAddr, 8) != 8)
+        return false;
+    file.partHole = (file.partLength & PART_HOLE) != 0;
+    file.partLength &= ~PART_HOLE;
+    return true;
+}
+
+/* Returns the index of the last part of map whose data starts at offset or before */
+int MyFS::findPart(const PartMap *map, quint64 offset)
+{
+    int low = 1, high = map->offsets.count();
+    while (low < high)
+    {
+        int middle = low + (high - low) / 2;
+        if (map->offsets.at(middle) <= offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low - 1;
+}
+
+/* Builds the part map of file if it has not been built yet, and returns false on error */
+bool MyFS::loadPartMap(OpenFile &file)
+{
+    QMutexLocker locker(&filesLock);
+    PartMap *map = file.parts;
+    if (map->built)
+        return true;
+    quint64 partLength, nextAddr, indexAddr;
+    if (readFirstPart(file.nodeAddr, partLength, nextAddr, indexAddr) != 0)
+        return false;
+    map->offsets.clear();
+    map->addrs.clear();
+    map->lengths.clear();
+    map->holes.clear();
+    map->holeCount = 0;
+    map->offsets.append(0);
+    map->addrs.append(file.nodeAddr);
+    map->lengths.append(partLength);
+    map->holes.append(false);
+    if (indexAddr)
+    {
+        /* All the parts are listed by the index, only the length of the last one is missing */
+        quint64 count;
+        if (mySeek(indexAddr + 16, SEEK_SET) == SEEK_ERROR)
+            return false;
+        if (myRead(&count, 8) != 8)
+            return false;
+        QByteArray entries(16 * count, 0);
+        if (myRead(entries.data(), 16 * count) != (ssize_t) (16 * count))
+            return false;
+        const quint64 *entry = (const quint64*) entries.constData();
+        for (quint64 i = 0; i < count; ++i)
+        {
+            bool hole = (entry[2 * i + 1] & PART_HOLE) != 0;
+            map->offsets.append(entry[2 * i]);
+            map->addrs.append(entry[2 * i + 1] & ~PART_HOLE);
+            map->lengths.append(0);
+            map->holes.append(hole);
+            map->holeCount += hole;
+        }
+        for (quint64 i = 1; i < count; ++i)
+            map->lengths[i] = map->offsets.at(i + 1) - map->offsets.at(i) + PART_HEADER_SIZE;
+        if (count)
+        {
+            if (mySeek(map->addrs.at(count), SEEK_SET) == SEEK_ERROR)
+                return false;
+            if (myRead(&partLength, 8) != 8)
+                return false;
+            map->lengths[count] = partLength & ~PART_HOLE;
+        }
+    } else {
+        quint64 offset = partLength - NODE_DATA;
+        while (nextAddr)
+        {
+            if (mySeek(nextAddr, SEEK_SET) == SEEK_ERROR)
+                return false;
+            if (myRead(&partLength, 8) != 8)
+                return false;
+            bool hole = (partLength & PART_HOLE) != 0;
+            partLength &= ~PART_HOLE;
+            map->offsets.append(offset);
+            map->addrs.append(nextAddr);
+            if (myRead(&nextAddr, 8) != 8)
+                return false;
+            map->lengths.append(partLength);
+            map->holes.append(hole);
+            map->holeCount += hole;
+            offset += partLength - PART_HEADER_SIZE;
+        }
+    }
+    map->built = true;
+    return true;
+}
+
+/* Returns the part map of the regular file nodeAddr, shared by all its open handles (filesLock must be held) */
+PartMap *MyFS::usePartMap(quint64 nodeAddr)
+{
+    PartMap *&map = partMaps[nodeAddr];
+    if (!map)
+    {
+        map = new PartMap;
+        map->nodeAddr = nodeAddr;
+        map->built = false;
+        map->holeCount = 0;
+        map->users = 0;
+        map->bufferedBytes = 0;
+        map->bufferedLength = 0;
+    }
+    ++map->users;
+    return map;
+}
+
+/* Stops using map, which is deleted once no open handle uses it (filesLock must be held) */
+void MyFS::releasePartMap(PartMap *map)
+{
+    if (--map->users)
+        return;
+    partMaps.remove(map->nodeAddr);
+    /* Its buffer was flushed when its last writer was closed, unless that failed */
+    if (map->bufferedBytes)
+        bufferedTotal -= map->bufferedBytes;
+    delete map;
+}
+
+/* Copies the open regular file (or directory, as specified by isRegular) fd into file and returns true if there is such an open file */
+bool MyFS::getOpenFile(quint32 fd, bool isRegular, OpenFile &file)
+{
+    QMutexLocker locker(&filesLock);
+    if ((fd >= (quint32) openFiles.count()) || (!openFiles.at(fd).nodeAddr) || (openFiles.at(fd).isRegular != isRegular))
+        return false;
+    file = openFiles.at(fd);
+    return true;
+}
+
+/* Saves the position reached by file, a copy of the open file fd */
+void MyFS::putOpenFile(quint32 fd, const OpenFile &file)
+{
+    QMutexLocker locker(&filesLock);
+    if (fd < (quint32) openFiles.count())
+        openFiles[fd] = file;
+}
+
+/* Notes that count bytes were written at offset through file, an open file whose entry is held (nsLock held for writing) */
+void MyFS::markWritten(OpenFile &file, quint64 offset, quint64 count)
+{
+    file.flags |= OPEN_FILE_FLAGS_MODIFIED;
+    if (file.dirtyStart >= file.dirtyEnd)
+    {
+        file.dirtyStart = offset;
+        file.dirtyEnd = offset + count;
+    } else {
+        file.dirtyStart = qMin(file.dirtyStart, offset);
+        file.dirtyEnd = qMax(file.dirtyEnd, offset + count);
+    }
+    unsynced = 2;
+}
+
+/* Writes count bytes of buf at offset in file, an open file whose data goes that far, and returns 0 on success
+    (the holes of the range are allocated first) */
+int MyFS::writeAt(OpenFile &file, const void *buf, quint32 count, quint64 offset)
+{
+    int ret_value = fillHoles(file, offset, count);
+    if (ret_value != 0)
+        return ret_value;
+    if (!setPosition(file, offset))
+        return -EIO;
+    quint32 towrite = (quint32) qMin((quint64) count, file.partLength - (file.currentAddr - file.partAddr));
+    if (myWriteDirect(buf, towrite) != towrite)
+        return -EIO;
+    if (towrite == count)
+    {
+        file.currentAddr += count;
+        return 0;
+    }
+    const quint8 *mbuf = (const quint8*) buf + towrite;
+    count -= towrite;
+    while (true)
+    {
+        if (!nextPart(file))
+            return -EIO;
+        towrite = (quint32) qMin((quint64) count, file.partLength - PART_HEADER_SIZE);
+        if (myWriteDirect(mbuf, towrite) != towrite)
+            return -EIO;
+        if (towrite == count)
+        {
+            file.currentAddr = file.partAddr + PART_HEADER_SIZE + count;
+            return 0;
+        }
+        mbuf += towrite;
+        count -= towrite;
+    }
+}
+
+/* Writes count zeros at offset in file, an open file whose data goes that far, and returns 0 on success */
+int MyFS::zeroAt(OpenFile &file, quint64 offset, quint64 count)
+{
+    if (!setPosition(file, offset))
+        return -EIO;
+    quint64 towrite = qMin(count, file.partLength - (file.currentAddr - file.partAddr));
+    while (true)
+    {
+        if (!myWriteB(towrite))
+            return -EIO;
+        count -= towrite;
+        if (!count)
+        {
+            file.currentAddr = position;
+            return 0;
+        }
+        if (!nextPart(file))
+            return -EIO;
+        towrite = qMin(count, file.partLength - PART_HEADER_SIZE);
+    }
+}
+
+/* Allocates the holes of file in the count bytes at offset, which are about to be written (see fillHole()), and returns 0 on success */
+int MyFS::fillHoles(OpenFile &file, quint64 offset, quint64 count)
+{
+    if (!count)
+        return 0;
+    if (!loadPartMap(file))
+        return -EIO;
+    const PartMap *map = file.parts;
+    quint64 end = offset + count;
+    for (int i = findPart(map, offset); map->holeCount && (i < map->addrs.count()) && (map->offsets.at(i) < end); ++i)
+    {
+        if (!map->holes.at(i))
+            continue;
+        quint64 partEnd = map->offsets.at(i) + map->lengths.at(i) - PART_HEADER_SIZE;
+        int ret_value = fillHole(file, i, qMax(offset, map->offsets.at(i)), qMin(end, partEnd));
+        if (ret_value != 0)
+            return ret_value;
+        /* The hole was replaced by several parts */
+        i = findPart(map, partEnd - 1);
+    }
+    return 0;
+}
+
+/* Gives space to the data from start to end in the hole part of file (the index of a hole in its part map, nsLock held for writing),
+    and to up to HOLE_FILL_SIZE bytes of the hole on each side, which are zeroed. The rest of the hole is kept before and after the new parts. */
+int MyFS::fillHole(OpenFile &file, int part, quint64 start, quint64 end)
+{
+    PartMap *map = file.parts;
+    quint64 holeAddr = map->addrs.at(part), holeStart = map->offsets.at(part);
+    quint64 holeEnd = holeStart + map->lengths.at(part) - PART_HEADER_SIZE;
+    quint64 prevAddr = map->addrs.at(part - 1), nextAddr = (part + 1 < map->addrs.count()) ? map->addrs.at(part + 1) : 0;
+    /* The space is aligned, and no hole smaller than HOLE_FILL_SIZE is left */
+    quint64 first = qMax(holeStart, start & ~((quint64) HOLE_FILL_SIZE - 1));
+    quint64 last = qMin(holeEnd, (end + HOLE_FILL_SIZE - 1) & ~((quint64) HOLE_FILL_SIZE - 1));
+    if (first - holeStart < HOLE_FILL_SIZE)
+        first = holeStart;
+    if (holeEnd - last < HOLE_FILL_SIZE)
+        last = holeEnd;
+    quint64 partLength, secondAddr, indexAddr, dataAddr, lastAddr, tailAddr = 0;
+    int ret_value = readFirstPart(file.nodeAddr, partLength, secondAddr, indexAddr);
+    if (ret_value != 0)
+        return ret_value;
+    ret_value = getExactBlocks(last - first, dataAddr, lastAddr);
+    if (ret_value != 0)
+        return ret_value;
+    /* The parts replacing the hole, as in the part map */
+    QVector<quint64> offsets, addrs, lengths;
+    QVector<bool> holes;
+    quint64 header[2];
+    if (first > holeStart)
+    {
+        /* The hole is kept before the data */
+        offsets.append(holeStart);
+        addrs.append(holeAddr);
+        lengths.append(first - holeStart + PART_HEADER_SIZE);
+        holes.append(true);
+        header[0] = PART_HOLE | lengths.last();
+        header[1] = dataAddr;
+        if (mySeek(holeAddr, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(header, 16) != 16)
+            return -EIO;
+    } else {
+        /* The first part of an indexed file is followed by its index */
+        quint64 link = ((part == 1) && indexAddr) ? indexAddr : prevAddr;
+        if (mySeek(link + 8, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(&dataAddr, 8) != 8)
+            return -EIO;
+        if (part == 1)
+            secondAddr = dataAddr;
+        inodes.remove(file.nodeAddr);
+    }
+    for (quint64 addr = dataAddr, offset = first; addr; addr = header[1])
+    {
+        if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(header, 16) != 16)
+            return -EIO;
+        offsets.append(offset);
+        addrs.append(addr);
+        lengths.append(header[0]);
+        holes.append(false);
+        offset += header[0] - PART_HEADER_SIZE;
+    }
+    if (last < holeEnd)
+    {
+        /* And after it, in a new hole if it is kept before too */
+        if (first > holeStart)
+        {
+            ret_value = getHole(holeEnd - last, tailAddr);
+            if (ret_value != 0)
+                return ret_value;
+        } else {
+            tailAddr = holeAddr;
+        }
+        offsets.append(last);
+        addrs.append(tailAddr);
+        lengths.append(holeEnd - last + PART_HEADER_SIZE);
+        holes.append(true);
+        header[0] = PART_HOLE | lengths.last();
+        header[1] = nextAddr;
+        if (mySeek(tailAddr, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(header, 16) != 16)
+            return -EIO;
+    } else if (first == holeStart) {
+        ret_value = freeBlock(holeAddr);
+        if (ret_value != 0)
+            return ret_value;
+    }
+    quint64 link = tailAddr ? tailAddr : nextAddr;
+    if (mySeek(lastAddr + 8, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&link, 8) != 8)
+        return -EIO;
+    if (indexAddr)
+    {
+        /* The entry of the hole is replaced by those of the new parts */
+        quint64 size, count;
+        if (mySeek(indexAddr, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(&size, 8) != 8)
+            return -EIO;
+        if (mySeek(indexAddr + 16, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(&count, 8) != 8)
+            return -EIO;
+        QByteArray entries(16 * count, 0);
+        if (myRead(entries.data(), 16 * count) != (ssize_t) (16 * count))
+            return -EIO;
+        QByteArray added;
+        for (int i = 0; i < addrs.count(); ++i)
+        {
+            quint64 entry[2] = { offsets.at(i), addrs.at(i) | (holes.at(i) ? PART_HOLE : 0) };
+            added.append((const char*) entry, 16);
+        }
+        entries = entries.left(16 * (part - 1)) + added + entries.mid(16 * part);
+        if (24 + (quint64) entries.size() <= size)
+        {
+            count = entries.size() / 16;
+            if (mySeek(indexAddr + 16, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myWrite(&count, 8) != 8)
+                return -EIO;
+            if (mySeek(indexAddr + 24 + 16 * (part - 1), SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myWrite(entries.constData() + 16 * (part - 1), entries.size() - 16 * (part - 1)) != (ssize_t) (entries.size() - 16 * (part - 1)))
+                return -EIO;
+        } else {
+            ret_value = moveIndex(file.nodeAddr, indexAddr, secondAddr, entries);
+            if (ret_value != 0)
+                return ret_value;
+        }
+    }
+    /* Update the part map and the file descriptors */
+    map->offsets.removeAt(part);
+    map->addrs.removeAt(part);
+    map->lengths.removeAt(part);
+    map->holes.removeAt(part);
+    --map->holeCount;
+    for (int i = 0; i < addrs.count(); ++i)
+    {
+        map->offsets.insert(part + i, offsets.at(i));
+        map->addrs.insert(part + i, addrs.at(i));
+        map->lengths.insert(part + i, lengths.at(i));
+        map->holes.insert(part + i, holes.at(i));
+        map->holeCount += holes.at(i);
+    }
+    for (int i = 0; i < openFiles.count(); ++i)
+    {
+        if ((openFiles.at(i).nodeAddr == file.nodeAddr) && (!resetPosition(openFiles[i])))
+            return -EIO;
+    }
+    if (!resetPosition(file))
+        return -EIO;
+    /* Only the data around the range is zeroed, the caller writes the rest */
+    OpenFile copy = file;
+    if (first < start)
+        ret_value = zeroAt(copy, first, start - first);
+    if ((ret_value == 0) && (end < last))
+        ret_value = zeroAt(copy, end, last - end);
+    return ret_value;
+}
+
+/* Keeps the count bytes written at offset through file in the buffer of the file, merged with the data already there, and returns 0 on success.
+    The buffer is flushed once it holds more than WRITE_BUFFER_SIZE bytes, and all of them once they hold more than WRITE_BUFFER_TOTAL bytes
+    (nsLock has to be held for writing). */
+int MyFS::bufferWrite(OpenFile &file, const void *buf, quint32 count, quint64 offset)
+{
+    PartMap *map = file.parts;
+    if (map->buffered.isEmpty())
+        map->bufferedLength = file.fileLength;
+    int rangeCount = 0;
+    quint64 added = mergeRange(map->buffered, offset, buf, count, rangeCount);
+    map->bufferedBytes += added;
+    bufferedTotal += added;
+    map->bufferedLength = qMax(map->bufferedLength, offset + count);
+    if (map->bufferedBytes > WRITE_BUFFER_SIZE)
+        return flushBuffer(file.nodeAddr);
+    if (bufferedTotal > WRITE_BUFFER_TOTAL)
+        return flushBuffers();
+    return 0;
+}
+
+/* Writes the data buffered for the regular file nodeAddr into the container, the gaps past the end of the file being left as holes,
+    and returns 0 on success. The data is forgotten even on failure (nsLock has to be held for writing). */
+int MyFS::flushBuffer(quint64 nodeAddr)
+{
+    PartMap *map = partMaps.value(nodeAddr);
+    if ((!map) || map->buffered.isEmpty())
+        return 0;
+    QMap<quint64, QByteArray> ranges;
+    ranges.swap(map->buffered);
+    bufferedTotal -= map->bufferedBytes;
+    map->bufferedBytes = 0;
+    /* The file has an open handle, as it has a part map */
+    int i = 0;
+    while (openFiles.at(i).nodeAddr != nodeAddr)
+        ++i;
+    int ret_value = 0;
+    quint64 end = openFiles.at(i).fileLength;
+    for (QMap<quint64, QByteArray>::const_iterator it = ranges.constBegin(); (ret_value == 0) && (it != ranges.constEnd()); ++it)
+    {
+        quint64 rangeEnd = it.key() + it.value().size();
+        if (rangeEnd > end)
+        {
+            /* The gaps between the ranges written beyond the former end are left as holes */
+            if (it.key() > end)
+                ret_value = myTruncate(nodeAddr, it.key());
+            if (ret_value == 0)
+                ret_value = myTruncate(nodeAddr, rangeEnd, false);
+            end = rangeEnd;
+        }
+        /* A copy, so that the position of the handle is kept */
+        OpenFile file = openFiles.at(i);
+        if (ret_value == 0)
+            ret_value = writeAt(file, it.value().constData(), it.value().size(), it.key());
+    }
+    return ret_value;
+}
+
+/* Writes all the buffered data into the container (see flushBuffer()), and returns 0 on success */
+int MyFS::flushBuffers()
+{
+    int ret_value = 0;
+    if (!bufferedTotal)
+        return 0;
+    for (QHash<quint64, PartMap*>::const_iterator it = partMaps.constBegin(); it != partMaps.constEnd(); ++it)
+    {
+        int flushed = flushBuffer(it.key());
+        if (flushed != 0)
+            ret_value = flushed;
+    }
+    return ret_value;
+}
+
+/* Writes the data buffered for the open file fd into the container (see flushBuffer()), and returns 0 on success (no lock has to be held) */
+int MyFS::flushFile(quint32 fd)
+{
+    OpenFile file;
+    {
+        QReadLocker locker(&nsLock);
+        if (!getOpenFile(fd, true, file))
+            return -EBADF;
+        if (this->fd < 0) return -EIO;
+        if (file.parts->buffered.isEmpty())
+            return 0;
+    }
+    QWriteLocker locker(&nsLock);
+    if (!getOpenFile(fd, true, file))
+        return -EBADF;
+    if (this->fd < 0) return -EIO;
+    return flushBuffer(file.nodeAddr);
+}
+
+/* Forgets the data buffered for the regular file nodeAddr, which is being freed (nsLock has to be held for writing) */
+void MyFS::dropBuffer(quint64 nodeAddr)
+{
+    PartMap *map = partMaps.value(nodeAddr);
+    if (!map)
+        return;
+    bufferedTotal -= map->bufferedBytes;
+    map->bufferedBytes = 0;
+    map->buffered.clear();
+}
+
+void MyFS::closeOpenFile(quint32 fd)
+{
+    QMutexLocker locker(&filesLock);
+    if (openFiles.at(fd).parts)
+        releasePartMap(openFiles.at(fd).parts);
+    openFiles[fd].nodeAddr = 0;
+    openFiles[fd].parts = NULL;
+    while ((!openFiles.isEmpty()) && (!openFiles.last().nodeAddr))
+        openFiles.removeLast();
+}
+
+/* Writes size zeros in place, in the data of a regular file (the larger runs are zeroed by the file system, keeping their space) */
+bool MyFS::myWriteB(quint64 size)
+{
+    if ((size >= ZERO_RANGE_SIZE) && (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, position, (off_t) size) == 0))
+    {
+        position += size;
+        return true;
+    }
+    while (size > ZERO_RANGE_SIZE)
+    {
+        if (myWriteDirect(zeros, ZERO_RANGE_SIZE) != ZERO_RANGE_SIZE)
+            return false;
+        size -= ZERO_RANGE_SIZE;
+    }
+    return (myWriteDirect(zeros, size) == (ssize_t) size);
+}
+
+/* Maps the whole container, or maps it again if its size changed. On failure, the previous mapping is kept. */
+bool MyFS::remap()
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return false;
+    quint64 size = (quint64) st.st_size;
+    if (map && (size == mapSize))
+        return true;
+    if (!size)
+        return false;
+    void *addr;
+    if (map)
+        addr = mremap(map, mapSize, size, MREMAP_MAYMOVE);
+    else
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        perror(map ? "mremap" : "mmap");
+        return false;
+    }
+    map = (quint8*) addr;
+    mapSize = size;
+    return true;
+}
+
+void MyFS::unmap()
+{
+    if (map)
+    {
+        munmap(map, mapSize);
+        map = NULL;
+        mapSize = 0;
+    }
+}
+
+/* Same as lseek() on the container, except that the position is kept by each thread, so that fd can be shared by all of them */
+off_t MyFS::mySeek(off_t offset, int whence)
+{
+    off_t base;
+    switch (whence)
+    {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = position;
+        break;
+    case SEEK_END:
+        base = (off_t) containerSize;
+        break;
+    default:
+        errno = EINVAL;
+        return SEEK_ERROR;
+    }
+    if (base + offset < 0)
+    {
+        errno = EINVAL;
+        return SEEK_ERROR;
+    }
+    position = base + offset;
+    return position;
+}
+
+/* Same as read() on the container, copying from the mapping if the container is mapped, and seeing the changes not written in place yet */
+ssize_t MyFS::myRead(void *buf, size_t count)
+{
+    quint64 addr = (quint64) position;
+    ssize_t result;
+    if (!map)
+    {
+        result = pread(fd, buf, count, position);
+    } else if (addr >= mapSize) {
+        result = 0;
+    } else {
+        result = (ssize_t) qMin((quint64) count, mapSize - addr);
+        memcpy(buf, map + addr, result);
+    }
+    if (result <= 0)
+        return result;
+    position += result;
+    if (!committing.isEmpty())
+        readJournal(committing, addr, (quint8*) buf, (quint64) result);
+    if (!journal.isEmpty())
+        readJournal(journal, addr, (quint8*) buf, (quint64) result);
+    return result;
+}
+
+/* Same as write() on the container, except that the bytes are put into the running transaction, only written in place once it is committed.
+    This is how the metadata is written (nsLock must be held for writing). */
+ssize_t MyFS::myWrite(const void *buf, size_t count)
+{
+    if (!count)
+        return 0;
+    int rangeCount = 0;
+    journalBytes += mergeRange(journal, (quint64) position, buf, count, rangeCount);
+    journalBytes += (qint64) 16 * rangeCount;
+    position += count;
+    return (ssize_t) count;
+}
+
+/* Copies count bytes of buf at address start of ranges (which never overlap nor touch), merging the ones it overlaps or touches.
+    Returns the number of bytes added to ranges, and adds the change of their number to rangeCount. */
+quint64 MyFS::mergeRange(QMap<quint64, QByteArray> &ranges, quint64 start, const void *buf, quint64 count, int &rangeCount)
+{
+    quint64 end = start + count, added = count;
+    QMap<quint64, QByteArray>::iterator it = ranges.upperBound(start);
+    if (it != ranges.begin())
+    {
+        --it;
+        if (it.key() + it.value().size() < start)
+            ++it;
+    }
+    quint64 first = start;
+    QByteArray range;
+    if ((it != ranges.end()) && (it.key() <= start))
+    {
+        if (it.key() + it.value().size() >= end)
+        {
+            /* Already in a range */
+            memcpy(it.value().data() + (start - it.key()), buf, count);
+            return 0;
+        }
+        first = it.key();
+        range = it.value();
+        added -= it.key() + range.size() - start;
+        --rangeCount;
+        it = ranges.erase(it);
+    }
+    range.resize(end - first);
+    memcpy(range.data() + (start - first), buf, count);
+    while ((it != ranges.end()) && (it.key() <= end))
+    {
+        quint64 last = it.key() + it.value().size();
+        if (last > end)
+            range.append(it.value().constData() + (end - it.key()), last - end);
+        added -= qMin(last, end) - it.key();
+        --rangeCount;
+        it = ranges.erase(it);
+    }
+    ++rangeCount;
+    ranges.insert(first, range);
+    return added;
+}
+
+/* Same as write() on the container, copying to the mapping if the container is mapped (nsLock must be held for writing).
+    The data of the regular files (and the journal) is written in place this way, outside of the transactions. */
+ssize_t MyFS::myWriteDirect(const void *buf, size_t count)
+{
+    if ((!map) || (((quint64) position) + count > mapSize))
+    {
+        /* Writing past the end of the mapping grows the container, which is then mapped again */
+        ssize_t written = pwrite(fd, buf, count, position);
+        if (written > 0)
+            position += written;
+        if (((quint64) position) > containerSize)
+            containerSize = position;
+        if (map)
+            remap();
+        return written;
+    }
+    memcpy(map + position, buf, count);
+    position += count;
+    return (ssize_t) count;
+}
+
+char *MyFS::convStr(const QString &str)
+{
+    char *result = new char[str.length() + 1];
+    QByteArray strData = str.toLocal8Bit();
+    memcpy(result, strData.data(), str.length());
+    result[str.length()] = 0;
+    return result;
+}
+
+/* Allocates some blocks (linked together), puts the address of the first one into addr and returns 0 on success. */
+int MyFS::getBlocks(quint64 size, quint64 &addr)
+{
+    Q_ASSERT(size > 0);
+    int ret_value;
+    quint64 next_block = 0;
+    while (true)
+    {
+        ret_value = getBlock(size + PART_HEADER_SIZE, addr);
+        if ((ret_value != 0) && (ret_value != -ENOSPC))
+            return ret_value;
+        if (ret_value == 0)
+        {
+            if (next_block)
+            {
+                if (mySeek(-8, SEEK_CUR) == SEEK_ERROR)
+                    return -EIO;
+                if (myWrite(&next_block, 8) != 8)
+                    return -EIO;
+            }
+            return 0;
+        }
+        if (addr <= PART_HEADER_SIZE)
+        {
+            if (next_block)
+                freeBlocks(next_block);
+            return -ENOSPC;
+        }
+        size -= addr - PART_HEADER_SIZE;
+        ret_value = getBlock(addr, addr);
+        if (ret_value != 0)
+            return ret_value;
+        if (next_block)
+        {
+            if (mySeek(-8, SEEK_CUR) == SEEK_ERROR)
+                return -EIO;
+            if (myWrite(&next_block, 8) != 8)
+                return -EIO;
+        }
+        next_block = addr;
+    }
+}
+
+/* Allocates the block, writes its size in the first 8 bytes, 0 on the 8 next bytes, puts its address into addr and returns 0 on success.
+    In this case, fd will point to the 17-th byte of that block at the end of the call.
+    In the case it returns -ENOSPC, addr will contain the maximum free block size.
+    The smallest free block large enough is chosen from the index, so that no free block is read. */
+int MyFS::getBlock(quint64 size, quint64 &addr)
+{
+#if READONLY_FS
+    Q_UNUSED(size);
+    Q_UNUSED(addr);
+    return -EROFS;
+#else
+    Q_ASSERT(size > 0);
+    QMutexLocker locker(&allocLock);
+    addr = 0;
+    QMap<QPair<quint64, quint64>, quint64>::iterator best = freeBySize.lowerBound(qMakePair(size, (quint64) 0));
+    if (best == freeBySize.end())
+    {
+        int ret_value = growContainer(size);
+        if ((ret_value != 0) && (ret_value != -ENOSPC))
+            return ret_value;
+        best = freeBySize.lowerBound(qMakePair(size, (quint64) 0));
+    }
+    if (best == freeBySize.end())
+    {
+        if (!freeBySize.isEmpty())
+            addr = freeBySize.lastKey().first;
+        return -ENOSPC;
+    }
+    quint64 currentAddr = best.value(), bsize = best.key().first, value;
+    if (bsize >= size + MIN_BLOCK_SIZE)
+    {
+        /* We split the space in two parts */
+        if (mySeek(currentAddr, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        addr = currentAddr + bsize - size;
+        value = bsize - size;
+        if (myWrite(&value, 8) != 8)
+            return -EIO;
+        if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(&size, 8) != 8)
+            return -EIO;
+        value = 0;
+        if (myWrite(&value, 8) != 8)
+            return -EIO;
+        unindexFree(currentAddr, bsize);
+        indexFree(currentAddr, bsize - size);
+    } else {
+        /* We use all the space */
+        addr = currentAddr;
+        QMap<quint64, quint64>::iterator it = freeByAddr.find(currentAddr);
+        quint64 refAddr = SB_FIRST_BLANK, nextAddr = 0;
+        if (it != freeByAddr.begin())
+        {
+            QMap<quint64, quint64>::iterator prev = it;
+            --prev;
+            refAddr = prev.key() + 8;
+        }
+        if ((++it) != freeByAddr.end())
+            nextAddr = it.key();
+        if (mySeek(refAddr, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(&nextAddr, 8) != 8)
+            return -EIO;
+        if (refAddr == SB_FIRST_BLANK)
+            first_blank = nextAddr;
+        if (mySeek(addr + 8, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        value = 0;
+        if (myWrite(&value, 8) != 8)
+            return -EIO;
+        unindexFree(currentAddr, bsize);
+        size = bsize;
+    }
+    /* The sizes and links of the free blocks merged into this one are now part of its data */
+    dropJournal(addr + PART_HEADER_SIZE, size - PART_HEADER_SIZE);
+    return 0;
+#endif /* READONLY_FS */
+}
+
+/* Allocates some blocks (linked together) whose data is exactly size bytes, what the last one has in excess being freed, so that they
+    replace a part of the same size in the middle of a regular file. Puts the addresses of the first and last ones into addr and lastAddr. */
+int MyFS::getExactBlocks(quint64 size, quint64 &addr, quint64 &lastAddr)
+{
+    Q_ASSERT(size > 0);
+    quint64 block, previous = 0;
+    addr = 0;
+    while (size)
+    {
+        /* A spare header is asked for, so that the excess can always be freed as a block */
+        int ret_value = getBlock(size + 2 * PART_HEADER_SIZE, block);
+        if (ret_value == -ENOSPC)
+        {
+            if (block <= 2 * PART_HEADER_SIZE)
             {
-                /* Empty part to remove */
-                if (lseek(fd, beforeAddr, SEEK_SET) != beforeAddr)
-                    return -EIO;
-                if (write(fd, &next_block, 4) != 4)
-                    return -EIO;
-                ret_value = freeBlock(currentAddr - 4);
-                if (ret_value != 0)
-                    return ret_value;
-            } else {
-                /* Move following entries */
-                len += 5;
-                if (lseek(fd, -(len + 4), SEEK_CUR) == SEEK_ERROR)
-                    return -EIO;
-                if (write(fd, &addr, 4) != 4)
-                    return -EIO;
-                while (addr)
-                {
-                    if (lseek(fd, len, SEEK_CUR) == SEEK_ERROR)
-                        return -EIO;
-                    if (read(fd, &nameLen, 1) != 1)
-                        return -EIO;
-                    if (read(fd, &str_buffer, nameLen) != nameLen)
-                        return -EIO;
-                    if (read(fd, &addr, 4) != 4)
-                        return -EIO;
-                    if (lseek(fd, -(len + 5 + (int) nameLen), SEEK_CUR) == SEEK_ERROR)
-                        return -EIO;
-                    if (write(fd, &nameLen, 1) != 1)
-                        return -EIO;
-                    if (write(fd, &str_buffer, nameLen) != nameLen)
-                        return -EIO;
-                    if (write(fd, &addr, 4) != 4)
-                        return -EIO;
-                }
+                if (addr)
+                    freeBlocks(addr);
+                return -ENOSPC;
             }
-            /* Change the last modification time */
-            dirAddr += 8;
-            if (lseek(fd, dirAddr, SEEK_SET) != dirAddr)
+            ret_value = getBlock(block, block);
+        }
+        if (ret_value != 0)
+            return ret_value;
+        quint64 length, used;
+        if (mySeek(block, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(&length, 8) != 8)
+            return -EIO;
+        used = qMin(size, length - 2 * PART_HEADER_SIZE);
+        quint64 header[2] = { length - used - PART_HEADER_SIZE, 0 };
+        length = used + PART_HEADER_SIZE;
+        if (mySeek(block, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(&length, 8) != 8)
+            return -EIO;
+        if (mySeek(block + length, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(header, 16) != 16)
+            return -EIO;
+        ret_value = freeBlock(block + length);
+        if (ret_value != 0)
+            return ret_value;
+        if (previous)
+        {
+            if (mySeek(previous + 8, SEEK_SET) == SEEK_ERROR)
                 return -EIO;
-            addr = htonl(time(0));
-            if (write(fd, &addr, 4) != 4)
+            if (myWrite(&block, 8) != 8)
                 return -EIO;
-            /* And the number of hard links if need be */
-            if (isDir)
-            {
-                nlink = htons(nlink - 1);
-                if (write(fd, &nlink, 2) != 2)
-                    return -EIO;
-            }
-            return 0;
+        } else {
+            addr = block;
         }
+        previous = block;
+        size -= used;
     }
+    lastAddr = previous;
+    return 0;
 }
 
-int MyFS::myGetAttr(quint32 addr, sAttr &attr)
+/* Allocates a hole (see PART_HOLE) of size bytes of data, not linked to any other part, puts its address into addr and returns 0 on success */
+int MyFS::getHole(quint64 size, quint64 &addr)
 {
-    addr += 8;
-    if (lseek(fd, addr, SEEK_SET) != addr)
+    int ret_value = getBlock(HOLE_BLOCK_SIZE, addr);
+    if (ret_value != 0)
+        return ret_value;
+    quint64 header[3] = { PART_HOLE | (size + PART_HEADER_SIZE), 0, 0 };
+    if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
         return -EIO;
-    if (read(fd, &addr, 4) != 4)
+    if (myRead(&header[2], 8) != 8)
         return -EIO;
-    attr.mst_atime = (time_t) ntohl(addr);
-    attr.mst_mtime = attr.mst_atime;
-    quint16 mshort;
-    if (read(fd, &mshort, 2) != 2)
+    if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
         return -EIO;
-    attr.mst_nlink = (quint32) ntohs(mshort);
-    if (read(fd, &mshort, 2) != 2)
+    if (myWrite(header, 24) != 24)
         return -EIO;
-    attr.mst_mode = ntohs(mshort);
-    if (attr.mst_mode & SF_MODE_REGULARFILE)
+    return 0;
+}
+
+/* Frees the block at address addr and its following parts, and returns 0 on success. */
+int MyFS::freeBlocks(quint64 addr)
+{
+    int ret_value;
+    quint64 next_block;
+    while (true)
     {
-        if (read(fd, &addr, 4) != 4)
+        if (mySeek(addr + 8, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(&next_block, 8) != 8)
             return -EIO;
-        attr.mst_size = (quint64) ntohl(addr);
+        ret_value = freeBlock(addr);
+        if (ret_value != 0)
+            return ret_value;
+        if (!next_block)
+            break;
+        addr = next_block;
     }
     return 0;
 }
 
-int MyFS::myTruncate(quint32 addr, quint32 newsize)
+/* Frees the block at address addr and returns 0 on success.
+    Its neighbours in the free list are found in the index when it is added to it (see addFree()), so that only the block itself is read. */
+int MyFS::freeBlock(quint64 addr)
 {
 #if READONLY_FS
     Q_UNUSED(addr);
-    Q_UNUSED(newsize);
     return -EROFS;
 #else
-    quint32 block_size, next_block, file_size, mytime;
-    quint32 modifNodeAddr = addr, modifNodeSize = (quint32) newsize, modifNodePart = 0;
-    if (lseek(fd, addr, SEEK_SET) != addr)
-        return -EIO;
-    if (read(fd, &block_size, 4) != 4)
-        return -EIO;
-    if (read(fd, &next_block, 4) != 4)
-        return -EIO;
-    mytime = htonl(time(0));
-    if (write(fd, &mytime, 4) != 4)
-        return -EIO;
-    if (lseek(fd, 4, SEEK_CUR) == SEEK_ERROR)
+    QMutexLocker locker(&allocLock);
+    /* Get the length of the block to free */
+    quint64 block_len;
+    if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
         return -EIO;
-    if (read(fd, &file_size, 4) != 4)
+    if (myRead(&block_len, 8) != 8)
         return -EIO;
-    file_size = ntohl(file_size);
-    if (file_size == newsize)
-        return 0;
-    if (file_size < newsize)
+    if (block_len & PART_HOLE)
     {
-        /* We have to increase the size of the file, by appending zeros at the end */
-        if (lseek(fd, -4, SEEK_CUR) == SEEK_ERROR)
+        /* A hole gives its real size after its header */
+        if (mySeek(addr + PART_HEADER_SIZE, SEEK_SET) == SEEK_ERROR)
             return -EIO;
-        quint32 mynewsize = (quint32) newsize;
-        mynewsize = htonl(mynewsize);
-        if (write(fd, &mynewsize, 4) != 4)
+        if (myRead(&block_len, 8) != 8)
             return -EIO;
-        bool isFistBlock = true;
-        block_size = ntohl(block_size) - 20;
-        while (block_size < file_size)
-        {
-            file_size -= block_size;
-            newsize -= block_size;
-            if (!next_block)
-                return -EIO; /* Corrupted data */
-            next_block = ntohl(next_block);
-            if (lseek(fd, next_block, SEEK_SET) != next_block)
-                return -EIO;
-            addr = next_block;
-            if (read(fd, &block_size, 4) != 4)
-                return -EIO;
-            isFistBlock = false;
-            block_size = ntohl(block_size) - 8;
-            if (read(fd, &next_block, 4) != 4)
-                return -EIO;
-        }
-        memset(str_buffer, 0, 0x100);
-        if (block_size > file_size)
-        {
-            if (lseek(fd, addr + (isFistBlock ? 20 : 8) + file_size, SEEK_SET) == SEEK_ERROR)
-                return -EIO;
-            if (!myWriteB(qMin(block_size - file_size, (quint32) (newsize - file_size))))
-                return -EIO;
-        }
-        while (newsize > block_size)
+    }
+    /* It is only added to the free blocks by the next commit, so that nothing overwrites it before the transaction is on the disk */
+    freed.append(qMakePair(addr, block_len));
+    if (block_len > PART_HEADER_SIZE)
+        freedSpace += block_len - PART_HEADER_SIZE;
+    return 0;
+#endif /* READONLY_FS */
+}
+
+/* Adds the block at address addr (of length block_len) to the free blocks, merging it with its neighbours (allocLock has to be held) */
+int MyFS::addFree(quint64 addr, quint64 block_len)
+{
+    /* Find the previous and the next free blocks */
+    quint64 prevAddr = 0, prev_len = 0, nextAddr = 0, next_len = 0, afterAddr = 0;
+    QMap<quint64, quint64>::iterator it = freeByAddr.lowerBound(addr);
+    if (it != freeByAddr.end())
+    {
+        Q_ASSERT(it.key() != addr);
+        nextAddr = it.key();
+        next_len = it.value();
+        QMap<quint64, quint64>::iterator after = it;
+        if ((++after) != freeByAddr.end())
+            afterAddr = after.key();
+    }
+    if (it != freeByAddr.begin())
+    {
+        --it;
+        prevAddr = it.key();
+        prev_len = it.value();
+    }
+    bool mergePrev = prevAddr && (prevAddr + prev_len == addr);
+    bool mergeNext = nextAddr && (addr + block_len == nextAddr);
+    quint64 value;
+    if (mergePrev)
+    {
+        /* Merge with the previous free block (and maybe the next one) */
+        if (mySeek(prevAddr, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        value = prev_len + block_len + (mergeNext ? next_len : 0);
+        if (myWrite(&value, 8) != 8)
+            return -EIO;
+        if (mergeNext)
         {
-            newsize -= block_size;
-            if (!next_block)
-            {
-                int ret_value = getBlock(newsize + 8, next_block);
-                if ((ret_value != 0) && (ret_value != -ENOSPC))
-                    return ret_value;
-                if (ret_value == -ENOSPC)
-                {
-                    if (next_block <= 8)
-                        return -ENOSPC;
-                    block_size = next_block - 8;
-                    ret_value = getBlock(next_block, next_block);
-                    if (ret_value != 0)
-                        return ret_value;
-                } else {
-                    block_size = newsize;
-                }
-                if (lseek(fd, addr + 4, SEEK_SET) == SEEK_ERROR)
-                    return -EIO;
-                addr = next_block;
-                if (!modifNodePart)
-                    modifNodePart = next_block;
-                next_block = htonl(next_block);
-                if (write(fd, &next_block, 4) != 4)
-                    return -EIO;
-                next_block = 0;
-                if (lseek(fd, addr + 8, SEEK_SET) == SEEK_ERROR)
-                    return -EIO;
-            } else {
-                addr = ntohl(next_block);
-                if (lseek(fd, addr, SEEK_SET) == SEEK_ERROR)
-                    return -EIO;
-                if (read(fd, &block_size, 4) != 4)
-                    return -EIO;
-                block_size = ntohl(block_size);
-                if (read(fd, &next_block, 4) != 4)
-                    return -EIO;
-            }
-            if (!myWriteB(qMin(block_size, (quint32) newsize)))
+            if (myWrite(&afterAddr, 8) != 8)
                 return -EIO;
         }
-        /* Update the file descriptors */
-        for (int i = 0; i < openFiles.count(); ++i)
-        {
-            if (openFiles.at(i).nodeAddr == modifNodeAddr)
-            {
-                if (modifNodePart && (!openFiles.at(i).nextAddr))
-                    openFiles[i].nextAddr = modifNodePart;
-                openFiles[i].fileLength = modifNodeSize;
-            }
-        }
-        return 0;
     } else {
-        /* We have to reduce the size of the file */
-        if (lseek(fd, -4, SEEK_CUR) == SEEK_ERROR)
+        /* Change the link of the previous block */
+        quint64 refAddr = prevAddr ? prevAddr + 8 : SB_FIRST_BLANK;
+        if (mySeek(refAddr, SEEK_SET) == SEEK_ERROR)
             return -EIO;
-        quint32 mynewsize = (quint32) newsize;
-        mynewsize = htonl(mynewsize);
-        if (write(fd, &mynewsize, 4) != 4)
+        if (myWrite(&addr, 8) != 8)
             return -EIO;
-        if (!next_block)
-            return 0;
-        next_block = ntohl(next_block);
-        newsize -= ntohl(block_size) - 20;
-        while (newsize > 0)
-        {
-            if (lseek(fd, next_block, SEEK_SET) != next_block)
-                return -EIO;
-            addr = next_block;
-            if (read(fd, &block_size, 4) != 4)
-                return -EIO;
-            if (read(fd, &next_block, 4) != 4)
-                return -EIO;
-            if (!next_block)
-                return 0;
-            next_block = ntohl(next_block);
-            newsize -= ntohl(block_size) - 8;
-        }
-        addr += 4;
-        if (lseek(fd, addr, SEEK_SET) != addr)
+        if (!prevAddr)
+            first_blank = addr;
+        /* Merge with the next free block if possible */
+        if (mySeek(addr, SEEK_SET) == SEEK_ERROR)
             return -EIO;
-        addr = 0;
-        if (write(fd, &addr, 4) != 4)
+        value = block_len + (mergeNext ? next_len : 0);
+        if (myWrite(&value, 8) != 8)
+            return -EIO;
+        value = mergeNext ? afterAddr : nextAddr;
+        if (myWrite(&value, 8) != 8)
+            return -EIO;
+    }
+    /* Update the index */
+    if (mergeNext)
+    {
+        unindexFree(nextAddr, next_len);
+        block_len += next_len;
+    }
+    if (mergePrev)
+    {
+        unindexFree(prevAddr, prev_len);
+        addr = prevAddr;
+        block_len += prev_len;
+    }
+    indexFree(addr, block_len);
+    return 0;
+}
+
+/* Extends the container so that it ends with a free block of at least size bytes (allocLock has to be held) */
+int MyFS::growContainer(quint64 size)
+{
+    /* The free block at the end of the container (if any) is merged with the new space */
+    quint64 oldSize = containerSize, needed = size;
+    if (!freeByAddr.isEmpty())
+    {
+        QMap<quint64, quint64>::const_iterator last = freeByAddr.constEnd();
+        --last;
+        if (last.key() + last.value() == oldSize)
+            needed -= qMin(needed, last.value());
+    }
+    if (oldSize + needed > MAX_CONTAINER_SIZE)
+        return -ENOSPC;
+    /* The size is doubled so that growing a large file only extends the container a few times, each time contiguously on the disk */
+    quint64 grow = qMin(qMax(oldSize, needed), MAX_CONTAINER_SIZE - oldSize);
+    while (true)
+    {
+        int ret_value = extendContainer(grow);
+        if (ret_value == 0)
+            break;
+        if ((ret_value != -ENOSPC) || (grow == needed))
+            return ret_value;
+        /* Try again with only what is needed */
+        grow = needed;
+    }
+    /* The new size is committed with the new free block */
+    if (mySeek(SB_SIZE, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&containerSize, 8) != 8)
+        return -EIO;
+    return addFree(oldSize, grow);
+}
+
+/* Makes the container size bytes larger, and returns 0 on success (the new space is not added to the free blocks) */
+int MyFS::extendContainer(quint64 size)
+{
+    quint64 oldSize = containerSize;
+    if (fallocate(fd, 0, (off_t) oldSize, (off_t) size) != 0)
+    {
+        /* Without preallocation, the container is only made larger */
+        if (((errno != EOPNOTSUPP) && (errno != ENOSYS)) || (ftruncate(fd, (off_t) (oldSize + size)) != 0))
+            return (errno == ENOSPC) ? -ENOSPC : -EIO;
+    }
+    containerSize = oldSize + size;
+    if (map && (!remap()))
+    {
+        fprintf(stderr, "Warning: could not map %s again, falling back to read/write\n", filename);
+        unmap();
+    }
+    return 0;
+}
+
+/* Builds the index of the free blocks from the list, and returns 0 on success. */
+int MyFS::loadFreeIndex()
+{
+    freeByAddr.clear();
+    freeBySize.clear();
+    freeSpace = 0;
+    quint64 current = first_blank, size;
+    while (current)
+    {
+        if (mySeek(current, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(&size, 8) != 8)
             return -EIO;
-        int ret_value = freeBlocks(next_block);
+        indexFree(current, size);
+        if (myRead(&current, 8) != 8)
+            return -EIO;
+    }
+    return 0;
+}
+
+/* Adds the free block at address addr to the index.
+    In freeBySize, the key is made of the size and the address, so that the blocks of a given size are kept sorted by address. */
+void MyFS::indexFree(quint64 addr, quint64 size)
+{
+    freeByAddr.insert(addr, size);
+    freeBySize.insert(qMakePair(size, addr), addr);
+    if (size > PART_HEADER_SIZE)
+        freeSpace += size - PART_HEADER_SIZE;
+}
+
+/* Removes the free block at address addr from the index. */
+void MyFS::unindexFree(quint64 addr, quint64 size)
+{
+    freeByAddr.remove(addr);
+    freeBySize.remove(qMakePair(size, addr));
+    if (size > PART_HEADER_SIZE)
+        freeSpace -= size - PART_HEADER_SIZE;
+}
+
+int MyFS::getAddress(lString &pathname, quint64 &result)
+{
+    if (pathname.str_value[0] != '/') return -ENOENT;
+    while ((pathname.str_len > 0) && (pathname.str_value[pathname.str_len - 1] == '/'))
+        --pathname.str_len;
+    if (pathname.str_len == 0)
+    {
+        result = root_address;
+        return 0;
+    }
+    /* Get the last part of the path */
+    int len = pathname.str_len;
+    while (pathname.str_value[pathname.str_len - 1] != '/')
+        --pathname.str_len;
+    len -= pathname.str_len;
+    int start = pathname.str_len;
+    /* Run this function recursively on the beginning of the path */
+    int ret_value = getAddress(pathname, result);
+    if (ret_value != 0)
+        return ret_value;
+    /* Look for the last part of the pathname in the parent directory */
+    return lookupEntry(result, pathname.str_value + start, len, result);
+}
+
+/* Looks for the entry name (of length len) in the directory dirAddr, and puts its address into result */
+int MyFS::lookupEntry(quint64 dirAddr, const char *name, int len, quint64 &result)
+{
+    /* The cached entries are only those of searchable directories (see myChMod) */
+    if (dentries.lookup(dirAddr, name, len, result))
+        return 0;
+    NodeHeader header;
+    int ret_value = readHeader(dirAddr, header);
+    if (ret_value != 0)
+        return ret_value;
+    if (!(header.mode & SF_MODE_DIRECTORY))
+        return -ENOTDIR;
+    if (!(header.mode & S_IXUSR))
+        return -EACCES;
+    quint64 next_block = header.next;
+    if (header.mode & MODE_INDEXED)
+    {
+        quint64 partAddr;
+        ret_value = findIndexedEntry(dirAddr, next_block, name, len, partAddr, result);
         if (ret_value != 0)
             return ret_value;
-        /* Update the file descriptors */
-        for (int i = 0; i < openFiles.count(); ++i)
+        if ((len > 2) || (name[0] != '.') || ((len == 2) && (name[1] != '.')))
+            dentries.insert(dirAddr, name, len, result);
+        return 0;
+    }
+    if (mySeek(dirAddr + NODE_ENTRIES, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    while (true)
+    {
+        quint64 addr;
+        if (myRead(&addr, 8) != 8)
+            return -EIO;
+        if (!addr)
         {
-            if (openFiles.at(i).nodeAddr == modifNodeAddr)
-            {
-                if (openFiles.at(i).partOffset >= modifNodeSize)
-                {
-                    openFiles[i].partAddr = openFiles[i].nodeAddr;
-                    openFiles[i].currentAddr = openFiles[i].nodeAddr + 20;
-                    if (lseek(fd, modifNodeAddr, SEEK_SET) != modifNodeAddr)
-                        return -EIO;
-                    quint32 &pLen = openFiles[i].partLength;
-                    quint32 &pNext = openFiles[i].nextAddr;
-                    if (read(fd, &pLen, 4) != 4)
-                        return -EIO;
-                    pLen = ntohl(pLen);
-                    if (read(fd, &pNext, 4) != 4)
-                        return -EIO;
-                    pNext = ntohl(pNext);
-                    openFiles[i].partOffset = 0;
-                } else if (openFiles.at(i).partOffset + openFiles.at(i).partLength >= modifNodeSize)
-                {
-                    openFiles[i].nextAddr = 0;
-                }
-                openFiles[i].fileLength = modifNodeSize;
-            }
+            if (!next_block)
+                return -ENOENT;
+            next_block += 8;
+            if (mySeek(next_block, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myRead(&next_block, 8) != 8)
+                return -EIO;
+            continue;
+        }
+        unsigned char nameLen;
+        if (myRead(&nameLen, 1) != 1)
+            return -EIO;
+        if (myRead(&str_buffer, nameLen) != nameLen)
+            return -EIO;
+        if ((nameLen == len) && (memcmp(name, str_buffer, len) == 0))
+        {
+            result = addr;
+            /* "." and ".." are not cached, their targets being freed or moved without unlinking them */
+            if ((len > 2) || (name[0] != '.') || ((len == 2) && (name[1] != '.')))
+                dentries.insert(dirAddr, name, len, result);
+            return 0;
         }
-        return 0;
     }
-#endif /* READONLY_FS */
 }
 
-bool MyFS::setPosition(OpenFile &file, quint32 offset)
+/* Hash of an entry name in the directory indexes (FNV-1a) */
+quint32 MyFS::entryHash(const char *name, int len)
 {
-    if (offset < file.partOffset)
+    quint32 hash = 0x811C9DC5;
+    for (int i = 0; i < len; ++i)
     {
-        /* Scan the file from the beginning */
-        file.partAddr = file.nodeAddr;
-        if (lseek(fd, file.nodeAddr, SEEK_SET) != file.nodeAddr)
-            return false;
-        if (read(fd, &file.partLength, 4) != 4)
-            return false;
-        if (read(fd, &file.nextAddr, 4) != 4)
-            return false;
-        file.partLength = ntohl(file.partLength);
-        file.nextAddr = ntohl(file.nextAddr);
-        file.currentAddr = file.nodeAddr + 20;
-        file.partOffset = 0;
+        hash ^= (quint8) name[i];
+        hash *= 0x01000193;
     }
-    /* Scan the file until the right offset range */
-    quint32 available = file.partLength - (file.partOffset ? 8 : 20);
-    while (offset >= file.partOffset + available)
+    return hash;
+}
+
+/* Looks for the entry name (of length len) in the part partAddr of the directory dirAddr only, and puts its address into result */
+int MyFS::findInPart(quint64 dirAddr, quint64 partAddr, const char *name, int len, quint64 &result)
+{
+    quint64 pos = partAddr + ((partAddr == dirAddr) ? NODE_ENTRIES : PART_HEADER_SIZE);
+    if (mySeek(pos, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    while (true)
     {
-        file.partOffset += available;
-        if (lseek(fd, file.nextAddr, SEEK_SET) != file.nextAddr)
-            return false;
-        file.partAddr = file.nextAddr;
-        if (read(fd, &file.partLength, 4) != 4)
-            return false;
-        if (read(fd, &file.nextAddr, 4) != 4)
-            return false;
-        file.partLength = ntohl(file.partLength);
-        file.nextAddr = ntohl(file.nextAddr);
-        available = file.partLength - 8;
+        quint64 addr;
+        if (myRead(&addr, 8) != 8)
+            return -EIO;
+        if (!addr)
+            return -ENOENT;
+        unsigned char nameLen;
+        if (myRead(&nameLen, 1) != 1)
+            return -EIO;
+        if (myRead(str_buffer, nameLen) != nameLen)
+            return -EIO;
+        if ((nameLen == len) && (memcmp(name, str_buffer, len) == 0))
+        {
+            result = addr;
+            return 0;
+        }
     }
-    file.currentAddr = file.partAddr + (file.partOffset ? 8 : 20) + (offset - file.partOffset);
-    if (lseek(fd, file.currentAddr, SEEK_SET) != file.currentAddr)
-        return -EIO;
-    return true;
 }
 
-bool MyFS::myWriteB(quint32 size)
+/* Looks for the entry name (of length len) of the directory dirAddr in its index indexAddr.
+    Puts the address of the entry into result and the address of the part holding it into partAddr. */
+int MyFS::findIndexedEntry(quint64 dirAddr, quint64 indexAddr, const char *name, int len, quint64 &partAddr, quint64 &result)
 {
-    while (size > 0x100)
+    quint64 header[2];
+    if (mySeek(indexAddr + 24, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(header, 16) != 16)
+        return -EIO;
+    quint64 slotsAddr = header[0] + 16, mask = header[1] - 1;
+    quint32 hash = entryHash(name, len);
+    /* The table always has an empty slot, which ends the search */
+    for (quint64 slot = hash & mask; ; slot = (slot + 1) & mask)
     {
-        if (write(fd, str_buffer, 0x100) != 0x100)
-            return false;
-        size -= 0x100;
+        quint64 entry[2];
+        if (mySeek(slotsAddr + slot * 16, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myRead(entry, 16) != 16)
+            return -EIO;
+        if (!entry[1])
+            return -ENOENT;
+        if (entry[0] != hash)
+            continue;
+        partAddr = entry[1];
+        int ret_value = findInPart(dirAddr, partAddr, name, len, result);
+        if (ret_value != -ENOENT)
+            return ret_value;
     }
-    return (write(fd, str_buffer, size) == size);
 }
 
-char *MyFS::convStr(const QString &str)
+/* Puts the slot (hash, partAddr) into a table of directory index read in memory */
+void MyFS::putSlot(QByteArray &table, quint32 hash, quint64 partAddr)
 {
-    char *result = new char[str.length() + 1];
-    QByteArray strData = str.toLocal8Bit();
-    memcpy(result, strData.data(), str.length());
-    result[str.length()] = 0;
-    return result;
+    quint64 mask = (table.size() / 16) - 1, entry[2];
+    quint64 slot = hash & mask;
+    while (true)
+    {
+        memcpy(&entry[1], table.constData() + slot * 16 + 8, 8);
+        if (!entry[1])
+            break;
+        slot = (slot + 1) & mask;
+    }
+    entry[0] = hash;
+    entry[1] = partAddr;
+    memcpy(table.data() + slot * 16, entry, 16);
 }
 
-/* Allocates some blocks (linked together), puts the address of the first one into addr and returns 0 on success. */
-int MyFS::getBlocks(quint32 size, quint32 &addr)
+/* Builds the index of the directory dirAddr, whose entries are spread over several parts, and puts its address into indexAddr */
+int MyFS::buildDirIndex(quint64 dirAddr, quint64 &indexAddr)
 {
-    Q_ASSERT(size > 0);
-    int ret_value;
-    quint32 next_block = 0;
+    /* Get the hash and the part of each entry */
+    QVector<quint32> hashes;
+    QVector<quint64> parts;
+    quint64 partAddr = dirAddr, tail = dirAddr, secondPart = 0, addr;
+    if (mySeek(dirAddr + NODE_ENTRIES, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
     while (true)
     {
-        ret_value = getBlock(size + 8, addr);
-        if ((ret_value != 0) && (ret_value != -ENOSPC))
-            return ret_value;
-        if (ret_value == 0)
-        {
-            if (next_block)
-            {
-                if (lseek(fd, -4, SEEK_CUR) != -SEEK_ERROR)
-                    return -EIO;
-                if (write(fd, &next_block, 4) != 4)
-                    return -EIO;
-            }
-            return 0;
-        }
-        if (addr <= 8)
-        {
-            if (next_block)
-                freeBlocks(next_block);
-            return -ENOSPC;
-        }
-        size -= addr - 8;
-        ret_value = getBlock(addr, addr);
-        if (ret_value != 0)
-            return ret_value;
-        if (next_block)
+        if (myRead(&addr, 8) != 8)
+            return -EIO;
+        if (!addr)
         {
-            if (lseek(fd, -4, SEEK_CUR) != -SEEK_ERROR)
+            if (mySeek(partAddr + 8, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myRead(&addr, 8) != 8)
                 return -EIO;
-            if (write(fd, &next_block, 4) != 4)
+            if (!addr)
+                break;
+            if (partAddr == dirAddr)
+                secondPart = addr;
+            partAddr = addr;
+            tail = partAddr;
+            if (mySeek(partAddr + PART_HEADER_SIZE, SEEK_SET) == SEEK_ERROR)
                 return -EIO;
+            continue;
         }
-        next_block = htonl(addr);
+        unsigned char nameLen;
+        if (myRead(&nameLen, 1) != 1)
+            return -EIO;
+        if (myRead(str_buffer, nameLen) != nameLen)
+            return -EIO;
+        hashes.append(entryHash(str_buffer, nameLen));
+        parts.append(partAddr);
+    }
+    Q_ASSERT(secondPart);
+    /* Fill the table (at most half full) */
+    quint64 capacity = DIR_INDEX_SLOTS;
+    while (capacity < 2 * ((quint64) hashes.count() + 1))
+        capacity <<= 1;
+    QByteArray table(capacity * 16, 0);
+    for (int i = 0; i < hashes.count(); ++i)
+        putSlot(table, hashes.at(i), parts.at(i));
+    /* Write it */
+    quint64 tableAddr;
+    int ret_value = getBlock(capacity * 16 + PART_HEADER_SIZE, tableAddr);
+    if (ret_value != 0)
+        return ret_value;
+    if (myWrite(table.constData(), table.size()) != table.size())
+        return -EIO;
+    ret_value = getBlock(DIR_INDEX_HEADER_SIZE, indexAddr);
+    if (ret_value != 0)
+    {
+        freeBlock(tableAddr);
+        return ret_value;
     }
+    quint64 header[8];
+    header[0] = secondPart;
+    header[1] = 0;
+    header[2] = tableAddr;
+    header[3] = capacity;
+    header[4] = (quint64) hashes.count();
+    header[5] = tail;
+    header[6] = header[5];
+    header[7] = 0;
+    if (mySeek(-8, SEEK_CUR) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(header, 64) != 64)
+        return -EIO;
+    /* Link it after the first part */
+    if (mySeek(dirAddr + 8, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&indexAddr, 8) != 8)
+        return -EIO;
+    quint16 mshort;
+    if (mySeek(dirAddr + NODE_MODE, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(&mshort, 2) != 2)
+        return -EIO;
+    mshort |= MODE_INDEXED;
+    if (mySeek(-2, SEEK_CUR) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&mshort, 2) != 2)
+        return -EIO;
+    inodes.remove(dirAddr);
+    return 0;
 }
 
-/* Allocates the block, writes its size in the first 4 bytes, 0 on the 4 next bytes, puts its address into addr and returns 0 on success.
-    In this case, fd will point to the 9-th byte of that block at the end of the call.
-    In the case it returns -ENOSPC, addr will contain the maximum free block size. */
-int MyFS::getBlock(quint32 size, quint32 &addr)
+/* Adds the slot (hash, partAddr) to the directory index indexAddr, which is made larger when half full */
+int MyFS::addDirSlot(quint64 indexAddr, quint32 hash, quint64 partAddr)
 {
-#if READONLY_FS
-    Q_UNUSED(size);
-    Q_UNUSED(addr);
-    return -EROFS;
-#else
-    Q_ASSERT(size > 0);
-    quint32 currentAddr = first_blank, refAddr = 4, bsize;
-    addr = 0;
-    while (true)
+    quint64 header[3];
+    if (mySeek(indexAddr + 24, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(header, 24) != 24)
+        return -EIO;
+    quint64 tableAddr = header[0], capacity = header[1], count = header[2];
+    if (2 * (count + 1) > capacity)
     {
-        if (!currentAddr)
-            return -ENOSPC;
-        if (lseek(fd, currentAddr, SEEK_SET) != currentAddr)
+        /* Move the slots to a table twice as large */
+        QByteArray table(capacity * 16, 0), larger(capacity * 32, 0);
+        if (mySeek(tableAddr + PART_HEADER_SIZE, SEEK_SET) == SEEK_ERROR)
             return -EIO;
-        if (read(fd, &bsize, 4) != 4)
+        if (myRead(table.data(), table.size()) != table.size())
             return -EIO;
-        bsize = ntohl(bsize);
-        if (bsize >= size)
+        for (quint64 slot = 0; slot < capacity; ++slot)
         {
-            if (bsize >= size + MIN_BLOCK_SIZE)
-            {
-                /* We split the space in two parts */
-                if (lseek(fd, currentAddr, SEEK_SET) != currentAddr)
-                    return -EIO;
-                bsize -= size;
-                addr = currentAddr + bsize;
-                bsize = htonl(bsize);
-                if (write(fd, &bsize, 4) != 4)
-                    return -EIO;
-                if (lseek(fd, addr, SEEK_SET) != addr)
-                    return -EIO;
-                bsize = htonl(size);
-                if (write(fd, &bsize, 4) != 4)
-                    return -EIO;
-                currentAddr = 0;
-                if (write(fd, &currentAddr, 4) != 4)
-                    return -EIO;
-            } else {
-                /* We use all the space */
-                addr = currentAddr;
-                if (read(fd, &currentAddr, 4) != 4)
-                    return -EIO;
-                if (lseek(fd, refAddr, SEEK_SET) != refAddr)
-                    return -EIO;
-                if (write(fd, &currentAddr, 4) != 4)
-                    return -EIO;
-                if (lseek(fd, addr + 4, SEEK_SET) != addr + 4)
-                    return -EIO;
-                bsize = 0;
-                if (write(fd, &bsize, 4) != 4)
-                    return -EIO;
-            }
-            return 0;
-        } else {
-            if (bsize > addr)
-                addr = bsize;
+            quint64 entry[2];
+            memcpy(entry, table.constData() + slot * 16, 16);
+            if (entry[1])
+                putSlot(larger, (quint32) entry[0], entry[1]);
+        }
+        quint64 largerAddr;
+        int ret_value = getBlock(capacity * 32 + PART_HEADER_SIZE, largerAddr);
+        if ((ret_value != 0) && ((ret_value != -ENOSPC) || (count + 1 >= capacity)))
+            return ret_value;
+        /* Without room for it, the current table is kept as long as it has an empty slot */
+        if (ret_value == 0)
+        {
+            if (myWrite(larger.constData(), larger.size()) != larger.size())
+                return -EIO;
+            ret_value = freeBlock(tableAddr);
+            if (ret_value != 0)
+                return ret_value;
+            tableAddr = largerAddr;
+            capacity *= 2;
+            header[0] = tableAddr;
+            header[1] = capacity;
+            if (mySeek(indexAddr + 24, SEEK_SET) == SEEK_ERROR)
+                return -EIO;
+            if (myWrite(header, 16) != 16)
+                return -EIO;
         }
-        refAddr = currentAddr + 4;
-        if (read(fd, &currentAddr, 4) != 4)
-            return -EIO;
-        currentAddr = ntohl(currentAddr);
     }
-#endif /* READONLY_FS */
-}
-
-/* Frees the block at address addr and its following parts, and returns 0 on success. */
-int MyFS::freeBlocks(quint32 addr)
-{
-    int ret_value;
-    quint32 next_block;
+    /* Put the slot into the first empty one from its place */
+    quint64 mask = capacity - 1, slot = hash & mask, entry[2];
     while (true)
     {
-        if (lseek(fd, addr + 4, SEEK_SET) == SEEK_ERROR)
+        if (mySeek(tableAddr + PART_HEADER_SIZE + slot * 16, SEEK_SET) == SEEK_ERROR)
             return -EIO;
-        if (read(fd, &next_block, 4) != 4)
+        if (myRead(entry, 16) != 16)
             return -EIO;
-        ret_value = freeBlock(addr);
-        if (ret_value != 0)
-            return ret_value;
-        if (!next_block)
+        if (!entry[1])
             break;
-        addr = ntohl(next_block);
+        slot = (slot + 1) & mask;
     }
+    entry[0] = hash;
+    entry[1] = partAddr;
+    if (mySeek(-16, SEEK_CUR) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(entry, 16) != 16)
+        return -EIO;
+    ++count;
+    if (mySeek(indexAddr + 40, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&count, 8) != 8)
+        return -EIO;
     return 0;
 }
 
-/* Frees the block at address addr and returns 0 on success. */
-int MyFS::freeBlock(quint32 addr)
+/* Removes the slot (hash, partAddr) from the directory index indexAddr, the size bytes of the entry being reusable in its part */
+int MyFS::removeDirSlot(quint64 indexAddr, quint32 hash, quint64 partAddr, quint64 size)
 {
-#if READONLY_FS
-    Q_UNUSED(addr);
-    return -EROFS;
-#else
-    /* Get the length of the block to free */
-    quint32 block_len;
-    if (lseek(fd, addr, SEEK_SET) != addr)
+    quint64 header[3];
+    if (mySeek(indexAddr + 24, SEEK_SET) == SEEK_ERROR)
         return -EIO;
-    if (read(fd, &block_len, 4) != 4)
+    if (myRead(header, 24) != 24)
         return -EIO;
-    block_len = ntohl(block_len);
-    /* Search for the next free block */
-    quint32 refAddr = 0, currentAddr = first_blank, prev_len = 0;
-    while (currentAddr < addr)
+    quint64 slotsAddr = header[0] + PART_HEADER_SIZE, mask = header[1] - 1, count = header[2];
+    quint64 slot = hash & mask, entry[2];
+    while (true)
     {
-        refAddr = currentAddr;
-        if (lseek(fd, currentAddr, SEEK_SET) != currentAddr)
+        if (mySeek(slotsAddr + slot * 16, SEEK_SET) == SEEK_ERROR)
             return -EIO;
-        if (read(fd, &prev_len, 4) != 4)
+        if (myRead(entry, 16) != 16)
             return -EIO;
-        prev_len = ntohl(prev_len);
-        if (read(fd, &currentAddr, 4) != 4)
+        if (!entry[1])
             return -EIO;
-        if (!currentAddr)
+        if ((entry[0] == hash) && (entry[1] == partAddr))
             break;
-        currentAddr = ntohl(currentAddr);
+        slot = (slot + 1) & mask;
     }
-    /* Check merging requirements */
-    if (refAddr + prev_len == addr)
+    /* Move back the following slots which would not be found anymore through the empty slot */
+    quint64 next = slot;
+    while (true)
     {
-        if (addr + block_len == currentAddr)
-        {
-            /* Merge with the previous and the next free block */
-            quint32 currentLen, currentNext;
-            if (lseek(fd, currentAddr, SEEK_SET) != currentAddr)
-                return -EIO;
-            if (read(fd, &currentLen, 4) != 4)
-                return -EIO;
-            currentLen = ntohl(currentLen);
-            if (read(fd, &currentNext, 4) != 4)
-                return -EIO;
-            if (lseek(fd, refAddr, SEEK_SET) != refAddr)
-                return -EIO;
-            block_len += prev_len;
-            block_len += currentLen;
-            block_len = htonl(block_len);
-            if (write(fd, &block_len, 4) != 4)
-                return -EIO;
-            if (write(fd, &currentNext, 4) != 4)
-                return -EIO;
-        } else {
-            /* Merge with the previous free block */
-            if (lseek(fd, refAddr, SEEK_SET) != refAddr)
-                return -EIO;
-            block_len += prev_len;
-            block_len = htonl(block_len);
-            if (write(fd, &block_len, 4) != 4)
-                return -EIO;
-            currentAddr = htonl(currentAddr);
-            if (write(fd, &currentAddr, 4) != 4)
-                return -EIO;
-        }
-    } else {
-        /* Change the link of the previous block */
-        refAddr += 4;
-        if (lseek(fd, refAddr, SEEK_SET) != refAddr)
+        next = (next + 1) & mask;
+        if (mySeek(slotsAddr + next * 16, SEEK_SET) == SEEK_ERROR)
             return -EIO;
-        refAddr = htonl(addr);
-        if (write(fd, &refAddr, 4) != 4)
+        if (myRead(entry, 16) != 16)
             return -EIO;
-        if (addr + block_len == currentAddr)
-        {
-            /* Merge with the next free block */
-            quint32 currentLen, currentNext;
-            if (lseek(fd, currentAddr, SEEK_SET) != currentAddr)
-                return -EIO;
-            if (read(fd, &currentLen, 4) != 4)
-                return -EIO;
-            currentLen = ntohl(currentLen);
-            if (read(fd, &currentNext, 4) != 4)
-                return -EIO;
-            if (lseek(fd, addr, SEEK_SET) != addr)
-                return -EIO;
-            block_len += currentLen;
-            block_len = htonl(block_len);
-            if (write(fd, &block_len, 4) != 4)
-                return -EIO;
-            if (write(fd, &currentNext, 4) != 4)
-                return -EIO;
-        } else {
-            /* Do not merge with anything */
-            addr += 4;
-            if (lseek(fd, addr, SEEK_SET) != addr)
-                return -EIO;
-            currentAddr = htonl(currentAddr);
-            if (write(fd, &currentAddr, 4) != 4)
-                return -EIO;
-        }
+        if (!entry[1])
+            break;
+        quint64 home = entry[0] & mask;
+        if ((slot <= next) ? ((slot < home) && (home <= next)) : ((slot < home) || (home <= next)))
+            continue;
+        if (mySeek(slotsAddr + slot * 16, SEEK_SET) == SEEK_ERROR)
+            return -EIO;
+        if (myWrite(entry, 16) != 16)
+            return -EIO;
+        slot = next;
     }
+    entry[0] = 0;
+    entry[1] = 0;
+    if (mySeek(slotsAddr + slot * 16, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(entry, 16) != 16)
+        return -EIO;
+    --count;
+    if (mySeek(indexAddr + 40, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&count, 8) != 8)
+        return -EIO;
+    quint64 slack;
+    if (mySeek(indexAddr + 64, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(&slack, 8) != 8)
+        return -EIO;
+    slack += size;
+    if (mySeek(-8, SEEK_CUR) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(&slack, 8) != 8)
+        return -EIO;
     return 0;
-#endif /* READONLY_FS */
 }
 
-int MyFS::getAddress(lString &pathname, quint32 &result)
+/* Sets the address of the last part of a directory in its index indexAddr, where the next entries are then added */
+int MyFS::setDirTail(quint64 indexAddr, quint64 tail)
 {
-    if (pathname.str_value[0] != '/') return -ENOENT;
-    while ((pathname.str_value[pathname.str_len - 1] == '/') && (pathname.str_len > 0))
-        --pathname.str_len;
-    if (pathname.str_len == 0)
-    {
-        result = root_address;
-        return 0;
-    }
-    /* Checking whether or not the result is in the cache */
-    QString sValue = QString::fromLocal8Bit(pathname.str_value, pathname.str_len);
-    result = cache.value(sValue, 0);
-    if (result != 0)
-        return 0;
-    /* Get the last part of the path */
-    int len = pathname.str_len;
-    while (pathname.str_value[pathname.str_len - 1] != '/')
-        --pathname.str_len;
-    len -= pathname.str_len;
-    int start = pathname.str_len;
-    /* Run this function recursively on the beginning of the path */
-    int ret_value = getAddress(pathname, result);
-    if (ret_value != 0)
-        return ret_value;
-    /* Look for the last part of the pathname in the parent directory */
-    result += 4;
-    if (lseek(fd, result, SEEK_SET) != result)
+    if (mySeek(indexAddr + 48, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    quint64 fields[2];
+    fields[0] = tail;
+    fields[1] = tail;
+    if (myWrite(fields, 16) != 16)
         return -EIO;
-    if (read(fd, &result, 4) != 4)
+    return 0;
+}
+
+/* Puts into room the number of bytes left after the entries of the part partAddr of a directory (not its first part) */
+int MyFS::partRoom(quint64 partAddr, quint64 &room)
+{
+    quint64 size, addr;
+    if (mySeek(partAddr, SEEK_SET) == SEEK_ERROR)
         return -EIO;
-    if (read(fd, &str_buffer, 6) != 6)
+    if (myRead(&size, 8) != 8)
         return -EIO;
-    quint16 mshort;
-    if (read(fd, &mshort, 2) != 2)
+    quint64 pos = partAddr + PART_HEADER_SIZE;
+    if (mySeek(pos, SEEK_SET) == SEEK_ERROR)
         return -EIO;
-    mshort = ntohs(mshort);
-    if (!(mshort & SF_MODE_DIRECTORY))
-        return -ENOTDIR;
-    if (!(mshort & S_IXUSR))
-        return -EACCES;
     while (true)
     {
-        quint32 addr;
-        if (read(fd, &addr, 4) != 4)
+        if (myRead(&addr, 8) != 8)
             return -EIO;
+        pos += 8;
         if (!addr)
-        {
-            if (!result)
-                return -ENOENT;
-            result = ntohl(result) + 4;
-            if (lseek(fd, result, SEEK_SET) != result)
-                return -EIO;
-            if (read(fd, &result, 4) != 4)
-                return -EIO;
-            continue;
-        }
+            break;
         unsigned char nameLen;
-        if (read(fd, &nameLen, 1) != 1)
+        if (myRead(&nameLen, 1) != 1)
             return -EIO;
-        if (read(fd, &str_buffer, nameLen) != nameLen)
+        if (mySeek(nameLen, SEEK_CUR) == SEEK_ERROR)
             return -EIO;
-        if ((nameLen == len) && (memcmp(pathname.str_value + start, str_buffer, len) == 0))
+        pos += 1 + nameLen;
+    }
+    room = (size > pos - partAddr) ? size - (pos - partAddr) : 0;
+    return 0;
+}
+
+/* Chooses the part of a directory where an entry of size bytes is added, from its index indexAddr, and puts its address into partAddr.
+    The part of the last added entry is tried first. If it is full, the other parts are only tried if enough entries were removed from them.
+    The last part is chosen when no part has room left, so that a new part is then added after it. */
+int MyFS::findDirRoom(quint64 indexAddr, quint64 size, quint64 &partAddr)
+{
+    quint64 fields[3];
+    if (mySeek(indexAddr + 48, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(fields, 24) != 24)
+        return -EIO;
+    quint64 tail = fields[0], cursor = fields[1], slack = fields[2], room;
+    int ret_value = partRoom(cursor, room);
+    if (ret_value != 0)
+        return ret_value;
+    partAddr = cursor;
+    if (room < size)
+    {
+        partAddr = tail;
+        if (slack >= size)
         {
-            result = ntohl(addr);
-            /* Store the result in the cache (we won't care about limiting the cache size) */
-            cache[sValue] = result;
-            return 0;
+            /* Look for the next part with room left (the first part after the index follows the last one) */
+            quint64 current = cursor, next;
+            while (true)
+            {
+                if (mySeek(current + 8, SEEK_SET) == SEEK_ERROR)
+                    return -EIO;
+                if (myRead(&next, 8) != 8)
+                    return -EIO;
+                if (!next)
+                {
+                    if (mySeek(indexAddr + 8, SEEK_SET) == SEEK_ERROR)
+                        return -EIO;
+                    if (myRead(&next, 8) != 8)
+                        return -EIO;
+                }
+                current = next;
+                if (current == cursor)
+                {
+                    /* The room left is split in pieces too small */
+                    slack = 0;
+                    break;
+                }
+                ret_value = partRoom(current, room);
+                if (ret_value != 0)
+                    return ret_value;
+                if (room >= size)
+                {
+                    partAddr = current;
+                    break;
+                }
+            }
         }
     }
+    /* The room of the parts other than the last one comes from removed entries */
+    if (partAddr != tail)
+        slack = (slack > size) ? slack - size : 0;
+    fields[1] = partAddr;
+    fields[2] = slack;
+    if (mySeek(indexAddr + 56, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myWrite(fields + 1, 16) != 16)
+        return -EIO;
+    return 0;
+}
+
+/* Removes the index indexAddr of the directory dirAddr, which is then only read linearly */
+int MyFS::dropDirIndex(quint64 dirAddr, quint64 indexAddr)
+{
+    quint64 tableAddr;
+    if (mySeek(indexAddr + 24, SEEK_SET) == SEEK_ERROR)
+        return -EIO;
+    if (myRead(&tableAddr, 8) != 8)
+        return -EIO;
+    int ret_value = freeBlock(tableAddr);
+    if (ret_value != 0)
+        return ret_value;
+    return dropIndex(dirAddr, indexAddr);
 }
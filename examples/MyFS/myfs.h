@@ -2,54 +2,157 @@
 #define MYFS_H
 
 #include "sfuse/qsimplefuse.h"
+#include "dentrycache.h"
+#include "inodecache.h"
 
+#include <QByteArray>
 #include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QSet>
+#include <QVector>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QWaitCondition>
+
+#include <pthread.h>
 
 /*
     This implementation is an example of the usage of QSimpleFuse.
     As such, it is not efficient at all and not recommended for any real use.
 
-    It works as follows:
-    Each data block starts with its size on 4 bytes (network byte order ie. big endian).
-    There are three types of data blocks : FREE_BLOCK (free memory) and FILE_BLOCK (file).
-    The 8 very first bytes of the file however are not part of any block.
-    They are used to define the address of the root directory / (bytes 0-3) and the first free block (bytes 4-7).
+    It works as follows (version 2 of the format):
+    All the fields are in the byte order of the machine which created the container, the addresses and sizes being 8 bytes long.
+    Each data block starts with its size and the address of the next block (16 bytes in all).
+    There are two types of data blocks : FREE_BLOCK (free memory) and FILE_BLOCK (file).
+    The 64 very first bytes of the file however are not part of any block. They form the superblock:
+        0-3: "MyFS"
+        4-7: Version of the format (2), which also tells whether the container was made with another byte order
+        8-15: Address of the root directory /
+        16-23: Address of the first free block
+        24-31: Address of the journal
+        32-39: Size of the container at the last commit (the space after it is free, but for the journal)
+        40-63: Reserved (0)
+    A container of the first version (4 bytes fields in network byte order, without superblock) is upgraded when mounted:
+    its whole tree is copied into a new container of version 2, which then replaces it.
 
     FREE_BLOCK:
-        Its size is followed by the address of the next free block (4 bytes) and useless bytes.
+        Its size is followed by the address of the next free block and useless bytes.
         A null value is written if there is no such next free block.
+        The free blocks are sorted by address, and two free blocks are never contiguous.
+        The list is only read at mount, to build an index of the free blocks in memory.
+        When no free block is large enough, the container is extended (at least doubled) and the new space is added to the list.
 
     FILE_BLOCK:
         Its size is followed by the following bytes:
-        4-7: Address of the next part of the file (or 0 if this is the last part)
+        8-15: Address of the next part of the file (or 0 if this is the last part)
 
         And then, for each first part:
 
-        8-11: Last modification time
-        12-13: Number of hard links
-        14-15: SF_MODE_DIRECTORY for directory, SF_MODE_REGULARFILE for file, plus access rights
+        16-23: Last modification time
+        24-25: Number of hard links
+        26-27: SF_MODE_DIRECTORY for directory, SF_MODE_REGULARFILE for file, plus access rights
+        28-31: Reserved (0)
 
         If this is a directory, for each entry: (starts here for next parts)
-            * Address (4 bytes) (0 to end the list, which might then be continued on the next part of this "directory file")
+            * Address (8 bytes) (0 to end the list, which might then be continued on the next part of this "directory file")
             * Name length (NULL terminating byte excluded) (1 byte)
             * Name (without the NULL terminating byte)
 
         If this is a regular file:
-            * The size of its data (4 bytes)
+            * The size of its data (8 bytes)
             * Its data (starts here for next parts)
+        A next part of a regular file may also be a hole, read as zeros: its size then has the flag 1 << 63, and is the size of the part
+        the data would make (the header included). The block itself only holds its header and its real size (8 bytes).
+
+        A regular file made of several parts may also have an extent index, so that any offset is found without following the whole list.
+        Its mode then has the flag 0x1000 (never reported), and its first part is followed in the list by a block holding:
+        8-15: Address of the second part of the file
+        16-23: Number of entries
+        And then, for each part but the first one, in order: the offset of its data in the file (8 bytes) and its address (8 bytes),
+        which has the flag 1 << 63 if the part is a hole.
+
+        A directory made of several parts also has a hashed index of its entries, so that a name is found without reading every entry.
+        Its mode then has the flag 0x1000 (never reported), and its first part is followed in the list by a header holding:
+        8-15: Address of the second part of the directory
+        16-23: 0 (so that the header is read as a part without entries)
+        24-31: Address of the table of the index
+        32-39: Number of slots of the table (a power of two)
+        40-47: Number of used slots (at most half of them, unless the table could not be made larger)
+        48-55: Address of the last part of the directory
+        56-63: Address of the part where the last entry was added, tried first for the next one
+        64-71: Number of bytes of the removed entries, which may be reused before adding a new part
+        The parts of an indexed directory are only freed with it.
+        The table is a block which is not part of the list. Its size is followed by 8 useless bytes and the slots.
+        Each slot holds the hash of a name (8 bytes) and the address of the part holding that entry (8 bytes), or 0 if it is empty.
+        A name is looked for in the slots from the one given by its hash to the first empty one.
+
+    The metadata (everything but the data of the regular files) is only changed through a journal, so that a crash never leaves it half written.
+    The changes are kept in memory (see myWrite()) until they are committed all together, which:
+        * adds the blocks freed since the last commit to the free blocks (a freed block is never reused before that),
+        * flushes the container, so that the data written in place is on the disk before the nodes which point to it,
+        * writes the changes into the journal and flushes it,
+        * and then writes them in place.
+    The journal is a block holding:
+        16-23: Sequence number of the last commit
+        24-31: Length of its record
+        32-39: Checksum of the 24 first bytes (with a null checksum) and of the record (FNV-1a)
+        And then the record: for each range of changed bytes, its address (8 bytes), its length (8 bytes) and the bytes.
+    When the container is mounted, the record is written in place again, unless its checksum is wrong (the commit was interrupted).
+    When a record does not fit, the journal is moved to a larger block at the end of the container.
+    A commit is made at unmount, when the running transaction gets large or frees more space than there is left,
+    and as chosen by the durability mode (see MyFSDurability), which may be changed at run time: by sSync(), by sClose(), or every few milliseconds
+    by a thread of its own. All the callers arriving while a commit is flushed are served by the next one (group commit).
+    Before waiting for a commit, the writeback of the data written through the file is started (sync_file_range()), so that the flush has less to wait for.
+    While a record is flushed, the operations which do not allocate nor free blocks go on, the changes being committed still being seen.
+
+    The small writes are kept in memory, merged by open file, and written into the container (the gaps past its end being left as holes)
+    when the file is synced, closed, read, truncated, or when too much data is buffered (see bufferWrite()). The size of the file reported meanwhile includes them.
+
+    The headers of the first parts of the nodes are kept in a cache (see readHeader()).
+    Any change of a header (or freeing of a node) has to remove it from the cache, while nsLock is held for writing.
+
+    Locking (the file system is multithreaded):
+        nsLock is held for reading by the operations which only read the container, and for writing by those which change it.
+        allocLock protects the free block list, its index and freeSpace.
+        filesLock protects the open files while nsLock is only held for reading, and the nodes known by the kernel.
+        journalLock protects journalSequence, so that groupCommit() reads it while a commit is being written.
+        commitLock is held while committing (and protects committedSequence). It is taken before nsLock, or tried while nsLock is held.
+        flushLock protects the durability mode and the background flush thread, and is never held with another lock.
+        allocLock is also held while a commit is flushed without nsLock.
+        nsLock is otherwise always taken first, and the others are never held together.
 */
 
+/* Parts of a regular file, shared by all its open handles */
+struct PartMap
+{
+    quint64 nodeAddr;
+    QVector<quint64> offsets; /* Offset in the file of the data of each part */
+    QVector<quint64> addrs; /* Address of each part */
+    QVector<quint64> lengths; /* Length of each part (without PART_HOLE) */
+    QVector<bool> holes; /* Whether each part is a hole */
+    int holeCount;
+    bool built; /* Whether the vectors are up to date (they are built when first needed) */
+    int users; /* Number of open handles of the file */
+    QMap<quint64, QByteArray> buffered; /* Data written through the handles but not yet into the container, by offset (see bufferWrite()) */
+    quint64 bufferedBytes;
+    quint64 bufferedLength; /* Length of the file with the buffered data (only meaningful if there is any) */
+};
+
 struct OpenFile
 {
-    quint32 nodeAddr;
-    quint32 partAddr; /* Only used in regular files */
-    quint32 partLength; /* Only used in regular files */
-    quint32 nextAddr;
-    quint32 currentAddr;
-    quint32 partOffset; /* Only used in regular files */
-    quint32 fileLength; /* Only used in regular files */
+    quint64 nodeAddr;
+    quint64 partAddr; /* Only used in regular files */
+    quint64 partLength; /* Only used in regular files */
+    bool partHole; /* Whether the part is a hole, read as zeros (only used in regular files) */
+    quint64 nextAddr;
+    quint64 currentAddr;
+    quint64 partOffset; /* Only used in regular files */
+    quint64 fileLength; /* Only used in regular files */
+    quint64 dirtyStart, dirtyEnd; /* Range of the data written since the last sync (only used in regular files, empty if equal) */
     quint8 flags; /* Only used in regular files (see constants below) */
     bool isRegular;
+    PartMap *parts; /* Only used in regular files */
 };
 
 #define OPEN_FILE_FLAGS_PREAD    1
@@ -57,11 +160,29 @@ struct OpenFile
 #define OPEN_FILE_FLAGS_NOATIME  4
 #define OPEN_FILE_FLAGS_MODIFIED 8
 
+/* Default maximum number of node headers kept in the cache */
+#define INODE_CACHE_SIZE 0x10000
+
+/* When the changes are committed (whatever the mode, they are committed at unmount and when the journal gets large) */
+enum MyFSDurability
+{
+    DURABILITY_NONE,     /* Never otherwise */
+    DURABILITY_PERIODIC, /* In the background, every few milliseconds (sSync() and sClose() do not wait) */
+    DURABILITY_ON_CLOSE, /* When a modified file is closed */
+    DURABILITY_STRICT    /* By sSync() (flush and fsync), and when a modified file is closed */
+};
+
+/* Default interval between two commits of the periodic mode, in milliseconds */
+#define DURABILITY_INTERVAL 1000
+
 class MyFS : public QSimpleFuse
 {
 public:
-    MyFS(QString mountPoint, QString filename);
+    MyFS(QString mountPoint, QString filename, bool mapped = true, quint32 inodeCacheSize = INODE_CACHE_SIZE);
     ~MyFS();
+    void inodeCacheStats(quint64 &hits, quint64 &misses);
+    void setDurability(MyFSDurability mode, quint32 interval = DURABILITY_INTERVAL);
+    MyFSDurability durability();
     static void createNewFilesystem(QString filename);
     void sInit();
     void sDestroy();
@@ -77,34 +198,170 @@ public:
     int sOpen(const lString &pathname, int flags, quint32 &fd);
     int sRead(quint32 fd, void *buf, quint32 count, quint64 offset);
     int sWrite(quint32 fd, const void *buf, quint32 count, quint64 offset);
+    int sReadBuf(quint32 fd, quint32 count, quint64 offset, QList<sDataBuf> &bufs);
+    int sWriteBuf(quint32 fd, quint32 count, quint64 offset, QList<sDataBuf> &bufs);
     int sSync(quint32 fd);
     int sClose(quint32 fd);
     int sOpenDir(const lString &pathname, quint32 &fd);
     int sReadDir(quint32 fd, char *&name);
+    int sReadDirPlus(quint32 fd, char *&name, sAttr &attr);
+    int sReadDirBatch(quint32 fd, quint64 cookie, quint32 count, QList<sDirEntry> &entries);
     int sCloseDir(quint32 fd);
     int sAccess(const lString &pathname, quint8 mode);
     int sFTruncate(quint32 fd, quint64 newsize);
     int sFGetAttr(quint32 fd, sAttr &attr);
+    int sLookup(quint64 parent, const lString &name, quint64 &node, sAttr &attr);
+    void sForget(quint64 node, quint64 nlookup);
+    int sIGetAttr(quint64 node, sAttr &attr);
+    int sIMkFile(quint64 parent, const lString &name, quint16 mst_mode, quint64 &node, sAttr &attr);
+    int sIRmFile(quint64 parent, const lString &name, bool isDir);
+    int sIMvFile(quint64 parentBefore, const lString &nameBefore, quint64 parentAfter, const lString &nameAfter);
+    int sILink(quint64 node, quint64 newParent, const lString &newName, sAttr &attr);
+    int sIChMod(quint64 node, quint16 mst_mode);
+    int sITruncate(quint64 node, quint64 newsize);
+    int sIUTime(quint64 node, time_t mst_atime, time_t mst_mtime);
+    int sIOpen(quint64 node, int flags, quint32 &fd);
+    int sIOpenDir(quint64 node, quint32 &fd);
+    int sIAccess(quint64 node, quint8 mode);
 private:
-    int myLink(quint32 file, const lString &pathname, quint32 *parentAddr = 0);
-    int myUnlink(const lString &pathname, bool &isDir, quint32 *nodeAddr = 0);
-    int myGetAttr(quint32 addr, sAttr &attr);
-    int myTruncate(quint32 addr, quint32 newsize);
-    bool setPosition(OpenFile &file, quint32 offset);
-    bool myWriteB(quint32 size);
+    int loadContainer();
+    int upgradeContainer(int oldFd);
+    int upgradeDir(int oldFd, quint32 oldDir, quint64 newDir, QHash<quint32, quint64> &links);
+    int upgradeData(int oldFd, quint32 oldAddr, quint32 next, quint32 size, quint64 file);
+    int replayJournal();
+    void checkJournal();
+    int commitJournal(bool unlock = false);
+    int releaseFreed();
+    int applyJournal();
+    int moveJournal(quint64 size);
+    void dropJournal(quint64 addr, quint64 count);
+    static quint64 journalChecksum(const QByteArray &record);
+    static void readJournal(const QMap<quint64, QByteArray> &ranges, quint64 addr, quint8 *buf, quint64 count);
+    static quint64 mergeRange(QMap<quint64, QByteArray> &ranges, quint64 start, const void *buf, quint64 count, int &rangeCount);
+    int groupCommit();
+    int syncFile(quint32 fd);
+    void startWriteback(OpenFile &file);
+    void startFlusher();
+    void stopFlusher();
+    static void *flushThread(void *arg);
+    void flushLoop();
+    quint64 toNode(quint64 addr) const;
+    quint64 toAddress(quint64 node) const;
+    static int splitPath(lString &pathname, const char *&name, int &len);
+    int myChMod(quint64 nodeAddr, quint16 mst_mode);
+    int mySetSize(quint64 nodeAddr, quint64 newsize);
+    int myUTime(quint64 nodeAddr, time_t mst_mtime);
+    int myOpen(quint64 nodeAddr, int flags, quint32 &fd);
+    int myOpenDir(quint64 nodeAddr, quint32 &fd);
+    int myReadDir(quint32 fd, char *&name, quint64 &entryAddr);
+    int myAccess(quint64 addr, quint8 mode);
+    int myHardLink(quint64 nodeAddr, quint64 dirAddr, const char *name, int len);
+    int myMkFile(quint64 dirAddr, const char *name, int len, quint16 mst_mode, quint64 &file);
+    int myMove(quint64 dirBefore, const char *nameBefore, int lenBefore, quint64 dirAfter, const char *nameAfter, int lenAfter);
+    int releaseNode(quint64 addr);
+    int myLink(quint64 dirAddr, quint64 file, const char *name, int len, bool isDir);
+    int myUnlink(quint64 dirAddr, const char *name, int len, bool &isDir, quint64 *nodeAddr = 0);
+    int myGetAttr(quint64 addr, sAttr &attr);
+    int readHeader(quint64 addr, NodeHeader &header);
+    int myTruncate(quint64 addr, quint64 newsize, bool fill = true);
+    int readFirstPart(quint64 nodeAddr, quint64 &partLength, quint64 &nextAddr, quint64 &indexAddr);
+    int findExtent(quint64 indexAddr, quint64 offset, bool strict, quint64 &partAddr, quint64 &partOffset, quint64 &count);
+    int indexPart(quint64 nodeAddr, quint64 partOffset, quint64 partAddr);
+    int moveIndex(quint64 nodeAddr, quint64 indexAddr, quint64 nextAddr, const QByteArray &entries);
+    int dropIndex(quint64 nodeAddr, quint64 indexAddr);
+    static quint32 entryHash(const char *name, int len);
+    static void putSlot(QByteArray &table, quint32 hash, quint64 partAddr);
+    int findInPart(quint64 dirAddr, quint64 partAddr, const char *name, int len, quint64 &result);
+    int findIndexedEntry(quint64 dirAddr, quint64 indexAddr, const char *name, int len, quint64 &partAddr, quint64 &result);
+    int buildDirIndex(quint64 dirAddr, quint64 &indexAddr);
+    int addDirSlot(quint64 indexAddr, quint32 hash, quint64 partAddr);
+    int removeDirSlot(quint64 indexAddr, quint32 hash, quint64 partAddr, quint64 size);
+    int setDirTail(quint64 indexAddr, quint64 tail);
+    int partRoom(quint64 partAddr, quint64 &room);
+    int findDirRoom(quint64 indexAddr, quint64 size, quint64 &partAddr);
+    int dropDirIndex(quint64 dirAddr, quint64 indexAddr);
+    int getParts(OpenFile &file, quint32 count, quint64 offset, QList<sDataBuf> &bufs);
+    bool resetPosition(OpenFile &file);
+    bool setPosition(OpenFile &file, quint64 offset);
+    bool nextPart(OpenFile &file);
+    static int findPart(const PartMap *map, quint64 offset);
+    bool loadPartMap(OpenFile &file);
+    PartMap *usePartMap(quint64 nodeAddr);
+    void releasePartMap(PartMap *map);
+    bool getOpenFile(quint32 fd, bool isRegular, OpenFile &file);
+    void putOpenFile(quint32 fd, const OpenFile &file);
+    void closeOpenFile(quint32 fd);
+    void markWritten(OpenFile &file, quint64 offset, quint64 count);
+    int writeAt(OpenFile &file, const void *buf, quint32 count, quint64 offset);
+    int zeroAt(OpenFile &file, quint64 offset, quint64 count);
+    int fillHoles(OpenFile &file, quint64 offset, quint64 count);
+    int fillHole(OpenFile &file, int part, quint64 start, quint64 end);
+    int bufferWrite(OpenFile &file, const void *buf, quint32 count, quint64 offset);
+    int flushBuffer(quint64 nodeAddr);
+    int flushBuffers();
+    int flushFile(quint32 fd);
+    void dropBuffer(quint64 nodeAddr);
+    bool myWriteB(quint64 size);
     static char *convStr(const QString &str);
-    int getBlocks(quint32 size, quint32 &addr);
-    int getBlock(quint32 size, quint32 &addr);
-    int freeBlocks(quint32 addr);
-    int freeBlock(quint32 addr);
+    bool remap();
+    void unmap();
+    off_t mySeek(off_t offset, int whence);
+    ssize_t myRead(void *buf, size_t count);
+    ssize_t myWrite(const void *buf, size_t count);
+    ssize_t myWriteDirect(const void *buf, size_t count);
+    int getBlocks(quint64 size, quint64 &addr);
+    int getBlock(quint64 size, quint64 &addr);
+    int getExactBlocks(quint64 size, quint64 &addr, quint64 &lastAddr);
+    int getHole(quint64 size, quint64 &addr);
+    int freeBlocks(quint64 addr);
+    int freeBlock(quint64 addr);
+    int addFree(quint64 addr, quint64 block_len);
+    int growContainer(quint64 size);
+    int extendContainer(quint64 size);
+    int loadFreeIndex();
+    void indexFree(quint64 addr, quint64 size);
+    void unindexFree(quint64 addr, quint64 size);
     /* Warning: the following function does not preserve pathname (length changed) */
-    int getAddress(lString &pathname, quint32 &result);
+    int getAddress(lString &pathname, quint64 &result);
+    int lookupEntry(quint64 dirAddr, const char *name, int len, quint64 &result);
 private:
     char *filename;
     int fd;
-    quint32 root_address, first_blank;
-    QHash<QString, quint32> cache;
+    bool mapped; /* Whether the container should be accessed through a memory mapping */
+    quint8 *map; /* Mapping of the whole container (NULL if not mapped) */
+    quint64 mapSize;
+    quint64 containerSize; /* Size of the container, which only grows through extendContainer() and myWriteDirect() */
+    quint64 root_address, first_blank, journal_address;
+    quint64 journal_size; /* Size of the journal block */
+    QMap<quint64, QByteArray> journal; /* Bytes changed by the running transaction, by address (the ranges never overlap nor touch) */
+    quint64 journalBytes; /* Length of the record of the running transaction */
+    QMap<quint64, QByteArray> committing; /* Bytes changed by the transaction being committed, until they are written in place */
+    QMutex journalLock;
+    QMutex commitLock;
+    quint64 journalSequence; /* Sequence number of the next commit */
+    quint64 committedSequence; /* Sequence number of the last commit */
+    QMutex flushLock;
+    QWaitCondition flushCondition; /* Wakes the flush thread up when the mode changes or when it has to stop */
+    MyFSDurability durabilityMode;
+    quint32 flushInterval; /* Interval between two commits of the periodic mode, in milliseconds */
+    pthread_t flusher; /* Runs while the container is loaded, but only commits in the periodic mode */
+    bool flusherRunning, flusherStop;
+    quint8 unsynced; /* Number of periodic commits still owed to the data written in place (two, as sWriteBuf() returns before it is written) */
+    QReadWriteLock nsLock;
+    QMutex allocLock;
+    QMap<quint64, quint64> freeByAddr; /* Size of each free block, by address */
+    QMap<QPair<quint64, quint64>, quint64> freeBySize; /* Address of each free block, by size then address */
+    quint64 freeSpace; /* Free bytes in the free blocks, sizes and links excluded */
+    QList<QPair<quint64, quint64> > freed; /* Address and length of the blocks freed by the running transaction (only changed with nsLock held for writing, like the journal) */
+    quint64 freedSpace; /* Bytes of these blocks, sizes and links excluded */
+    QMutex filesLock;
+    DentryCache dentries;
+    InodeCache inodes; /* Headers of the nodes, shared by all the operations and open handles */
     QList<OpenFile> openFiles;
+    QHash<quint64, PartMap*> partMaps; /* Part maps of the open regular files */
+    quint64 bufferedTotal; /* Bytes buffered for all of them */
+    QHash<quint64, quint64> lookups; /* Lookup count of the nodes known by the kernel (inode mode) */
+    QSet<quint64> orphans; /* Removed nodes still known by the kernel */
 };
 
 #endif // MYFS_H
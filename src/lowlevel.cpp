@@ -0,0 +1,712 @@
+/*
+ * Copyright (c) 2015, Rémi Bazin <bazin.remi@gmail.com>
+ * All rights reserved.
+ * See LICENSE for licensing details.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <qglobal.h>
+
+#include "lowlevel.h"
+#include "simplifier.h"
+#include "qsimplefuse.h"
+
+#define LLDATA(req) ((LowLevelData*) fuse_req_userdata(req))
+#define INSTANCE(req) (LLDATA(req)->instance)
+
+/* Measures and traces the operation until the end of the current scope */
+#define OPERATION_SCOPE(req, op, node, fh, offset, size) \
+    OpScope opScope(LLDATA(req)->stats, LLDATA(req)->trace, op, (quint64) (node), fh, offset, size)
+
+/* Inode number given to directory entries (the kernel does a lookup anyway) */
+#define UNKNOWN_INO 0xFFFFFFFF
+
+struct LowLevelDir
+{
+    quint32 fd;
+    off_t offset; // offset of the next entry
+    char *pending; // entry already read from the backend but not sent yet
+    mode_t pendingMode; // type of the pending entry (0 if unknown)
+    bool stream; // the backend does not implement sReadDirBatch
+    bool plain; // the backend does not implement sReadDirPlus either
+};
+
+/* Replies with an error (or success if err is 0), recording it as the result of the operation */
+static void replyError(fuse_req_t req, int err)
+{
+    OpScope::setResult(-err);
+    fuse_reply_err(req, err);
+}
+
+static void replyEntry(fuse_req_t req, quint64 node, const sAttr &attr)
+{
+    fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = (fuse_ino_t) node;
+    makeStat(attr, LLDATA(req)->def_stat, &e.attr);
+    e.attr.st_ino = e.ino;
+    e.attr_timeout = LLDATA(req)->options.attr_timeout;
+    e.entry_timeout = LLDATA(req)->options.entry_timeout;
+    fuse_reply_entry(req, &e);
+}
+
+/* Tells the kernel that name does not exist (cached during negative_timeout) */
+static void replyNoEntry(fuse_req_t req)
+{
+    double timeout = LLDATA(req)->options.negative_timeout;
+    if (timeout <= 0)
+    {
+        replyError(req, ENOENT);
+        return;
+    }
+    OpScope::setResult(-ENOENT);
+    fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = 0;
+    e.entry_timeout = timeout;
+    fuse_reply_entry(req, &e);
+}
+
+/* Whether the kernel may keep the cached data of node on open (kernel_cache / auto_cache) */
+static bool keepCache(fuse_req_t req, quint64 node)
+{
+    LowLevelData *data = LLDATA(req);
+    if (data->options.kernel_cache)
+        return true;
+    if (!data->options.auto_cache)
+        return false;
+    sAttr attr;
+    if (data->instance->sIGetAttr(node, attr) < 0)
+        return false;
+    QMutexLocker locker(&data->stampsLock);
+    bool known = data->stamps.contains(node);
+    LowLevelCacheStamp &stamp = data->stamps[node];
+    bool unchanged = known && (stamp.size == attr.mst_size) && (stamp.mtime == attr.mst_mtime);
+    stamp.size = attr.mst_size;
+    stamp.mtime = attr.mst_mtime;
+    return unchanged;
+}
+
+static void replyAttr(fuse_req_t req, fuse_ino_t ino)
+{
+    sAttr result;
+    int ret_value;
+    if ((ret_value = INSTANCE(req)->sIGetAttr((quint64) ino, result)) < 0)
+    {
+        replyError(req, -ret_value);
+        return;
+    }
+    struct stat statbuf;
+    makeStat(result, LLDATA(req)->def_stat, &statbuf);
+    statbuf.st_ino = ino;
+    fuse_reply_attr(req, &statbuf, LLDATA(req)->options.attr_timeout);
+}
+
+void ll_init(void *userdata, fuse_conn_info *conn)
+{
+    LowLevelData *data = (LowLevelData*) userdata;
+    applyConnOptions(data->options, conn);
+    memset(&data->def_stat, 0, sizeof(struct stat));
+    data->def_stat.st_uid = geteuid();
+    data->def_stat.st_gid = getegid();
+    data->instance->sInit();
+}
+
+void ll_destroy(void *userdata)
+{
+    ((LowLevelData*) userdata)->instance->sDestroy();
+}
+
+void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    OPERATION_SCOPE(req, SF_OP_LOOKUP, parent, 0, 0, 0);
+    lString lName = toLString(name);
+    if (lName.str_len > STR_LEN_MAX)
+    {
+        replyError(req, ENAMETOOLONG);
+        return;
+    }
+    quint64 node;
+    sAttr result;
+    int ret_value = INSTANCE(req)->sLookup((quint64) parent, lName, node, result);
+    if (ret_value == -ENOENT)
+    {
+        replyNoEntry(req);
+        return;
+    }
+    if (ret_value < 0)
+    {
+        replyError(req, -ret_value);
+        return;
+    }
+    replyEntry(req, node, result);
+}
+
+void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    OPERATION_SCOPE(req, SF_OP_FORGET, ino, 0, 0, 0);
+    if (LLDATA(req)->options.auto_cache)
+    {
+        /* The stamp may be dropped early, the cache is then only invalidated once more */
+        QMutexLocker locker(&LLDATA(req)->stampsLock);
+        LLDATA(req)->stamps.remove((quint64) ino);
+    }
+    INSTANCE(req)->sForget((quint64) ino, (quint64) nlookup);
+    fuse_reply_none(req);
+}
+
+void ll_getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_GETATTR, ino, 0, 0, 0);
+    Q_UNUSED(fi);
+    replyAttr(req, ino);
+}
+
+void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_SETATTR, ino, fi ? fi->fh : 0, 0, 0);
+    QSimpleFuse *instance = INSTANCE(req);
+    int ret_value;
+    if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+    {
+        dispLog("Warning: Entered ll_setattr with owner change on node %lu\n", ino);
+        replyError(req, EPERM);
+        return;
+    }
+    if (to_set & FUSE_SET_ATTR_MODE)
+    {
+        if (attr->st_mode & 0xE00)
+        {
+            dispLog("Warning: ll_setattr on node %lu with mode 0%o\n", ino, attr->st_mode);
+            replyError(req, EPERM);
+            return;
+        }
+        if ((ret_value = instance->sIChMod((quint64) ino, (quint16) attr->st_mode)) < 0)
+        {
+            replyError(req, -ret_value);
+            return;
+        }
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE)
+    {
+        if (attr->st_size < 0)
+        {
+            replyError(req, EINVAL);
+            return;
+        }
+        if (fi)
+            ret_value = instance->sFTruncate((quint32) fi->fh, (quint64) attr->st_size);
+        else
+            ret_value = instance->sITruncate((quint64) ino, (quint64) attr->st_size);
+        if (ret_value < 0)
+        {
+            replyError(req, -ret_value);
+            return;
+        }
+    }
+    if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
+    {
+        /* The time which is not being set has to be kept as it is */
+        sAttr current;
+        if ((ret_value = instance->sIGetAttr((quint64) ino, current)) < 0)
+        {
+            replyError(req, -ret_value);
+            return;
+        }
+        time_t now;
+        time(&now);
+        time_t mst_atime = current.mst_atime, mst_mtime = current.mst_mtime;
+        if (to_set & FUSE_SET_ATTR_ATIME)
+            mst_atime = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? now : attr->st_atime;
+        if (to_set & FUSE_SET_ATTR_MTIME)
+            mst_mtime = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? now : attr->st_mtime;
+        if ((ret_value = instance->sIUTime((quint64) ino, mst_atime, mst_mtime)) < 0)
+        {
+            replyError(req, -ret_value);
+            return;
+        }
+    }
+    replyAttr(req, ino);
+}
+
+static void ll_makefile(fuse_req_t req, fuse_ino_t parent, const char *name, quint16 mst_mode)
+{
+    lString lName = toLString(name);
+    if (lName.str_len > STR_LEN_MAX)
+    {
+        replyError(req, ENAMETOOLONG);
+        return;
+    }
+    quint64 node;
+    sAttr result;
+    int ret_value = INSTANCE(req)->sIMkFile((quint64) parent, lName, mst_mode, node, result);
+    if (ret_value < 0)
+    {
+        replyError(req, -ret_value);
+        return;
+    }
+    replyEntry(req, node, result);
+}
+
+void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    OPERATION_SCOPE(req, SF_OP_MKNOD, parent, 0, 0, 0);
+    Q_UNUSED(rdev);
+    if ((mode & 0xFE00) != 0x8000)
+    {
+        dispLog("Warning: ll_mknod on \"%s\" with mode 0%o\n", name, mode);
+        replyError(req, EPERM);
+        return;
+    }
+    ll_makefile(req, parent, name, (quint16) mode);
+}
+
+void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    OPERATION_SCOPE(req, SF_OP_MKDIR, parent, 0, 0, 0);
+    if ((mode & 0xFE00) == 0)
+    {
+        mode |= 0x4000;
+    } else if ((mode & 0xFE00) != 0x4000)
+    {
+        dispLog("Warning: ll_mkdir on \"%s\" with mode 0%o\n", name, mode);
+        replyError(req, EPERM);
+        return;
+    }
+    ll_makefile(req, parent, name, (quint16) mode);
+}
+
+static void ll_removefile(fuse_req_t req, fuse_ino_t parent, const char *name, bool isDir)
+{
+    lString lName = toLString(name);
+    if (lName.str_len > STR_LEN_MAX)
+    {
+        replyError(req, ENAMETOOLONG);
+        return;
+    }
+    replyError(req, -INSTANCE(req)->sIRmFile((quint64) parent, lName, isDir));
+}
+
+void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    OPERATION_SCOPE(req, SF_OP_UNLINK, parent, 0, 0, 0);
+    ll_removefile(req, parent, name, false);
+}
+
+void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    OPERATION_SCOPE(req, SF_OP_RMDIR, parent, 0, 0, 0);
+    ll_removefile(req, parent, name, true);
+}
+
+void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+{
+    OPERATION_SCOPE(req, SF_OP_RENAME, parent, 0, 0, 0);
+    lString lNameFrom = toLString(name);
+    if (lNameFrom.str_len > STR_LEN_MAX)
+    {
+        replyError(req, ENAMETOOLONG);
+        return;
+    }
+    lString lNameTo = toLString(newname);
+    if (lNameTo.str_len > STR_LEN_MAX)
+    {
+        replyError(req, ENAMETOOLONG);
+        return;
+    }
+    replyError(req, -INSTANCE(req)->sIMvFile((quint64) parent, lNameFrom, (quint64) newparent, lNameTo));
+}
+
+void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+    OPERATION_SCOPE(req, SF_OP_LINK, ino, 0, 0, 0);
+    lString lName = toLString(newname);
+    if (lName.str_len > STR_LEN_MAX)
+    {
+        replyError(req, ENAMETOOLONG);
+        return;
+    }
+    sAttr result;
+    int ret_value = INSTANCE(req)->sILink((quint64) ino, (quint64) newparent, lName, result);
+    if (ret_value < 0)
+    {
+        replyError(req, -ret_value);
+        return;
+    }
+    replyEntry(req, (quint64) ino, result);
+}
+
+void ll_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_OPEN, ino, 0, 0, 0);
+    if (fi->flags & (O_ASYNC | O_DIRECTORY | O_TMPFILE | O_CREAT | O_EXCL | O_TRUNC | O_PATH))
+    {
+        dispLog("Warning: ll_open on node %lu with flags 0x%08x\n", ino, fi->flags);
+        replyError(req, EOPNOTSUPP);
+        return;
+    }
+    // O_NONBLOCK and O_NDELAY simply ignored.
+    quint32 fhv = 0;
+    int ret_value = INSTANCE(req)->sIOpen((quint64) ino, fi->flags, fhv);
+    if (ret_value < 0)
+    {
+        replyError(req, -ret_value);
+        return;
+    }
+    fi->fh = (uint64_t) fhv;
+    fi->keep_cache = keepCache(req, (quint64) ino);
+    opScope.setHandle(fi->fh);
+    fuse_reply_open(req, fi);
+}
+
+void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_READ, ino, fi->fh, (quint64) off, (quint32) size);
+    if ((size > 0xFFFFFFFFL) || (off < 0))
+    {
+        replyError(req, EINVAL);
+        return;
+    }
+    fuse_bufvec *bufv;
+    int ret_value = readToBufvec(INSTANCE(req), (quint32) fi->fh, (quint32) size, (quint64) off, &bufv);
+    if (ret_value < 0)
+    {
+        replyError(req, -ret_value);
+        return;
+    }
+    /* The trace gives the number of bytes read */
+    OpScope::setResult((int) fuse_buf_size(bufv));
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    freeBufvec(bufv);
+}
+
+void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_WRITE, ino, fi->fh, (quint64) off, (quint32) size);
+    if ((size > 0xFFFFFFFFL) || (off < 0))
+    {
+        replyError(req, EINVAL);
+        return;
+    }
+    fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    bufv.buf[0].mem = (void*) buf;
+    int ret_value = writeFromBufvec(INSTANCE(req), (quint32) fi->fh, &bufv, (quint64) off);
+    if (ret_value < 0)
+        replyError(req, -ret_value);
+    else
+    {
+        OpScope::setResult(ret_value);
+        fuse_reply_write(req, (size_t) ret_value);
+    }
+}
+
+void ll_write_buf(fuse_req_t req, fuse_ino_t ino, fuse_bufvec *bufv, off_t off, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_WRITE, ino, fi->fh, (quint64) off, (quint32) fuse_buf_size(bufv));
+    if (off < 0)
+    {
+        replyError(req, EINVAL);
+        return;
+    }
+    int ret_value = writeFromBufvec(INSTANCE(req), (quint32) fi->fh, bufv, (quint64) off);
+    if (ret_value < 0)
+        replyError(req, -ret_value);
+    else
+    {
+        OpScope::setResult(ret_value);
+        fuse_reply_write(req, (size_t) ret_value);
+    }
+}
+
+void ll_flush(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_FLUSH, ino, fi->fh, 0, 0);
+    replyError(req, -INSTANCE(req)->sSync((quint32) fi->fh));
+}
+
+void ll_release(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_RELEASE, ino, fi->fh, 0, 0);
+    replyError(req, -INSTANCE(req)->sClose((quint32) fi->fh));
+}
+
+void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_FSYNC, ino, fi->fh, 0, 0);
+    // We do not care about meta data being flushed here.
+    Q_UNUSED(datasync);
+    replyError(req, -INSTANCE(req)->sSync((quint32) fi->fh));
+}
+
+void ll_opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_OPENDIR, ino, 0, 0, 0);
+    quint32 fhv = 0;
+    int ret_value = INSTANCE(req)->sIOpenDir((quint64) ino, fhv);
+    if (ret_value < 0)
+    {
+        replyError(req, -ret_value);
+        return;
+    }
+    LowLevelDir *dir = new LowLevelDir;
+    dir->fd = fhv;
+    dir->offset = 0;
+    dir->pending = NULL;
+    dir->pendingMode = 0;
+    dir->stream = false;
+    dir->plain = false;
+    fi->fh = (uint64_t) dir;
+    opScope.setHandle(fi->fh);
+    fuse_reply_open(req, fi);
+}
+
+/* Smallest size of an entry in a readdir reply (used to size the batches) */
+#define DIRENT_SIZE_MIN 32
+
+/* Fills buf with the entries following off and returns the used size (or -ENOSYS if sReadDirBatch is not implemented) */
+static int readDirBatch(fuse_req_t req, LowLevelDir *dir, char *buf, size_t size, off_t off)
+{
+    QList<sDirEntry> entries;
+    quint32 count = (quint32) qMax(size / DIRENT_SIZE_MIN, (size_t) 1);
+    int ret_value = INSTANCE(req)->sReadDirBatch(dir->fd, (quint64) off, count, entries);
+    if (ret_value < 0)
+        return ret_value;
+    struct stat statbuf;
+    memset(&statbuf, 0, sizeof(statbuf));
+    statbuf.st_ino = UNKNOWN_INO;
+    size_t used = 0;
+    for (int i = 0; i < entries.count(); ++i)
+    {
+        const sDirEntry &entry = entries.at(i);
+        const char *name = entry.name.constData();
+        size_t entrySize = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+        if (used + entrySize > size)
+            break; // The kernel asks again from the offset of the last entry
+        statbuf.st_mode = (mode_t) entry.attr.mst_mode;
+        fuse_add_direntry(req, buf + used, size - used, name, &statbuf, (off_t) entry.next);
+        used += entrySize;
+    }
+    return (int) used;
+}
+
+/* Fills buf with the next entries of the directory stream and returns the used size */
+static int readDirStream(fuse_req_t req, LowLevelDir *dir, char *buf, size_t size)
+{
+    struct stat statbuf;
+    memset(&statbuf, 0, sizeof(statbuf));
+    statbuf.st_ino = UNKNOWN_INO;
+    size_t used = 0;
+    while (true)
+    {
+        char *name = dir->pending;
+        statbuf.st_mode = dir->pendingMode;
+        if (!name)
+        {
+            int ret_value = -ENOSYS;
+            sAttr attr;
+            /* The attributes are only used for the type of the entry */
+            if (!dir->plain)
+                ret_value = INSTANCE(req)->sReadDirPlus(dir->fd, name, attr);
+            if (ret_value == -ENOSYS)
+            {
+                dir->plain = true;
+                ret_value = INSTANCE(req)->sReadDir(dir->fd, name);
+                statbuf.st_mode = 0;
+            } else
+                statbuf.st_mode = (mode_t) attr.mst_mode;
+            if (ret_value < 0)
+                return ret_value;
+            if (!name)
+                break;
+        }
+        size_t entrySize = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+        if (used + entrySize > size)
+        {
+            /* Keep this entry for the next call */
+            if (!dir->pending)
+            {
+                dir->pending = strdup(name);
+                dir->pendingMode = statbuf.st_mode;
+            }
+            break;
+        }
+        fuse_add_direntry(req, buf + used, size - used, name, &statbuf, ++dir->offset);
+        used += entrySize;
+        if (dir->pending)
+        {
+            free(dir->pending);
+            dir->pending = NULL;
+        }
+    }
+    return (int) used;
+}
+
+void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_READDIR, ino, fi->fh, (quint64) off, (quint32) size);
+    LowLevelDir *dir = (LowLevelDir*) fi->fh;
+    char *buf = (char*) malloc(size);
+    if (!buf)
+    {
+        replyError(req, ENOMEM);
+        return;
+    }
+    int ret_value = -ENOSYS;
+    if (!dir->stream)
+        ret_value = readDirBatch(req, dir, buf, size, off);
+    if (ret_value == -ENOSYS)
+    {
+        /* The offset is ignored, the backend only provides a directory stream */
+        dir->stream = true;
+        ret_value = readDirStream(req, dir, buf, size);
+    }
+    if (ret_value < 0)
+        replyError(req, -ret_value);
+    else
+        fuse_reply_buf(req, buf, (size_t) ret_value);
+    free(buf);
+}
+
+void ll_releasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_RELEASEDIR, ino, fi->fh, 0, 0);
+    LowLevelDir *dir = (LowLevelDir*) fi->fh;
+    int ret_value = INSTANCE(req)->sCloseDir(dir->fd);
+    free(dir->pending);
+    delete dir;
+    replyError(req, -ret_value);
+}
+
+void ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_FSYNCDIR, ino, fi->fh, 0, 0);
+    Q_UNUSED(datasync);
+    replyError(req, 0); // Directories should always be directly synchronized.
+}
+
+void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    OPERATION_SCOPE(req, SF_OP_STATFS, ino, 0, 0, 0);
+    quint64 bSize, bFree;
+    int ret_value = INSTANCE(req)->sGetSize(bSize, bFree);
+    if (ret_value < 0)
+    {
+        replyError(req, -ret_value);
+        return;
+    }
+    struct statvfs statv;
+    memset(&statv, 0, sizeof(statv));
+    makeStatvfs(bSize, bFree, &statv);
+    fuse_reply_statfs(req, &statv);
+}
+
+void ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    OPERATION_SCOPE(req, SF_OP_ACCESS, ino, 0, 0, 0);
+    replyError(req, -INSTANCE(req)->sIAccess((quint64) ino, (quint8) mask));
+}
+
+void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(req, SF_OP_CREATE, parent, 0, 0, 0);
+    lString lName = toLString(name);
+    if (lName.str_len > STR_LEN_MAX)
+    {
+        replyError(req, ENAMETOOLONG);
+        return;
+    }
+    if ((mode & 0xFE00) != 0x8000)
+    {
+        dispLog("Warning: ll_create on \"%s\" with mode 0%o\n", name, mode);
+        replyError(req, EPERM);
+        return;
+    }
+    QSimpleFuse *instance = INSTANCE(req);
+    quint64 node;
+    sAttr result;
+    int flags = fi->flags & O_ACCMODE;
+    int ret_value = instance->sIMkFile((quint64) parent, lName, (quint16) ((mode & 0x1FF) | 0x8000), node, result);
+    if ((ret_value == -EEXIST) && !(fi->flags & O_EXCL))
+    {
+        ret_value = instance->sLookup((quint64) parent, lName, node, result);
+        flags |= O_TRUNC;
+    }
+    if (ret_value < 0)
+    {
+        replyError(req, -ret_value);
+        return;
+    }
+    quint32 fhv = 0;
+    ret_value = instance->sIOpen(node, flags, fhv);
+    if (ret_value < 0)
+    {
+        /* The kernel will never know about this node */
+        instance->sForget(node, 1);
+        replyError(req, -ret_value);
+        return;
+    }
+    fi->fh = (uint64_t) fhv;
+    fi->keep_cache = keepCache(req, node);
+    fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = (fuse_ino_t) node;
+    makeStat(result, LLDATA(req)->def_stat, &e.attr);
+    e.attr.st_ino = e.ino;
+    e.attr_timeout = LLDATA(req)->options.attr_timeout;
+    e.entry_timeout = LLDATA(req)->options.entry_timeout;
+    opScope.setHandle(fi->fh);
+    fuse_reply_create(req, &e, fi);
+}
+
+fuse_lowlevel_ops ll_oper;
+static pthread_once_t ll_oper_once = PTHREAD_ONCE_INIT;
+
+static void fillLowLevelFuseOperations()
+{
+    memset(&ll_oper, 0, sizeof(ll_oper));
+    ll_oper.init = ll_init;
+    ll_oper.destroy = ll_destroy;
+    ll_oper.lookup = ll_lookup;
+    ll_oper.forget = ll_forget;
+    ll_oper.getattr = ll_getattr;
+    ll_oper.setattr = ll_setattr;
+    ll_oper.mknod = ll_mknod;
+    ll_oper.mkdir = ll_mkdir;
+    ll_oper.unlink = ll_unlink;
+    ll_oper.rmdir = ll_rmdir;
+    ll_oper.rename = ll_rename;
+    ll_oper.link = ll_link;
+    ll_oper.open = ll_open;
+    ll_oper.read = ll_read;
+    ll_oper.write = ll_write;
+    ll_oper.flush = ll_flush;
+    ll_oper.release = ll_release;
+    ll_oper.fsync = ll_fsync;
+    ll_oper.opendir = ll_opendir;
+    ll_oper.readdir = ll_readdir;
+    ll_oper.releasedir = ll_releasedir;
+    ll_oper.fsyncdir = ll_fsyncdir;
+    ll_oper.statfs = ll_statfs;
+    ll_oper.access = ll_access;
+    ll_oper.create = ll_create;
+    ll_oper.write_buf = ll_write_buf;
+}
+
+/* Fills the operation table shared by all the instances (only once) */
+void makeLowLevelFuseOperations()
+{
+    pthread_once(&ll_oper_once, fillLowLevelFuseOperations);
+}
+
+fuse_lowlevel_ops *getLowLevelFuseOperations()
+{
+    return &ll_oper;
+}
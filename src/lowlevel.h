@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2015, Rémi Bazin <bazin.remi@gmail.com>
+ * All rights reserved.
+ * See LICENSE for licensing details.
+ */
+
+#ifndef __LOWLEVEL_H__
+#define __LOWLEVEL_H__
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#include <fuse/fuse_lowlevel.h>
+#include <QHash>
+#include <QMutex>
+
+#include "qsimplefuse.h"
+#include "opstats.h"
+
+struct LowLevelCacheStamp
+{
+    quint64 size;
+    time_t mtime;
+};
+
+struct LowLevelData
+{
+    QSimpleFuse *instance;
+    struct stat def_stat;
+    sMountOptions options;
+    OpStats *stats; // NULL if the operations are not measured
+    OpTrace *trace; // NULL if the operations are not traced
+    QMutex stampsLock;
+    QHash<quint64, LowLevelCacheStamp> stamps; // Size and mtime of the nodes when last opened (auto_cache)
+};
+
+void makeLowLevelFuseOperations();
+
+fuse_lowlevel_ops *getLowLevelFuseOperations();
+
+#endif /* Not __LOWLEVEL_H__ */
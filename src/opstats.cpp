@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2015, Rémi Bazin <bazin.remi@gmail.com>
+ * All rights reserved.
+ * See LICENSE for licensing details.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <QMutexLocker>
+#include <QtAlgorithms>
+
+#include "opstats.h"
+
+quint64 monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((quint64) ts.tv_sec) * 1000000000ULL + (quint64) ts.tv_nsec;
+}
+
+/* Reads a counter, setting it to 0 if reset is true */
+static quint64 takeCounter(quint64 *counter, bool reset)
+{
+    if (reset)
+        return __atomic_exchange_n(counter, 0, __ATOMIC_RELAXED);
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Returns the upper bound of the bucket holding the rank-th latency */
+static quint64 percentile(const quint64 *buckets, quint64 rank, quint64 max)
+{
+    quint64 seen = 0;
+    for (int i = 0; i < OP_STATS_BUCKETS; ++i)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+        {
+            if (i >= OP_STATS_BUCKETS - 1)
+                return max;
+            return qMin((((quint64) 2) << i) - 1, max);
+        }
+    }
+    return max;
+}
+
+OpStats::OpStats()
+{
+    memset(counters, 0, sizeof(counters));
+}
+
+void OpStats::record(sOperation op, quint64 ns)
+{
+    OpCounters &c = counters[op];
+    __atomic_fetch_add(&c.buckets[63 - __builtin_clzll(ns | 1)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c.total_ns, ns, __ATOMIC_RELAXED);
+    quint64 max = __atomic_load_n(&c.max_ns, __ATOMIC_RELAXED);
+    while ((ns > max) && !__atomic_compare_exchange_n(&c.max_ns, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* The counters are read (and reset) one by one, so a snapshot may miss a call being recorded */
+QList<sOpStats> OpStats::snapshot(bool reset)
+{
+    QList<sOpStats> result;
+    for (int op = 0; op < SF_OP_COUNT; ++op)
+    {
+        OpCounters &c = counters[op];
+        quint64 buckets[OP_STATS_BUCKETS];
+        sOpStats stats;
+        stats.count = 0;
+        for (int i = 0; i < OP_STATS_BUCKETS; ++i)
+        {
+            buckets[i] = takeCounter(&c.buckets[i], reset);
+            stats.count += buckets[i];
+        }
+        stats.total_ns = takeCounter(&c.total_ns, reset);
+        stats.max_ns = takeCounter(&c.max_ns, reset);
+        stats.p50_ns = stats.count ? percentile(buckets, (stats.count + 1) / 2, stats.max_ns) : 0;
+        stats.p99_ns = stats.count ? percentile(buckets, (stats.count * 99 + 99) / 100, stats.max_ns) : 0;
+        result.append(stats);
+    }
+    return result;
+}
+
+/* Ring used by the current thread (it may belong to another trace if the thread served another instance) */
+static __thread TraceRing *threadRingCache = NULL;
+/* Operation running in the current thread */
+static __thread OpScope *currentScope = NULL;
+
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+
+/* Gives the ring of an exiting thread back to its trace */
+static void releaseRing(void *ring)
+{
+    __atomic_store_n(&((TraceRing*) ring)->inUse, false, __ATOMIC_RELEASE);
+}
+
+static void makeRingKey()
+{
+    pthread_key_create(&ringKey, releaseRing);
+}
+
+static bool traceEntryLessThan(const sTraceEntry &e1, const sTraceEntry &e2)
+{
+    return e1.start_ns < e2.start_ns;
+}
+
+/* Each ring holds size entries, rounded up to a power of two */
+OpTrace::OpTrace(quint32 size)
+{
+    mask = 1;
+    while ((mask < size) && (mask < 0x80000000))
+        mask <<= 1;
+    --mask;
+}
+
+OpTrace::~OpTrace()
+{
+    for (int i = 0; i < rings.count(); ++i)
+    {
+        delete[] rings.at(i)->entries;
+        delete rings.at(i);
+    }
+}
+
+/* Returns the ring of the current thread, reusing the ring of an exited thread if possible */
+TraceRing *OpTrace::threadRing()
+{
+    if (threadRingCache && (threadRingCache->owner == this))
+        return threadRingCache;
+    QMutexLocker locker(&lock);
+    TraceRing *ring = NULL;
+    for (int i = 0; i < rings.count(); ++i)
+    {
+        if (!__atomic_load_n(&rings.at(i)->inUse, __ATOMIC_ACQUIRE))
+        {
+            ring = rings.at(i);
+            break;
+        }
+    }
+    if (!ring)
+    {
+        ring = new TraceRing;
+        ring->owner = this;
+        ring->index = rings.count();
+        ring->mask = mask;
+        ring->head = 0;
+        ring->entries = new sTraceEntry[mask + 1];
+        rings.append(ring);
+    }
+    ring->inUse = true;
+    pthread_once(&ringKeyOnce, makeRingKey);
+    pthread_setspecific(ringKey, ring);
+    threadRingCache = ring;
+    return ring;
+}
+
+/* Returns the entries of all the rings, oldest first (entries overwritten while copying are skipped) */
+QList<sTraceEntry> OpTrace::snapshot() const
+{
+    QMutexLocker locker(&lock);
+    QList<sTraceEntry> result;
+    quint64 capacity = ((quint64) mask) + 1;
+    for (int i = 0; i < rings.count(); ++i)
+    {
+        TraceRing *ring = rings.at(i);
+        quint64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        quint64 first = (head > capacity) ? head - capacity : 0;
+        QList<sTraceEntry> entries;
+        for (quint64 n = first; n < head; ++n)
+            entries.append(ring->entries[n & mask]);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        /* The entries up to newHead - capacity may have been overwritten in the meantime */
+        quint64 newHead = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        for (quint64 n = first; n < head; ++n)
+        {
+            if (n + capacity > newHead)
+            {
+                sTraceEntry entry = entries.at((int) (n - first));
+                entry.thread = ring->index;
+                result.append(entry);
+            }
+        }
+    }
+    qSort(result.begin(), result.end(), traceEntryLessThan);
+    return result;
+}
+
+/* FNV-1a hash of a path, as recorded in the trace in path mode */
+quint64 OpTrace::pathHash(const char *path)
+{
+    quint64 hash = 0xCBF29CE484222325ULL;
+    for (const char *c = path; *c; ++c)
+    {
+        hash ^= (quint8) *c;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+OpScope::OpScope(OpStats *stats, OpTrace *trace, sOperation op, quint64 node, quint64 fh, quint64 offset, quint32 size) :
+    stats(stats), ring(trace ? trace->threadRing() : NULL), previous(currentScope), op(op),
+    node(node), fh(fh), offset(offset), size(size), res(0), begin(0)
+{
+    if (stats || ring)
+        begin = monotonicNs();
+    currentScope = this;
+}
+
+OpScope::~OpScope()
+{
+    currentScope = previous;
+    if (!(stats || ring))
+        return;
+    quint64 duration = monotonicNs() - begin;
+    if (stats)
+        stats->record(op, duration);
+    if (ring)
+    {
+        quint64 head = ring->head;
+        sTraceEntry &entry = ring->entries[head & ring->mask];
+        entry.start_ns = begin;
+        entry.duration_ns = duration;
+        entry.node = node;
+        entry.fh = fh;
+        entry.offset = offset;
+        entry.size = size;
+        entry.result = res;
+        entry.thread = ring->index;
+        entry.op = op;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Sets the result of the operation running in the current thread (for the operations replying by themselves) */
+void OpScope::setResult(int result)
+{
+    if (currentScope)
+        currentScope->res = result;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015, Rémi Bazin <bazin.remi@gmail.com>
+ * All rights reserved.
+ * See LICENSE for licensing details.
+ */
+
+#ifndef __OPSTATS_H__
+#define __OPSTATS_H__
+
+#include <qglobal.h>
+#include <QList>
+#include <QMutex>
+
+#include "qsimplefuse.h"
+
+/* Number of latency buckets (bucket i holds the latencies from 2^i to 2^(i+1)-1 nanoseconds) */
+#define OP_STATS_BUCKETS 64
+
+quint64 monotonicNs();
+
+class OpTrace;
+
+struct OpCounters
+{
+    quint64 total_ns;
+    quint64 max_ns;
+    quint64 buckets[OP_STATS_BUCKETS];
+};
+
+/* Per-operation latency histograms, updated without any lock */
+class OpStats
+{
+public:
+    OpStats();
+    void record(sOperation op, quint64 ns);
+    QList<sOpStats> snapshot(bool reset);
+private:
+    OpCounters counters[SF_OP_COUNT];
+};
+
+struct TraceRing
+{
+    OpTrace *owner;
+    quint32 index;
+    quint32 mask; // Number of entries minus one
+    quint64 head; // Number of entries ever written (only written by the thread using the ring)
+    bool inUse; // Whether a thread uses the ring
+    sTraceEntry *entries;
+};
+
+/* Rings of the last requests, one for each thread (appending an entry takes no lock) */
+class OpTrace
+{
+public:
+    explicit OpTrace(quint32 size);
+    ~OpTrace();
+    TraceRing *threadRing();
+    QList<sTraceEntry> snapshot() const;
+    static quint64 pathHash(const char *path);
+private:
+    quint32 mask;
+    mutable QMutex lock; // Only taken when a thread gets its ring and when taking a snapshot
+    QList<TraceRing*> rings;
+};
+
+/* Measures and traces the operation running in the current scope (does nothing if stats and trace are NULL) */
+class OpScope
+{
+public:
+    OpScope(OpStats *stats, OpTrace *trace, sOperation op, quint64 node, quint64 fh, quint64 offset, quint32 size);
+    ~OpScope();
+    int done(int result) { res = result; return result; }
+    int result() const { return res; }
+    void setHandle(quint64 handle) { fh = handle; }
+    static void setResult(int result);
+private:
+    OpStats *stats;
+    TraceRing *ring;
+    OpScope *previous;
+    sOperation op;
+    quint64 node, fh, offset;
+    quint32 size;
+    int res;
+    quint64 begin;
+};
+
+#endif /* Not __OPSTATS_H__ */
@@ -25,6 +25,12 @@
 
     All the functions that you do not implement will be considered "unsupported" by the filesystem.
 
+    By default, the filesystem is driven through full path names (see QSimpleFuse::sGetAttr() for instance).
+    If the \c inodeMode argument of the constructor is set, the filesystem is driven through node identifiers instead,
+    so that a backend only resolves a name once per directory entry (see QSimpleFuse::sLookup()).
+    In this mode, the functions taking a path name are not used anymore and their node-based counterparts
+    (starting with \c sI) are called instead; the functions taking a file descriptor are shared by both modes.
+
     \warning You need to add the following lines to your .pro file:
 
     DEFINES += "_FILE_OFFSET_BITS=64"
@@ -34,11 +40,17 @@
 
 #include "qsimplefuse.h"
 #include "simplifier.h"
+#include "lowlevel.h"
+#include "workerpool.h"
+#include "opstats.h"
 
 #include <string.h>
 #include <QCoreApplication>
 #include <QStringList>
+#include <QMutex>
 #include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
 
 #ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 26
@@ -151,41 +163,363 @@
     Last modification time (seconds elapsed since epoch, as returned by the \c time() function from time.h).
 */
 
-static struct fuse_server {
+/*!
+    \class sDirEntry
+    \inmodule SimpleFuse
+    \ingroup SimpleFuse
+
+    \brief Structure holding a directory entry, as returned by QSimpleFuse::sReadDirBatch().
+*/
+
+/*!
+    \variable sDirEntry::name
+
+    The name of the entry.
+*/
+
+/*!
+    \variable sDirEntry::attr
+
+    The attributes of the entry (see QSimpleFuse::sGetAttr()).
+    If they are not known, \c attr.mst_mode should be left to 0 (its value after construction).
+*/
+
+/*!
+    \variable sDirEntry::next
+
+    The cookie that designates the position just after this entry in the directory.
+    It is given back to QSimpleFuse::sReadDirBatch() to continue the listing, possibly much later
+    (after a \c seekdir() for instance), so it should remain meaningful as long as the directory is open.
+    It must not be 0 and must be lower than 2^63.
+*/
+
+/*!
+    \class sWorkerStats
+    \inmodule SimpleFuse
+    \ingroup SimpleFuse
+
+    \brief Structure holding the statistics of a worker thread, as returned by QSimpleFuse::workerStats().
+*/
+
+/*!
+    \variable sWorkerStats::requests
+
+    The number of requests processed by this worker.
+*/
+
+/*!
+    \variable sWorkerStats::busy_ns
+
+    The time spent processing requests (in nanoseconds).
+*/
+
+/*!
+    \variable sWorkerStats::alive_ns
+
+    The time spent running, idle or not (in nanoseconds).
+*/
+
+/*!
+    \variable sWorkerStats::running
+
+    Whether a thread is currently running for this worker.
+    A stopped worker may be started again later, its statistics being accumulated.
+*/
+
+/*!
+    \enum sOperation
+    \inmodule SimpleFuse
+    \ingroup SimpleFuse
+
+    \brief Operations measured by QSimpleFuse::operationStats().
+
+    The operations are those of the FUSE protocol, so that several callbacks of the path mode may be counted
+    as one operation (for instance, changing the mode, the owner, the size or the times are all \c SF_OP_SETATTR).
+    \c SF_OP_LOOKUP and \c SF_OP_FORGET are only used in inode mode.
+    \c SF_OP_COUNT is the number of operations.
+*/
+
+/*!
+    \class sOpStats
+    \inmodule SimpleFuse
+    \ingroup SimpleFuse
+
+    \brief Structure holding the statistics of an operation, as returned by QSimpleFuse::operationStats().
+*/
+
+/*!
+    \variable sOpStats::count
+
+    The number of calls.
+*/
+
+/*!
+    \variable sOpStats::total_ns
+
+    The total time spent in the calls (in nanoseconds).
+*/
+
+/*!
+    \variable sOpStats::p50_ns
+
+    The median latency (in nanoseconds), rounded up to the upper bound of its histogram bucket.
+*/
+
+/*!
+    \variable sOpStats::p99_ns
+
+    The 99th percentile of the latency (in nanoseconds), rounded up to the upper bound of its histogram bucket.
+*/
+
+/*!
+    \variable sOpStats::max_ns
+
+    The maximum latency (in nanoseconds).
+*/
+
+/*!
+    \class sTraceEntry
+    \inmodule SimpleFuse
+    \ingroup SimpleFuse
+
+    \brief Structure describing a traced request, as returned by QSimpleFuse::traceEntries().
+*/
+
+/*!
+    \variable sTraceEntry::start_ns
+
+    When the request started, in nanoseconds of the monotonic clock (see \c clock_gettime(CLOCK_MONOTONIC)).
+*/
+
+/*!
+    \variable sTraceEntry::duration_ns
+
+    The time spent processing the request (in nanoseconds).
+*/
+
+/*!
+    \variable sTraceEntry::node
+
+    In path mode, the hash of the path concerned by the request (see QSimpleFuse::tracePathHash()).
+    In inode mode, the node concerned by the request (the parent directory for the requests naming an entry).
+*/
+
+/*!
+    \variable sTraceEntry::fh
+
+    The file handle of the request, or 0 if it has none.
+    For the requests opening or creating a file, this is the handle given to the new file.
+*/
+
+/*!
+    \variable sTraceEntry::offset
+
+    The offset of the request (reads, writes, directory listings and truncations), or 0.
+*/
+
+/*!
+    \variable sTraceEntry::size
+
+    The size of the request (reads, writes and directory listings), or 0.
+*/
+
+/*!
+    \variable sTraceEntry::result
+
+    The result of the request: -errno on error, the number of bytes read or written for a read or a write,
+    0 otherwise.
+*/
+
+/*!
+    \variable sTraceEntry::thread
+
+    The index of the thread which processed the request (threads started later may reuse the index of a stopped one).
+*/
+
+/*!
+    \variable sTraceEntry::op
+
+    The operation of the request.
+*/
+
+/*!
+    \class sMountOptions
+    \inmodule SimpleFuse
+    \ingroup SimpleFuse
+
+    \brief Structure holding the kernel options of a mount.
+
+    The default values are the ones of FUSE itself.
+    A filesystem that is mostly read, or that is only modified through its mount point,
+    may use much longer timeouts so that the kernel does not ask for the attributes of a file on nearly every access.
+    A filesystem that handles large sequential transfers should rather allow larger requests (see \l sMountOptions::big_writes).
+
+    \sa QSimpleFuse::QSimpleFuse()
+*/
+
+/*!
+    \variable sMountOptions::entry_timeout
+
+    Time (in seconds) during which the kernel caches the names (1 second by default).
+*/
+
+/*!
+    \variable sMountOptions::attr_timeout
+
+    Time (in seconds) during which the kernel caches the attributes of a file (1 second by default).
+*/
+
+/*!
+    \variable sMountOptions::negative_timeout
+
+    Time (in seconds) during which the kernel remembers that a name does not exist.
+    The default value of 0 disables this cache.
+*/
+
+/*!
+    \variable sMountOptions::kernel_cache
+
+    If \c true, the kernel keeps the cached data of a file when it is opened again.
+    Only set this if the data cannot be changed without going through the mount point.
+*/
+
+/*!
+    \variable sMountOptions::auto_cache
+
+    If \c true, the kernel keeps the cached data of a file when it is opened again,
+    unless its size or last modification time changed in the meantime.
+    This option is ignored if \l sMountOptions::kernel_cache is set.
+*/
+
+/*!
+    \variable sMountOptions::max_read
+
+    Maximum size (in bytes) of a read request sent by the kernel.
+    The default value of 0 sets no limit other than the one of FUSE.
+*/
+
+/*!
+    \variable sMountOptions::max_write
+
+    Maximum size (in bytes) of a write request sent by the kernel.
+    The default value of 0 keeps the FUSE default, and larger values are limited by FUSE to its buffer size.
+    Requests larger than a page are only sent if \l sMountOptions::big_writes is set.
+*/
+
+/*!
+    \variable sMountOptions::max_readahead
+
+    Maximum size (in bytes) the kernel may read ahead of a file.
+    The default value of 0 keeps the kernel default, which cannot be exceeded.
+*/
+
+/*!
+    \variable sMountOptions::async_read
+
+    If \c true (default), the kernel may send several read requests on the same file at once
+    (readahead requests for instance).
+*/
+
+/*!
+    \variable sMountOptions::big_writes
+
+    If \c true, the kernel may send write requests larger than a page (up to \l sMountOptions::max_write).
+    Large sequential writes then reach the filesystem in far fewer calls.
+*/
+
+/*!
+    \variable sMountOptions::splice_read
+
+    If \c true and supported by the kernel, the data of the write requests is received through a pipe
+    (see "man 2 splice"), so that it can reach QSimpleFuse::sWriteBuf() buffers without being copied in memory.
+*/
+
+/*!
+    \variable sMountOptions::splice_write
+
+    If \c true and supported by the kernel, the data of the read replies is sent through a pipe
+    (see "man 2 splice"), so that the buffers given by QSimpleFuse::sReadBuf() are not copied in memory.
+*/
+
+/*!
+    \variable sMountOptions::splice_move
+
+    If \c true and supported by the kernel, the pages of the read replies sent through a pipe are moved
+    instead of copied. Only used with \l sMountOptions::splice_write.
+*/
+
+/*!
+    \variable sMountOptions::max_threads
+
+    Maximum number of threads serving the requests at once.
+    The default value of 0 sets no limit, and this option is ignored if the filesystem is singlethreaded.
+    A new thread is started whenever all the others are busy, so this bounds the concurrency seen by the backend.
+*/
+
+/*!
+    \variable sMountOptions::max_idle_threads
+
+    Maximum number of idle threads (10 by default, as in FUSE).
+    A thread that becomes idle while there are already that many idle threads stops.
+*/
+
+/*!
+    \variable sMountOptions::cpus
+
+    CPUs to which the threads serving the requests are pinned, the n-th thread being pinned to the n-th CPU
+    of this list (modulo its length).
+    The default empty list does not pin the threads.
+*/
+
+/*!
+    \variable sMountOptions::op_stats
+
+    Whether the calls of each operation are counted and their latency recorded in a histogram
+    (see QSimpleFuse::operationStats()). This costs two clock readings per call and is disabled by default.
+*/
+
+/*!
+    \variable sMountOptions::trace_size
+
+    Number of requests kept in the trace of each thread serving the requests, rounded up to a power of two
+    (see QSimpleFuse::traceEntries()). The default value of 0 disables the trace.
+    Recording a request takes neither a lock nor an allocation.
+*/
+
+struct fuse_server {
     pthread_t pid;
     struct fuse *fuse;
+    struct fuse_session *se; /* Only used in inode mode */
+    LowLevelData *lldata; /* Only used in inode mode */
+    PersistentData *persdata; /* Only used in path mode */
+    OpStats *stats; /* Only used if the operations are measured */
+    OpTrace *trace; /* Only used if the operations are traced */
     struct fuse_chan *ch;
+    WorkerPool *pool;
     int failed;
     char *mountpoint;
     int multithreaded;
     int foreground;
-} fs;
+};
 
 static void *fuse_thread(void *arg)
 {
-    Q_UNUSED(arg);
-    if (fs.multithreaded)
+    fuse_server *server = (fuse_server*) arg;
+    int ret_value = server->pool->run();
+    if (ret_value < 0)
     {
-        if (fuse_loop_mt(fs.fuse) < 0)
-        {
 #ifndef QT_NO_DEBUG
-            perror("fuse_loop_mt");
+        fprintf(stderr, "QSimpleFuse: Error while serving the requests: %s\n", strerror(-ret_value));
 #endif
-            fs.failed = 1;
-        }
-    } else {
-        if (fuse_loop(fs.fuse) < 0)
-        {
-#ifndef QT_NO_DEBUG
-            perror("fuse_loop");
-#endif
-            fs.failed = 1;
-        }
+        server->failed = 1;
     }
     return NULL;
 }
 
-QSimpleFuse * volatile QSimpleFuse::_instance = NULL;
+/* Instances handling the signals (the handlers are installed for the first one and restored after the last one) */
+static QList<QSimpleFuse*> handlingInstances;
+static QMutex handlingLock;
+static struct sigaction oldSigInt, oldSigHup, oldSigTerm;
 
 char *getCStrFromQStr(const QString &str)
 {
@@ -196,11 +530,20 @@ char *getCStrFromQStr(const QString &str)
     return result;
 }
 
+static void freeArgv(int argc, char **argv)
+{
+    for (int i = 0; i < argc; ++i)
+        delete[] argv[i];
+    delete[] argv;
+}
+
 /*!
     Constructs and initialize a new FUSE filesystem.
 
     This filesystem is mounted at \a mountPoint.
     If \a singlethreaded is \c true, it will not be multithreaded.
+    If \a inodeMode is \c true, it will be driven through node identifiers instead of path names.
+    The kernel cache policy and the request sizes and capabilities are given by \a options.
 
     If \a handleSignals is \c true, the handlers for the INT, HUP and TERM signals will be
     changed so that whenever these are received, the filesystem will be unmounted prior
@@ -209,109 +552,107 @@ char *getCStrFromQStr(const QString &str)
     the filesystem.
     You may also consider using the \l QDaemon provided alongside to handle signals in a more accurate way.
 
-    \warning Only one single instance at a time can be created / used.
+    Several instances may be mounted at once, each of them being served by its own thread(s).
+    A signal then unmounts all the instances created with \a handleSignals.
 */
-QSimpleFuse::QSimpleFuse(QString mountPoint, bool singlethreaded, bool handleSignals) : signalHandling(false)
+QSimpleFuse::QSimpleFuse(QString mountPoint, bool singlethreaded, bool handleSignals, bool inodeMode, const sMountOptions &options) : signalHandling(false), mountOpts(options)
 {
-    /* Check whether or not this is a new instance */
-    if (_instance)
-    {
-#ifndef QT_NO_DEBUG
-        fprintf(stderr, "Error: Attempted to create a second instance of QSimpleFuse.\n");
-#endif
-        is_ok = false;
-        return;
-    }
-    _instance = this;
+    server = new fuse_server;
+    memset(server, 0, sizeof(fuse_server));
+    is_ok = false;
     /* Handle signals if required */
-    signalHandling = handleSignals;
-    if (signalHandling)
-    {
-        struct sigaction mySig;
-        mySig.sa_handler = mySignalHandler;
-        sigemptyset(&mySig.sa_mask);
-        mySig.sa_flags = SA_RESTART;
-        if (sigaction(SIGINT, &mySig, &oldSigInt))
-        {
-#ifndef QT_NO_DEBUG
-            perror("Error while installing the signal handle for SIGINT");
-#endif
-            is_ok = false;
-            return;
-        }
-        if (sigaction(SIGHUP, &mySig, &oldSigHup))
-        {
-#ifndef QT_NO_DEBUG
-            perror("Error while installing the signal handle for SIGHUP");
-#endif
-            is_ok = false;
-            return;
-        }
-        if (sigaction(SIGTERM, &mySig, &oldSigTerm))
-        {
-#ifndef QT_NO_DEBUG
-            perror("Error while installing the signal handle for SIGTERM");
-#endif
-            is_ok = false;
-            return;
-        }
-    }
-    /* Initialize fs */
-    memset(&fs, 0, sizeof(fs));
+    if (handleSignals && !installSignalHandlers())
+        return;
     /* Recreating custom arguments */
-    int argc;
-    char **argv;
+    QStringList arguments;
+    arguments << QCoreApplication::arguments().first() << mountPoint;
 #if FULL_DEBUG
-    argc = singlethreaded ? 4 : 3;
-    argv = new char*[argc];
-    argv[0] = getCStrFromQStr(QCoreApplication::arguments().first());
-    argv[1] = getCStrFromQStr(mountPoint);
-    argv[2] = getCStrFromQStr("-d");
-    if (singlethreaded)
-        argv[3] = getCStrFromQStr("-s");
-#else
-    argc = singlethreaded ? 3 : 2;
-    argv = new char*[argc];
-    argv[0] = getCStrFromQStr(QCoreApplication::arguments().first());
-    argv[1] = getCStrFromQStr(mountPoint);
-    if (singlethreaded)
-        argv[2] = getCStrFromQStr("-s");
+    arguments << "-d";
 #endif
+    if (singlethreaded)
+        arguments << "-s";
+    if (!inodeMode)
+    {
+        /* The low-level API does not know about these, they are applied by lowlevel.cpp in inode mode */
+        QString cacheOptions = QString("entry_timeout=%1,attr_timeout=%2,negative_timeout=%3")
+                .arg(options.entry_timeout).arg(options.attr_timeout).arg(options.negative_timeout);
+        if (options.kernel_cache)
+            cacheOptions += ",kernel_cache";
+        else if (options.auto_cache)
+            cacheOptions += ",auto_cache";
+        arguments << "-o" << cacheOptions;
+    }
+    if (options.max_read)
+        arguments << "-o" << QString("max_read=%1").arg(options.max_read);
+    int argc = arguments.count();
+    char **argv = new char*[argc];
+    for (int i = 0; i < argc; ++i)
+        argv[i] = getCStrFromQStr(arguments.at(i));
     /* Parsing arguments */
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    int res = fuse_parse_cmdline(&args, &fs.mountpoint, &fs.multithreaded, &fs.foreground);
+    int res = fuse_parse_cmdline(&args, &server->mountpoint, &server->multithreaded, &server->foreground);
     if (res == -1)
     {
 #ifndef QT_NO_DEBUG
         fprintf(stderr, "QSimpleFuse: Error on fuse_parse_cmdline.\n");
 #endif
-        is_ok = false;
+        freeArgv(argc, argv);
         return;
     }
     /* Mounting FS */
-    fs.ch = fuse_mount(fs.mountpoint, &args);
-    if (!fs.ch)
+    server->ch = fuse_mount(server->mountpoint, &args);
+    if (!server->ch)
     {
 #ifndef QT_NO_DEBUG
         perror("fuse_mount");
 #endif
-        is_ok = false;
+        fuse_opt_free_args(&args);
+        freeArgv(argc, argv);
         return;
     }
-    makeSimplifiedFuseOperations();
-    fs.fuse = fuse_new(fs.ch, &args, getSimplifiedFuseOperations(), sizeof(fuse_operations), NULL);
-    fuse_opt_free_args(&args);
-    if (!fs.fuse)
+    if (options.op_stats)
+        server->stats = new OpStats;
+    if (options.trace_size)
+        server->trace = new OpTrace(options.trace_size);
+    if (inodeMode)
     {
+        server->lldata = new LowLevelData;
+        server->lldata->instance = this;
+        server->lldata->options = options;
+        server->lldata->stats = server->stats;
+        server->lldata->trace = server->trace;
+        makeLowLevelFuseOperations();
+        server->se = fuse_lowlevel_new(&args, getLowLevelFuseOperations(), sizeof(fuse_lowlevel_ops), server->lldata);
+        fuse_opt_free_args(&args);
+        freeArgv(argc, argv);
+        if (!server->se)
+        {
 #ifndef QT_NO_DEBUG
-        perror("fuse_new");
+            perror("fuse_lowlevel_new");
 #endif
-        goto cancelmount;
+            goto cancelmount;
+        }
+        fuse_session_add_chan(server->se, server->ch);
+    } else {
+        server->persdata = new PersistentData;
+        server->persdata->instance = this;
+        server->persdata->stats = server->stats;
+        server->persdata->trace = server->trace;
+        makeSimplifiedFuseOperations();
+        server->fuse = fuse_new(server->ch, &args, getSimplifiedFuseOperations(), sizeof(fuse_operations), server->persdata);
+        fuse_opt_free_args(&args);
+        freeArgv(argc, argv);
+        if (!server->fuse)
+        {
+#ifndef QT_NO_DEBUG
+            perror("fuse_new");
+#endif
+            goto cancelmount;
+        }
     }
-    for (int i = 0; i < argc; ++i)
-        delete[] argv[i];
-    delete[] argv;
-    if (pthread_create(&fs.pid, NULL, fuse_thread, NULL) != 0)
+    server->pool = new WorkerPool(server->se ? server->se : fuse_get_session(server->fuse),
+                                  server->multithreaded ? options.max_threads : 1, options.max_idle_threads, options.cpus);
+    if (pthread_create(&server->pid, NULL, fuse_thread, server) != 0)
     {
 #ifndef QT_NO_DEBUG
         perror("pthread_create");
@@ -321,8 +662,20 @@ QSimpleFuse::QSimpleFuse(QString mountPoint, bool singlethreaded, bool handleSig
     is_ok = true;
     return;
 cancelmount:
-    fuse_unmount(fs.mountpoint, fs.ch);
-    is_ok = false;
+    fuse_unmount(server->mountpoint, server->ch);
+    if (server->se)
+    {
+        fuse_session_destroy(server->se);
+        server->se = NULL;
+    } else if (server->fuse)
+    {
+        fuse_destroy(server->fuse);
+        server->fuse = NULL;
+    }
+    delete server->lldata;
+    server->lldata = NULL;
+    delete server->persdata;
+    server->persdata = NULL;
 }
 
 /*!
@@ -332,35 +685,35 @@ void QSimpleFuse::unmount()
 {
     /* Restore previous handlers if necessary */
     if (signalHandling)
-    {
-        if (sigaction(SIGINT, &oldSigInt, 0))
-        {
-#ifndef QT_NO_DEBUG
-            perror("Error while restoring the signal handle for SIGINT");
-#endif
-        }
-        if (sigaction(SIGHUP, &oldSigHup, 0))
-        {
-#ifndef QT_NO_DEBUG
-            perror("Error while restoring the signal handle for SIGHUP");
-#endif
-        }
-        if (sigaction(SIGTERM, &oldSigTerm, 0))
-        {
-#ifndef QT_NO_DEBUG
-            perror("Error while restoring the signal handle for SIGTERM");
-#endif
-        }
-        signalHandling = false;
-    }
+        releaseSignalHandlers();
+    stop();
+}
+
+/* Stops the FUSE loop and unmounts the filesystem */
+void QSimpleFuse::stop()
+{
     if (is_ok)
     {
-        /* Aborting FS */
-        fuse_session_exit(fuse_get_session(fs.fuse));
-        fuse_unmount(fs.mountpoint, fs.ch);
-        pthread_join(fs.pid, NULL);
-        fs.fuse = NULL;
         is_ok = false;
+        /* Aborting FS */
+        if (server->se)
+        {
+            fuse_session_exit(server->se);
+            fuse_unmount(server->mountpoint, server->ch);
+            pthread_join(server->pid, NULL);
+            fuse_session_destroy(server->se);
+            server->se = NULL;
+            delete server->lldata;
+            server->lldata = NULL;
+        } else {
+            fuse_session_exit(fuse_get_session(server->fuse));
+            fuse_unmount(server->mountpoint, server->ch);
+            pthread_join(server->pid, NULL);
+            fuse_destroy(server->fuse);
+            server->fuse = NULL;
+            delete server->persdata;
+            server->persdata = NULL;
+        }
     }
 }
 
@@ -370,9 +723,11 @@ void QSimpleFuse::unmount()
 QSimpleFuse::~QSimpleFuse()
 {
     unmount();
-    /* Allow a future new instance */
-    if (_instance == this)
-        _instance = NULL;
+    free(server->mountpoint);
+    delete server->pool;
+    delete server->stats;
+    delete server->trace;
+    delete server;
 }
 
 /*!
@@ -381,7 +736,124 @@ QSimpleFuse::~QSimpleFuse()
 */
 bool QSimpleFuse::checkStatus()
 {
-    return is_ok && (!fs.failed);
+    return is_ok && (!server->failed);
+}
+
+/*!
+    Returns the mount options given to the constructor.
+*/
+const sMountOptions &QSimpleFuse::mountOptions() const
+{
+    return mountOpts;
+}
+
+/*!
+    Returns the statistics of the threads serving the filesystem requests, one entry for each worker slot.
+    The first worker runs as long as the filesystem is mounted, the others are started when all the workers
+    are busy and stopped when too many are idle (see \l sMountOptions::max_threads and \l sMountOptions::max_idle_threads).
+
+    The utilization of a worker is the ratio between \l sWorkerStats::busy_ns and \l sWorkerStats::alive_ns.
+*/
+QList<sWorkerStats> QSimpleFuse::workerStats() const
+{
+    if (!server->pool)
+        return QList<sWorkerStats>();
+    return server->pool->stats();
+}
+
+/*!
+    Returns the statistics of each operation, indexed by \l sOperation, since the mount or the last reset.
+    If \a reset is \c true, the statistics are also reset.
+
+    The operations are only measured if \l sMountOptions::op_stats is set, an empty list being returned otherwise.
+    An operation is measured from the call of the FUSE callback to its return, so that it includes the time spent
+    in the corresponding virtual function. Comparing these latencies with the utilization of the workers
+    (see workerStats()) tells whether the requests wait for the backend or for the kernel.
+
+    The percentiles are computed from histograms whose buckets are powers of two (in nanoseconds), so they are
+    rounded up to the next power of two minus one (without exceeding \l sOpStats::max_ns).
+    No lock is taken, so a call being measured at the time of the snapshot may only be partially counted.
+
+    \sa operationName()
+*/
+QList<sOpStats> QSimpleFuse::operationStats(bool reset)
+{
+    if (!server->stats)
+        return QList<sOpStats>();
+    return server->stats->snapshot(reset);
+}
+
+/*!
+    Returns the name of the operation \a op (such as \c "getattr"), or \c NULL if it is not valid.
+*/
+const char *QSimpleFuse::operationName(sOperation op)
+{
+    static const char *names[SF_OP_COUNT] = {
+        "getattr", "setattr", "lookup", "forget", "mknod", "mkdir",
+        "unlink", "rmdir", "rename", "link", "open", "read",
+        "write", "statfs", "flush", "release", "fsync", "opendir",
+        "readdir", "releasedir", "fsyncdir", "access", "create"
+    };
+    if ((op < 0) || (op >= SF_OP_COUNT))
+        return NULL;
+    return names[op];
+}
+
+/*!
+    Returns the last requests processed by each thread, oldest first.
+
+    The requests are only traced if \l sMountOptions::trace_size is set, an empty list being returned otherwise.
+    Each thread serving the requests records them in its own ring of \l sMountOptions::trace_size entries,
+    without taking any lock, so that the trace can be left enabled. The ring of a thread that stopped is reused
+    by the next thread started, so its entries are kept until they are overwritten.
+
+    This function can be called at any time, for instance when the filesystem seems to stall.
+    A request being recorded while the trace is read may be missing from the result.
+
+    \sa dumpTrace(), tracePathHash()
+*/
+QList<sTraceEntry> QSimpleFuse::traceEntries() const
+{
+    if (!server->trace)
+        return QList<sTraceEntry>();
+    return server->trace->snapshot();
+}
+
+/*!
+    Writes the last requests processed by each thread to the file descriptor \a fd, one request per line.
+    Returns \c false if the requests are not traced or if the trace could not be written.
+
+    To dump the trace on demand, this function can for instance be called from a slot connected to the
+    QDaemon::sigHUP() signal.
+
+    \sa traceEntries()
+*/
+bool QSimpleFuse::dumpTrace(int fd) const
+{
+    if (!server->trace)
+        return false;
+    QList<sTraceEntry> entries = server->trace->snapshot();
+    char line[256];
+    for (int i = 0; i < entries.count(); ++i)
+    {
+        const sTraceEntry &e = entries.at(i);
+        int len = snprintf(line, sizeof(line), "%llu.%09llu thread=%u %s node=%llx fh=%llx offset=%llu size=%u result=%d duration=%lluns\n",
+                           (unsigned long long) (e.start_ns / 1000000000ULL), (unsigned long long) (e.start_ns % 1000000000ULL),
+                           e.thread, operationName(e.op), (unsigned long long) e.node, (unsigned long long) e.fh,
+                           (unsigned long long) e.offset, e.size, e.result, (unsigned long long) e.duration_ns);
+        if (write(fd, line, (size_t) len) != (ssize_t) len)
+            return false;
+    }
+    return true;
+}
+
+/*!
+    Returns the hash of \a path recorded as \l sTraceEntry::node in path mode, so that the requests
+    concerning a given path can be found in the trace.
+*/
+quint64 QSimpleFuse::tracePathHash(const char *path)
+{
+    return OpTrace::pathHash(path);
 }
 
 /*!
@@ -892,12 +1364,59 @@ int QSimpleFuse::sRead(quint32 fd, void *buf, quint32 count, quint64 offset)
             \li I/O error.
     \endtable
 */
-int QSimpleFuse::sWrite(quint32 fd, const void *buf, quint32 count, quint64 offset)
+int QSimpleFuse::sWrite(quint32 fd, const void *buf, quint32 count, quint64 offset)
+{
+    Q_UNUSED(fd);
+    Q_UNUSED(buf);
+    Q_UNUSED(count);
+    Q_UNUSED(offset);
+    return -ENOSYS;
+}
+
+/*!
+    Locates \a count bytes of file \a fd, offset \a offset, and appends their location to \a bufs
+    instead of copying them (the data is then sent directly from there, using splice when possible).
+
+    Each buffer is either a memory area (\c mem), or a part of a file descriptor (\c fd and \c pos, with \c mem set to NULL).
+    Memory areas have to remain valid until \a fd is used again.
+
+    Returns the number of bytes located by \a bufs on success, which is lower than \a count
+    only if the end of file has been reached. Else, returns one of the error values of QSimpleFuse::sRead().
+
+    \note This default implementation returns \c -ENOSYS, in which case QSimpleFuse::sRead() is used instead.
+
+    \sa QSimpleFuse::sRead()
+*/
+int QSimpleFuse::sReadBuf(quint32 fd, quint32 count, quint64 offset, QList<sDataBuf> &bufs)
+{
+    Q_UNUSED(fd);
+    Q_UNUSED(count);
+    Q_UNUSED(offset);
+    Q_UNUSED(bufs);
+    return -ENOSYS;
+}
+
+/*!
+    Prepares the file \a fd for \a count bytes to be written at offset \a offset (extending it if needed),
+    and appends to \a bufs the location where these bytes have to be stored.
+    The data is then copied directly there, using splice when possible.
+
+    Buffers are described as in QSimpleFuse::sReadBuf().
+    Memory areas have to remain valid until \a fd is used again.
+
+    Returns the number of bytes located by \a bufs on success, which should be equal to \a count.
+    Else, returns one of the error values of QSimpleFuse::sWrite().
+
+    \note This default implementation returns \c -ENOSYS, in which case QSimpleFuse::sWrite() is used instead.
+
+    \sa QSimpleFuse::sWrite()
+*/
+int QSimpleFuse::sWriteBuf(quint32 fd, quint32 count, quint64 offset, QList<sDataBuf> &bufs)
 {
     Q_UNUSED(fd);
-    Q_UNUSED(buf);
     Q_UNUSED(count);
     Q_UNUSED(offset);
+    Q_UNUSED(bufs);
     return -ENOSYS;
 }
 
@@ -1006,6 +1525,79 @@ int QSimpleFuse::sReadDir(quint32 fd, char *&name)
     return -ENOSYS;
 }
 
+/*!
+    Reads the next entry in the directory stream of \a fd, together with its attributes.
+    This puts the name of this entry in \a name (changing its pointer value) or NULL if there is no more (no error then),
+    and the attributes of this entry in \a attr (see QSimpleFuse::sGetAttr()).
+
+    Implementing this function saves most of the attribute requests that usually follow a listing (\c{ls -l} for instance),
+    as the attributes of the listed entries are kept for a short while.
+
+    Returns \c 0 on success, or one of these values on error:
+    \table
+        \header
+            \li Return value
+            \li Description
+        \row
+            \li -EBADF
+            \li \a fd is not a valid directory descriptor opened for reading.
+        \row
+            \li -EIO
+            \li I/O error.
+    \endtable
+
+    \note This default implementation returns \c -ENOSYS, in which case QSimpleFuse::sReadDir() is used instead.
+
+    \sa QSimpleFuse::sReadDir()
+*/
+int QSimpleFuse::sReadDirPlus(quint32 fd, char *&name, sAttr &attr)
+{
+    Q_UNUSED(fd);
+    Q_UNUSED(name);
+    Q_UNUSED(attr);
+    return -ENOSYS;
+}
+
+/*!
+    Reads at most \a count entries in the directory \a fd, starting at the position designated by \a cookie,
+    and appends them to \a entries.
+    A \a cookie of 0 designates the beginning of the directory, any other value is the \l sDirEntry::next
+    value of a previously returned entry.
+    Leaving \a entries empty means that there is no entry left (no error then).
+
+    Unlike QSimpleFuse::sReadDir(), this allows listing a directory in pages of any size,
+    and going back to a previous position.
+    The attributes of the entries may be given as well (see QSimpleFuse::sReadDirPlus()).
+
+    Returns \c 0 on success, or one of these values on error:
+    \table
+        \header
+            \li Return value
+            \li Description
+        \row
+            \li -EBADF
+            \li \a fd is not a valid directory descriptor opened for reading.
+        \row
+            \li -EINVAL
+            \li \a cookie does not designate a position in the directory.
+        \row
+            \li -EIO
+            \li I/O error.
+    \endtable
+
+    \note This default implementation returns \c -ENOSYS, in which case QSimpleFuse::sReadDirPlus() is used instead.
+
+    \sa QSimpleFuse::sReadDir()
+*/
+int QSimpleFuse::sReadDirBatch(quint32 fd, quint64 cookie, quint32 count, QList<sDirEntry> &entries)
+{
+    Q_UNUSED(fd);
+    Q_UNUSED(cookie);
+    Q_UNUSED(count);
+    Q_UNUSED(entries);
+    return -ENOSYS;
+}
+
 /*!
     Closes the directory \a fd (see "man 3 closedir").
 
@@ -1127,15 +1719,326 @@ int QSimpleFuse::sFGetAttr(quint32 fd, sAttr &attr)
     return -ENOSYS;
 }
 
+/*!
+    Looks up the entry \a name in the directory node \a parent (inode mode).
+    The identifier of the node found is put into \a node and its attributes are stored into \a attr.
+
+    The node identifiers are chosen by the implementation, except for the root directory
+    which is always \c SF_ROOT_NODE. Every successful call of this function (as well as of
+    QSimpleFuse::sIMkFile() and QSimpleFuse::sILink()) increments the lookup count of the node,
+    which is decremented by QSimpleFuse::sForget(). A node identifier must remain valid as long as
+    its lookup count is not null, even if the node has been removed in the meantime.
+
+    Returns \c 0 on success, or one of these values on error:
+    \table
+        \header
+            \li Return value
+            \li Description
+        \row
+            \li -EACCESS
+            \li Search permission denied for \a parent.
+        \row
+            \li -ENOENT
+            \li \a name does not exist in \a parent.
+        \row
+            \li -ENOTDIR
+            \li \a parent is not a directory.
+        \row
+            \li -EIO
+            \li I/O error.
+    \endtable
+
+    \sa QSimpleFuse::sForget(), QSimpleFuse::sGetAttr()
+*/
+int QSimpleFuse::sLookup(quint64 parent, const lString &name, quint64 &node, sAttr &attr)
+{
+    Q_UNUSED(parent);
+    Q_UNUSED(name);
+    Q_UNUSED(node);
+    Q_UNUSED(attr);
+    return -ENOSYS;
+}
+
+/*!
+    Decrements the lookup count of \a node by \a nlookup (inode mode).
+    Once this count drops to zero, the identifier \a node will not be used anymore
+    (until it is returned again by QSimpleFuse::sLookup() for instance).
+
+    \note This default implementation does nothing.
+
+    \sa QSimpleFuse::sLookup()
+*/
+void QSimpleFuse::sForget(quint64 node, quint64 nlookup)
+{
+    Q_UNUSED(node);
+    Q_UNUSED(nlookup);
+}
+
+/*!
+    Gets the attributes of \a node and store them into \a attr (inode mode).
+
+    Returns \c 0 on success, or \c -EIO on I/O error.
+
+    \sa QSimpleFuse::sGetAttr()
+*/
+int QSimpleFuse::sIGetAttr(quint64 node, sAttr &attr)
+{
+    Q_UNUSED(node);
+    Q_UNUSED(attr);
+    return -ENOSYS;
+}
+
+/*!
+    Creates the file \a name in the directory node \a parent with the parameters \a mst_mode (inode mode).
+    The identifier of the new node is put into \a node and its attributes are stored into \a attr
+    (this counts as a lookup, see QSimpleFuse::sLookup()).
+
+    Returns \c 0 on success, or one of the error values of QSimpleFuse::sMkFile().
+
+    \sa QSimpleFuse::sMkFile()
+*/
+int QSimpleFuse::sIMkFile(quint64 parent, const lString &name, quint16 mst_mode, quint64 &node, sAttr &attr)
+{
+    Q_UNUSED(parent);
+    Q_UNUSED(name);
+    Q_UNUSED(mst_mode);
+    Q_UNUSED(node);
+    Q_UNUSED(attr);
+    return -ENOSYS;
+}
+
+/*!
+    Removes the entry \a name of the directory node \a parent, which is supposed to be a directory if \a isDir is \c true,
+    or a regular file if \a isDir is \c false (inode mode).
+
+    Returns \c 0 on success, or one of the error values of QSimpleFuse::sRmFile().
+
+    \sa QSimpleFuse::sRmFile()
+*/
+int QSimpleFuse::sIRmFile(quint64 parent, const lString &name, bool isDir)
+{
+    Q_UNUSED(parent);
+    Q_UNUSED(name);
+    Q_UNUSED(isDir);
+    return -ENOSYS;
+}
+
+/*!
+    Renames the entry \a nameBefore of the directory node \a parentBefore as
+    the entry \a nameAfter of the directory node \a parentAfter (inode mode).
+
+    Returns \c 0 on success, or one of the error values of QSimpleFuse::sMvFile().
+
+    \sa QSimpleFuse::sMvFile()
+*/
+int QSimpleFuse::sIMvFile(quint64 parentBefore, const lString &nameBefore, quint64 parentAfter, const lString &nameAfter)
+{
+    Q_UNUSED(parentBefore);
+    Q_UNUSED(nameBefore);
+    Q_UNUSED(parentAfter);
+    Q_UNUSED(nameAfter);
+    return -ENOSYS;
+}
+
+/*!
+    Creates a new (hard) link named \a newName in the directory node \a newParent to the regular file \a node (inode mode).
+    The new attributes of \a node are stored into \a attr (this counts as a lookup, see QSimpleFuse::sLookup()).
+
+    Returns \c 0 on success, or one of the error values of QSimpleFuse::sLink().
+
+    \sa QSimpleFuse::sLink()
+*/
+int QSimpleFuse::sILink(quint64 node, quint64 newParent, const lString &newName, sAttr &attr)
+{
+    Q_UNUSED(node);
+    Q_UNUSED(newParent);
+    Q_UNUSED(newName);
+    Q_UNUSED(attr);
+    return -EPERM;
+}
+
+/*!
+    Changes the permissions of \a node to the ones specified in the lower 9 bits of \a mst_mode (inode mode).
+
+    Returns \c 0 on success, or one of the error values of QSimpleFuse::sChMod().
+
+    \sa QSimpleFuse::sChMod()
+*/
+int QSimpleFuse::sIChMod(quint64 node, quint16 mst_mode)
+{
+    Q_UNUSED(node);
+    Q_UNUSED(mst_mode);
+    return -ENOSYS;
+}
+
+/*!
+    Changes the size of the regular file \a node to \a newsize bytes, writing new zeros if necessary (inode mode).
+
+    Returns \c 0 on success, or one of the error values of QSimpleFuse::sTruncate().
+
+    \sa QSimpleFuse::sTruncate()
+*/
+int QSimpleFuse::sITruncate(quint64 node, quint64 newsize)
+{
+    Q_UNUSED(node);
+    Q_UNUSED(newsize);
+    return -ENOSYS;
+}
+
+/*!
+    Changes the last access date of \a node to \a mst_atime and modification date to \a mst_mtime (inode mode).
+
+    Returns \c 0 on success, or one of the error values of QSimpleFuse::sUTime().
+
+    \sa QSimpleFuse::sUTime()
+*/
+int QSimpleFuse::sIUTime(quint64 node, time_t mst_atime, time_t mst_mtime)
+{
+    Q_UNUSED(node);
+    Q_UNUSED(mst_atime);
+    Q_UNUSED(mst_mtime);
+    return -ENOSYS;
+}
+
+/*!
+    Opens the regular file \a node according to the \a flags parameter (inode mode).
+
+    \a fd is set to an arbitrary filehandle (positive integer) if successful.
+
+    Returns \c 0 on success, or one of the error values of QSimpleFuse::sOpen().
+
+    \sa QSimpleFuse::sOpen()
+*/
+int QSimpleFuse::sIOpen(quint64 node, int flags, quint32 &fd)
+{
+    Q_UNUSED(node);
+    Q_UNUSED(flags);
+    Q_UNUSED(fd);
+    return -ENOSYS;
+}
+
+/*!
+    Opens the directory \a node (inode mode).
+
+    \a fd is set to an arbitrary filehandle (positive integer) if successful.
+
+    Returns \c 0 on success, or one of the error values of QSimpleFuse::sOpenDir().
+
+    \sa QSimpleFuse::sOpenDir()
+*/
+int QSimpleFuse::sIOpenDir(quint64 node, quint32 &fd)
+{
+    Q_UNUSED(node);
+    Q_UNUSED(fd);
+    return -ENOSYS;
+}
+
+/*!
+    Checks access to \a node (inode mode).
+
+    If \a mode is F_OK, check if the node exists.
+    Else, it is a mask of R_OK, W_OK and X_OK to test read, write and execute permissions respectively.
+
+    Returns \c 0 on success (access granted), or one of the error values of QSimpleFuse::sAccess().
+
+    \sa QSimpleFuse::sAccess()
+*/
+int QSimpleFuse::sIAccess(quint64 node, quint8 mode)
+{
+    Q_UNUSED(node);
+    Q_UNUSED(mode);
+    return -ENOSYS;
+}
+
+/* Installs the signal handlers (if this is the first instance handling signals) and returns true on success */
+bool QSimpleFuse::installSignalHandlers()
+{
+    QMutexLocker locker(&handlingLock);
+    if (handlingInstances.isEmpty())
+    {
+        struct sigaction mySig;
+        mySig.sa_handler = mySignalHandler;
+        sigemptyset(&mySig.sa_mask);
+        mySig.sa_flags = SA_RESTART;
+        if (sigaction(SIGINT, &mySig, &oldSigInt))
+        {
+#ifndef QT_NO_DEBUG
+            perror("Error while installing the signal handle for SIGINT");
+#endif
+            return false;
+        }
+        if (sigaction(SIGHUP, &mySig, &oldSigHup))
+        {
+#ifndef QT_NO_DEBUG
+            perror("Error while installing the signal handle for SIGHUP");
+#endif
+            sigaction(SIGINT, &oldSigInt, 0);
+            return false;
+        }
+        if (sigaction(SIGTERM, &mySig, &oldSigTerm))
+        {
+#ifndef QT_NO_DEBUG
+            perror("Error while installing the signal handle for SIGTERM");
+#endif
+            sigaction(SIGINT, &oldSigInt, 0);
+            sigaction(SIGHUP, &oldSigHup, 0);
+            return false;
+        }
+    }
+    handlingInstances.append(this);
+    signalHandling = true;
+    return true;
+}
+
+/* Restores the previous signal handlers */
+static void restoreSignalHandlers()
+{
+    if (sigaction(SIGINT, &oldSigInt, 0))
+    {
+#ifndef QT_NO_DEBUG
+        perror("Error while restoring the signal handle for SIGINT");
+#endif
+    }
+    if (sigaction(SIGHUP, &oldSigHup, 0))
+    {
+#ifndef QT_NO_DEBUG
+        perror("Error while restoring the signal handle for SIGHUP");
+#endif
+    }
+    if (sigaction(SIGTERM, &oldSigTerm, 0))
+    {
+#ifndef QT_NO_DEBUG
+        perror("Error while restoring the signal handle for SIGTERM");
+#endif
+    }
+}
+
+/* Stops handling the signals (and restores the previous handlers if this is the last instance doing so) */
+void QSimpleFuse::releaseSignalHandlers()
+{
+    QMutexLocker locker(&handlingLock);
+    handlingInstances.removeAll(this);
+    if (handlingInstances.isEmpty())
+        restoreSignalHandlers();
+    signalHandling = false;
+}
+
 void QSimpleFuse::mySignalHandler(int sig)
 {
-    if (_instance)
+    /* The lock is not taken here, as the signal may have interrupted a thread holding it */
+    if (handlingInstances.isEmpty())
     {
-        _instance->unmount();
-        raise(sig);
-    } else {
 #ifndef QT_NO_DEBUG
         fprintf(stderr, "Error: Signal handler still alive without any instance of QSimpleFuse.\n");
 #endif
+        return;
+    }
+    for (int i = 0; i < handlingInstances.count(); ++i)
+    {
+        handlingInstances.at(i)->signalHandling = false;
+        handlingInstances.at(i)->stop();
     }
+    handlingInstances.clear();
+    restoreSignalHandlers();
+    raise(sig);
 }
@@ -13,6 +13,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <QString>
+#include <QByteArray>
+#include <QList>
 #include <signal.h>
 
 struct lString
@@ -24,6 +26,8 @@ struct lString
 #define SF_MODE_DIRECTORY       0x4000
 #define SF_MODE_REGULARFILE     0x8000
 
+#define SF_ROOT_NODE            1
+
 struct sAttr
 {
     quint16   mst_mode;  // (0x4000 if directory, 0x8000 if file) + file permissions (9 lowest bits, owner-read is highest, others-execute is lowest)
@@ -33,13 +37,103 @@ struct sAttr
     time_t    mst_mtime; // Last modification time
 };
 
+struct sDataBuf
+{
+    void     *mem;  // Memory holding the data (NULL if the data is held by fd)
+    int       fd;   // File descriptor holding the data (only used if mem is NULL)
+    quint64   pos;  // Position of the data in fd (only used if mem is NULL)
+    quint32   size; // Size of the data
+};
+
+struct sDirEntry
+{
+    QByteArray name; // Name of the entry
+    sAttr      attr; // Attributes of the entry (unknown if mst_mode is 0)
+    quint64    next; // Cookie to continue the listing after this entry (not 0)
+    sDirEntry() : next(0) { attr.mst_mode = 0; }
+};
+
+struct sMountOptions
+{
+    double    entry_timeout;    // Time (in seconds) during which the kernel caches the names
+    double    attr_timeout;     // Time (in seconds) during which the kernel caches the attributes
+    double    negative_timeout; // Time (in seconds) during which the kernel caches missing names (0 to disable)
+    bool      kernel_cache;     // Never invalidate the kernel page cache of a file on open
+    bool      auto_cache;       // Invalidate the kernel page cache of a file on open only if its size or mtime changed
+    quint32   max_read;         // Maximum size of a read request (0 for no limit)
+    quint32   max_write;        // Maximum size of a write request (0 for the FUSE default)
+    quint32   max_readahead;    // Maximum readahead of the kernel (0 for the kernel default)
+    bool      async_read;       // Allow several read requests on a file at once
+    bool      big_writes;       // Allow write requests larger than a page
+    bool      splice_read;      // Use splice() to receive the data of write requests
+    bool      splice_write;     // Use splice() to send the data of read replies
+    bool      splice_move;      // Move pages instead of copying them when splicing read replies
+    quint32   max_threads;      // Maximum number of worker threads (0 for no limit, ignored if singlethreaded)
+    quint32   max_idle_threads; // Maximum number of idle worker threads before some of them stop
+    QList<int> cpus;            // CPUs the worker threads are pinned to, in turn (empty for no pinning)
+    bool      op_stats;         // Measure the number of calls and the latency of each operation
+    quint32   trace_size;       // Number of requests kept in the trace of each thread (0 to disable)
+    sMountOptions() : entry_timeout(1.0), attr_timeout(1.0), negative_timeout(0.0), kernel_cache(false), auto_cache(false),
+        max_read(0), max_write(0), max_readahead(0), async_read(true), big_writes(false),
+        splice_read(false), splice_write(false), splice_move(false), max_threads(0), max_idle_threads(10),
+        op_stats(false), trace_size(0) {}
+};
+
+struct sWorkerStats
+{
+    quint64   requests; // Number of requests processed
+    quint64   busy_ns;  // Time spent processing requests (in nanoseconds)
+    quint64   alive_ns; // Time spent running (in nanoseconds)
+    bool      running;  // Whether a thread is currently running in this worker slot
+};
+
+enum sOperation
+{
+    SF_OP_GETATTR, SF_OP_SETATTR, SF_OP_LOOKUP, SF_OP_FORGET, SF_OP_MKNOD, SF_OP_MKDIR,
+    SF_OP_UNLINK, SF_OP_RMDIR, SF_OP_RENAME, SF_OP_LINK, SF_OP_OPEN, SF_OP_READ,
+    SF_OP_WRITE, SF_OP_STATFS, SF_OP_FLUSH, SF_OP_RELEASE, SF_OP_FSYNC, SF_OP_OPENDIR,
+    SF_OP_READDIR, SF_OP_RELEASEDIR, SF_OP_FSYNCDIR, SF_OP_ACCESS, SF_OP_CREATE,
+    SF_OP_COUNT
+};
+
+struct sOpStats
+{
+    quint64   count;    // Number of calls
+    quint64   total_ns; // Total time spent in the calls (in nanoseconds)
+    quint64   p50_ns;   // Median latency (in nanoseconds, rounded up to the histogram bucket)
+    quint64   p99_ns;   // 99th percentile of the latency (in nanoseconds, rounded up to the histogram bucket)
+    quint64   max_ns;   // Maximum latency (in nanoseconds)
+};
+
+struct sTraceEntry
+{
+    quint64   start_ns;    // When the request started (monotonic clock, in nanoseconds)
+    quint64   duration_ns; // Time spent processing the request (in nanoseconds)
+    quint64   node;        // Hash of the path (path mode) or node (inode mode) concerned by the request
+    quint64   fh;          // File handle (0 if none)
+    quint64   offset;      // Offset of the request (0 if none)
+    quint32   size;        // Size of the request (0 if none)
+    qint32    result;      // Result (-errno on error, number of bytes for a read or a write, 0 otherwise)
+    quint32   thread;      // Thread which processed the request
+    sOperation op;         // Operation
+};
+
+struct fuse_server;
+
 class QSimpleFuse
 {
 public:
-    explicit QSimpleFuse(QString mountPoint, bool singlethreaded = false, bool handleSignals = true);
+    explicit QSimpleFuse(QString mountPoint, bool singlethreaded = false, bool handleSignals = true, bool inodeMode = false, const sMountOptions &options = sMountOptions());
     void unmount();
     virtual ~QSimpleFuse();
     bool checkStatus();
+    const sMountOptions &mountOptions() const;
+    QList<sWorkerStats> workerStats() const;
+    QList<sOpStats> operationStats(bool reset = false);
+    static const char *operationName(sOperation op);
+    QList<sTraceEntry> traceEntries() const;
+    bool dumpTrace(int fd) const;
+    static quint64 tracePathHash(const char *path);
 public:
     /* Initialize */
     virtual void sInit();
@@ -83,6 +177,12 @@ public:
     /* Write open file */
     virtual int sWrite(quint32 fd, const void *buf, quint32 count, quint64 offset);
 
+    /* Read open file without copying the data */
+    virtual int sReadBuf(quint32 fd, quint32 count, quint64 offset, QList<sDataBuf> &bufs);
+
+    /* Write open file without copying the data */
+    virtual int sWriteBuf(quint32 fd, quint32 count, quint64 offset, QList<sDataBuf> &bufs);
+
     /* Flush cached data */
     virtual int sSync(quint32 fd);
 
@@ -95,6 +195,12 @@ public:
     /* Read a directory entry */
     virtual int sReadDir(quint32 fd, char *&name);
 
+    /* Read a directory entry with its attributes */
+    virtual int sReadDirPlus(quint32 fd, char *&name, sAttr &attr);
+
+    /* Read several directory entries from a given position */
+    virtual int sReadDirBatch(quint32 fd, quint64 cookie, quint32 count, QList<sDirEntry> &entries);
+
     /* Close a directory */
     virtual int sCloseDir(quint32 fd);
 
@@ -106,15 +212,58 @@ public:
 
     /* Get open file attributes */
     virtual int sFGetAttr(quint32 fd, sAttr &attr);
+public:
+    /* Look up a directory entry (inode mode) */
+    virtual int sLookup(quint64 parent, const lString &name, quint64 &node, sAttr &attr);
+
+    /* Forget about a node (inode mode) */
+    virtual void sForget(quint64 node, quint64 nlookup);
+
+    /* Get node attributes (inode mode) */
+    virtual int sIGetAttr(quint64 node, sAttr &attr);
+
+    /* Create a file (inode mode) */
+    virtual int sIMkFile(quint64 parent, const lString &name, quint16 mst_mode, quint64 &node, sAttr &attr);
+
+    /* Remove a file (inode mode) */
+    virtual int sIRmFile(quint64 parent, const lString &name, bool isDir);
+
+    /* Rename a file (inode mode) */
+    virtual int sIMvFile(quint64 parentBefore, const lString &nameBefore, quint64 parentAfter, const lString &nameAfter);
+
+    /* Make a link (inode mode) */
+    virtual int sILink(quint64 node, quint64 newParent, const lString &newName, sAttr &attr);
+
+    /* Change node permissions (inode mode) */
+    virtual int sIChMod(quint64 node, quint16 mst_mode);
+
+    /* Change the size of a node (inode mode) */
+    virtual int sITruncate(quint64 node, quint64 newsize);
+
+    /* Change last modification/access time of a node (inode mode) */
+    virtual int sIUTime(quint64 node, time_t mst_atime, time_t mst_mtime);
+
+    /* Open a node (inode mode) */
+    virtual int sIOpen(quint64 node, int flags, quint32 &fd);
+
+    /* Open a directory node (inode mode) */
+    virtual int sIOpenDir(quint64 node, quint32 &fd);
+
+    /* Check access to a node (inode mode) */
+    virtual int sIAccess(quint64 node, quint8 mode);
 private:
+    /* Stop serving and unmount */
+    void stop();
+
     /* Unix signal handlers */
+    bool installSignalHandlers();
+    void releaseSignalHandlers();
     static void mySignalHandler(int sig);
 private:
     bool is_ok;
-    struct sigaction oldSigInt, oldSigHup, oldSigTerm;
     bool signalHandling;
-public: /* Intended for private use only */
-    static QSimpleFuse * volatile _instance;
+    sMountOptions mountOpts;
+    fuse_server *server;
 };
 
 #endif /* Not __QSIMPLEFUSE_H__ */
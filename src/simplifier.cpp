@@ -7,10 +7,12 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <stdio.h>
 #include <time.h>
 #include <limits.h>
+#include <pthread.h>
 #include <qglobal.h>
 
 #include "simplifier.h"
@@ -24,38 +26,258 @@ lString toLString(const char *str)
     return result;
 }
 
-#ifndef QT_NO_DEBUG
-#define dispLog(...) fprintf(stderr, __VA_ARGS__)
-#else
-#define dispLog(...) qt_noop()
-#endif
-
 #define DIR_SIZE ((off_t) 0x1000)
 
+#define INSTANCE (PERSDATA->instance)
+
+/* Measures and traces the operation until the end of the current scope (the path is only hashed if traced) */
+#define OPERATION_SCOPE(op, path, fh, offset, size) \
+    PersistentData *data = PERSDATA; \
+    OpScope opScope(data->stats, data->trace, op, data->trace ? OpTrace::pathHash(path) : 0, fh, offset, size)
+
+/* Number of entries asked at once to sReadDirBatch */
+#define READDIR_BATCH 64
+
+void makeStat(const sAttr &attr, const struct stat &def_stat, struct stat *statbuf)
+{
+    *statbuf = def_stat;
+    statbuf->st_mode = (mode_t) attr.mst_mode;
+    statbuf->st_nlink = (nlink_t) attr.mst_nlink;
+    statbuf->st_size = (attr.mst_mode & 0x4000) ? DIR_SIZE : ((off_t) attr.mst_size);
+    statbuf->st_blocks = (statbuf->st_size + 0x01FF) >> 9; // really useful ???
+    statbuf->st_atim.tv_sec = attr.mst_atime;
+    statbuf->st_mtim.tv_sec = attr.mst_mtime;
+    statbuf->st_ctim.tv_sec = attr.mst_mtime;
+}
+
+void makeStatvfs(quint64 bSize, quint64 bFree, struct statvfs *statv)
+{
+    if (bSize & 0x1FF)
+        bSize = (bSize >> 9) + 1;
+    else
+        bSize = bSize >> 9;
+    if (bFree & 0x1FF)
+        bFree = (bFree >> 9) + 1;
+    else
+        bFree = bFree >> 9;
+    statv->f_bsize = 0x200;
+    statv->f_frsize = 0x200;
+    statv->f_blocks = bSize;
+    statv->f_bfree = bFree;
+    statv->f_bavail = statv->f_bfree;
+    statv->f_namemax = STR_LEN_MAX;
+}
+
+/* Requests the capabilities set in options (among the ones supported by the kernel) */
+void applyConnOptions(const sMountOptions &options, fuse_conn_info *conn)
+{
+    if (options.max_write)
+        conn->max_write = options.max_write;
+    if (options.max_readahead && (options.max_readahead < conn->max_readahead))
+        conn->max_readahead = options.max_readahead;
+    if (!options.async_read)
+    {
+        conn->async_read = 0;
+        conn->want &= ~FUSE_CAP_ASYNC_READ;
+    }
+    unsigned int wanted = 0;
+    if (options.big_writes)
+        wanted |= FUSE_CAP_BIG_WRITES;
+    if (options.splice_read)
+        wanted |= FUSE_CAP_SPLICE_READ;
+    if (options.splice_write)
+        wanted |= FUSE_CAP_SPLICE_WRITE;
+    if (options.splice_write && options.splice_move)
+        wanted |= FUSE_CAP_SPLICE_MOVE;
+    if ((wanted & conn->capable) != wanted)
+        dispLog("Warning: capabilities 0x%x not supported by the kernel\n", wanted & ~conn->capable);
+    conn->want |= wanted & conn->capable;
+}
+
+/* Builds a buffer vector describing bufs (memory areas are copied if copyMem is true) */
+static fuse_bufvec *makeBufvec(const QList<sDataBuf> &bufs, bool copyMem)
+{
+    size_t count = (size_t) bufs.count();
+    fuse_bufvec *bufv = (fuse_bufvec*) malloc(sizeof(fuse_bufvec) + (count ? count - 1 : 0) * sizeof(fuse_buf));
+    if (!bufv)
+        return NULL;
+    *bufv = FUSE_BUFVEC_INIT(0);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const sDataBuf &data = bufs.at((int) i);
+        fuse_buf &buf = bufv->buf[i];
+        buf.size = (size_t) data.size;
+        if (data.mem)
+        {
+            buf.flags = (fuse_buf_flags) 0;
+            buf.fd = -1;
+            buf.pos = 0;
+            buf.mem = data.mem;
+            if (copyMem)
+            {
+                buf.mem = malloc(buf.size ? buf.size : 1);
+                if (!buf.mem)
+                {
+                    bufv->count = i;
+                    freeBufvec(bufv);
+                    return NULL;
+                }
+                memcpy(buf.mem, data.mem, buf.size);
+            }
+        } else {
+            buf.flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+            buf.mem = NULL;
+            buf.fd = data.fd;
+            buf.pos = (off_t) data.pos;
+        }
+    }
+    if (count)
+        bufv->count = count;
+    return bufv;
+}
+
+/* Reads size bytes of fd into a new buffer vector (to be released with freeBufvec()) and returns 0 on success */
+int readToBufvec(QSimpleFuse *instance, quint32 fd, quint32 size, quint64 offset, fuse_bufvec **bufp)
+{
+    QList<sDataBuf> bufs;
+    int ret_value = instance->sReadBuf(fd, size, offset, bufs);
+    if (ret_value == -ENOSYS)
+    {
+        /* Fall back on a plain read into memory */
+        fuse_bufvec *bufv = (fuse_bufvec*) malloc(sizeof(fuse_bufvec));
+        if (!bufv)
+            return -ENOMEM;
+        *bufv = FUSE_BUFVEC_INIT(0);
+        bufv->buf[0].mem = malloc(size ? size : 1);
+        if (!bufv->buf[0].mem)
+        {
+            free(bufv);
+            return -ENOMEM;
+        }
+        ret_value = instance->sRead(fd, bufv->buf[0].mem, size, offset);
+        if (ret_value < 0)
+        {
+            freeBufvec(bufv);
+            return ret_value;
+        }
+        bufv->buf[0].size = (size_t) ret_value;
+        *bufp = bufv;
+        return 0;
+    }
+    if (ret_value < 0)
+        return ret_value;
+    *bufp = makeBufvec(bufs, true);
+    return *bufp ? 0 : -ENOMEM;
+}
+
+/* Releases a buffer vector and its memory areas (same as what FUSE does with the result of read_buf) */
+void freeBufvec(fuse_bufvec *bufv)
+{
+    for (size_t i = 0; i < bufv->count; ++i)
+        free(bufv->buf[i].mem);
+    free(bufv);
+}
+
+/* Writes the content of src into fd and returns the number of bytes written on success */
+int writeFromBufvec(QSimpleFuse *instance, quint32 fd, fuse_bufvec *src, quint64 offset)
+{
+    size_t size = fuse_buf_size(src);
+    if (size > 0xFFFFFFFFL)
+        return -EINVAL;
+    QList<sDataBuf> bufs;
+    int ret_value = instance->sWriteBuf(fd, (quint32) size, offset, bufs);
+    if (ret_value == -ENOSYS)
+    {
+        /* Fall back on a plain write from memory */
+        fuse_buf &first = src->buf[src->idx];
+        if ((src->count == src->idx + 1) && !(first.flags & FUSE_BUF_IS_FD))
+            return instance->sWrite(fd, ((char*) first.mem) + src->off, (quint32) size, offset);
+        fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+        mem.buf[0].mem = malloc(size ? size : 1);
+        if (!mem.buf[0].mem)
+            return -ENOMEM;
+        ssize_t copied = fuse_buf_copy(&mem, src, (fuse_buf_copy_flags) 0);
+        if (copied < 0)
+            ret_value = (int) copied;
+        else
+            ret_value = instance->sWrite(fd, mem.buf[0].mem, (quint32) copied, offset);
+        free(mem.buf[0].mem);
+        return ret_value;
+    }
+    if (ret_value < 0)
+        return ret_value;
+    fuse_bufvec *dst = makeBufvec(bufs, false);
+    if (!dst)
+        return -ENOMEM;
+    ssize_t copied = fuse_buf_copy(dst, src, (fuse_buf_copy_flags) 0);
+    free(dst);
+    return (int) copied;
+}
+
+/* Forgets the attributes kept for path (to be called before it changes), and for its parent directory if withParent
+    (when an entry is added to it or removed from it). All of them are forgotten if path is NULL. */
+static void dropListedAttr(const char *path, bool withParent = false)
+{
+    PersistentData *data = PERSDATA;
+    /* Most of the changes happen while nothing is kept */
+    if (!__atomic_load_n(&data->listedCount, __ATOMIC_RELAXED))
+        return;
+    QMutexLocker locker(&data->listedLock);
+    if (!path)
+    {
+        data->listed.clear();
+    } else {
+        QByteArray key(path);
+        data->listed.remove(key);
+        if (withParent)
+        {
+            int slash = key.lastIndexOf('/');
+            key.truncate(slash ? slash : 1);
+            data->listed.remove(key);
+        }
+    }
+    __atomic_store_n(&data->listedCount, data->listed.count(), __ATOMIC_RELAXED);
+}
+
+/* Takes the attributes of path if it has been listed recently */
+static bool takeListedAttr(const char *path, sAttr &attr)
+{
+    PersistentData *data = PERSDATA;
+    if (!__atomic_load_n(&data->listedCount, __ATOMIC_RELAXED))
+        return false;
+    QMutexLocker locker(&data->listedLock);
+    QHash<QByteArray, ListedAttr>::iterator it = data->listed.find(QByteArray(path));
+    if (it == data->listed.end())
+        return false;
+    bool valid = difftime(time(NULL), it.value().listed) <= INSTANCE->mountOptions().attr_timeout;
+    attr = it.value().attr;
+    data->listed.erase(it);
+    __atomic_store_n(&data->listedCount, data->listed.count(), __ATOMIC_RELAXED);
+    return valid;
+}
+
 int s_getattr(const char *path, struct stat *statbuf)
 {
     lString lPath = toLString(path);
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
     sAttr result;
+    if (takeListedAttr(path, result))
+    {
+        makeStat(result, PERSDATA->def_stat, statbuf);
+        return 0;
+    }
     int ret_value;
-    if ((ret_value = (QSimpleFuse::_instance)->sGetAttr(lPath, result)) < 0)
+    if ((ret_value = INSTANCE->sGetAttr(lPath, result)) < 0)
         return ret_value;
-    PersistentData *data = PERSDATA;
-    *statbuf = data->def_stat;
-    statbuf->st_mode = (mode_t) result.mst_mode;
-    statbuf->st_nlink = (nlink_t) result.mst_nlink;
-    statbuf->st_size = (result.mst_mode & 0x4000) ? DIR_SIZE : ((off_t) result.mst_size);
-    statbuf->st_blocks = (statbuf->st_size + 0x01FF) >> 9; // really useful ???
-    statbuf->st_atim.tv_sec = result.mst_atime;
-    statbuf->st_mtim.tv_sec = result.mst_mtime;
-    statbuf->st_ctim.tv_sec = result.mst_mtime;
+    makeStat(result, PERSDATA->def_stat, statbuf);
     return 0;
 }
 
 int s_mknod(const char *path, mode_t mode, dev_t dev)
 {
     Q_UNUSED(dev);
+    dropListedAttr(path, true);
     lString lPath = toLString(path);
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
@@ -64,11 +286,12 @@ int s_mknod(const char *path, mode_t mode, dev_t dev)
         dispLog("Warning: s_mknod on \"%s\" with mode 0%o\n", path, mode);
         return -EPERM;
     }
-    return (QSimpleFuse::_instance)->sMkFile(lPath, (quint16) mode);
+    return INSTANCE->sMkFile(lPath, (quint16) mode);
 }
 
 int s_mkdir(const char *path, mode_t mode)
 {
+    dropListedAttr(path, true);
     lString lPath = toLString(path);
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
@@ -80,49 +303,56 @@ int s_mkdir(const char *path, mode_t mode)
         dispLog("Warning: s_mkdir on \"%s\" with mode 0%o\n", path, mode);
         return -EPERM;
     }
-    return (QSimpleFuse::_instance)->sMkFile(lPath, (quint16) mode);
+    return INSTANCE->sMkFile(lPath, (quint16) mode);
 }
 
 int s_unlink(const char *path)
 {
+    dropListedAttr(path, true);
     lString lPath = toLString(path);
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
-    return (QSimpleFuse::_instance)->sRmFile(lPath, false);
+    return INSTANCE->sRmFile(lPath, false);
 }
 
 int s_rmdir(const char *path)
 {
+    dropListedAttr(path, true);
     lString lPath = toLString(path);
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
-    return (QSimpleFuse::_instance)->sRmFile(lPath, true);
+    return INSTANCE->sRmFile(lPath, true);
 }
 
 int s_rename(const char *path, const char *newpath)
 {
+    /* The paths of the entries of a directory change with it */
+    dropListedAttr(NULL);
     lString lPathFrom = toLString(path);
     if (lPathFrom.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
     lString lPathTo = toLString(newpath);
     if (lPathTo.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
-    return (QSimpleFuse::_instance)->sMvFile(lPathFrom, lPathTo);
+    return INSTANCE->sMvFile(lPathFrom, lPathTo);
 }
 
 int s_link(const char *path, const char *newpath)
 {
+    dropListedAttr(path);
+    dropListedAttr(newpath, true);
     lString lPathFrom = toLString(newpath);
     if (lPathFrom.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
     lString lPathTo = toLString(path);
     if (lPathTo.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
-    return (QSimpleFuse::_instance)->sLink(lPathFrom, lPathTo);
+    return INSTANCE->sLink(lPathFrom, lPathTo);
 }
 
 int s_chmod(const char *path, mode_t mode)
 {
+    dropListedAttr(path);
     if (mode & 0xE00)
     {
         dispLog("Warning: s_chmod on \"%s\" with mode 0%o\n", path, mode);
@@ -131,7 +361,7 @@ int s_chmod(const char *path, mode_t mode)
     lString lPath = toLString(path);
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
-    return (QSimpleFuse::_instance)->sChMod(lPath, (quint16) mode);
+    return INSTANCE->sChMod(lPath, (quint16) mode);
 }
 
 int s_chown(const char *path, uid_t uid, gid_t gid)
@@ -145,16 +375,18 @@ int s_chown(const char *path, uid_t uid, gid_t gid)
 
 int s_truncate(const char *path, off_t newsize)
 {
+    dropListedAttr(path);
     if (newsize < 0)
         return -EINVAL;
     lString lPath = toLString(path);
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
-    return (QSimpleFuse::_instance)->sTruncate(lPath, (quint64) newsize);
+    return INSTANCE->sTruncate(lPath, (quint64) newsize);
 }
 
 int s_utime(const char *path, utimbuf *ubuf)
 {
+    dropListedAttr(path);
     lString lPath = toLString(path);
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
@@ -167,7 +399,7 @@ int s_utime(const char *path, utimbuf *ubuf)
         time(&mst_atime);
         mst_mtime = mst_atime;
     }
-    return (QSimpleFuse::_instance)->sUTime(lPath, mst_atime, mst_mtime);
+    return INSTANCE->sUTime(lPath, mst_atime, mst_mtime);
 }
 
 int s_open(const char *path, fuse_file_info *fi)
@@ -182,7 +414,7 @@ int s_open(const char *path, fuse_file_info *fi)
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
     quint32 fhv = 0;
-    int ret_value = (QSimpleFuse::_instance)->sOpen(lPath, fi->flags, fhv);
+    int ret_value = INSTANCE->sOpen(lPath, fi->flags, fhv);
     fi->fh = (uint64_t) fhv;
     return ret_value;
 }
@@ -194,40 +426,45 @@ int s_read(const char *path, char *buf, size_t size, off_t offset, fuse_file_inf
         return -EINVAL;
     if (offset < 0)
         return -EINVAL;
-    return (QSimpleFuse::_instance)->sRead((quint32) fi->fh, buf, (quint32) size, (quint64) offset);
+    return INSTANCE->sRead((quint32) fi->fh, buf, (quint32) size, (quint64) offset);
 }
 
 int s_write(const char *path, const char *buf, size_t size, off_t offset, fuse_file_info *fi)
+{
+    dropListedAttr(path);
+    if (size > 0xFFFFFFFFL)
+        return -EINVAL;
+    if (offset < 0)
+        return -EINVAL;
+    return INSTANCE->sWrite((quint32) fi->fh, buf, (quint32) size, (quint64) offset);
+}
+
+int s_read_buf(const char *path, fuse_bufvec **bufp, size_t size, off_t offset, fuse_file_info *fi)
 {
     Q_UNUSED(path);
     if (size > 0xFFFFFFFFL)
         return -EINVAL;
     if (offset < 0)
         return -EINVAL;
-    return (QSimpleFuse::_instance)->sWrite((quint32) fi->fh, buf, (quint32) size, (quint64) offset);
+    return readToBufvec(INSTANCE, (quint32) fi->fh, (quint32) size, (quint64) offset, bufp);
+}
+
+int s_write_buf(const char *path, fuse_bufvec *buf, off_t offset, fuse_file_info *fi)
+{
+    dropListedAttr(path);
+    if (offset < 0)
+        return -EINVAL;
+    return writeFromBufvec(INSTANCE, (quint32) fi->fh, buf, (quint64) offset);
 }
 
 int s_statvfs(const char *path, struct statvfs *statv)
 {
     Q_UNUSED(path);
     quint64 bSize, bFree;
-    int ret_value = (QSimpleFuse::_instance)->sGetSize(bSize, bFree);
+    int ret_value = INSTANCE->sGetSize(bSize, bFree);
     if (ret_value < 0)
         return ret_value;
-    if (bSize & 0x1FF)
-        bSize = (bSize >> 9) + 1;
-    else
-        bSize = bSize >> 9;
-    if (bFree & 0x1FF)
-        bFree = (bFree >> 9) + 1;
-    else
-        bFree = bFree >> 9;
-    statv->f_bsize = 0x200;
-    statv->f_frsize = 0x200;
-    statv->f_blocks = bSize;
-    statv->f_bfree = bFree;
-    statv->f_bavail = statv->f_bfree;
-    statv->f_namemax = STR_LEN_MAX;
+    makeStatvfs(bSize, bFree, statv);
     return 0;
 }
 
@@ -235,13 +472,13 @@ int s_flush(const char *path, fuse_file_info *fi)
 {
     Q_UNUSED(path);
     // I did not really get the difference with a normal sync, but let's do the same action.
-    return (QSimpleFuse::_instance)->sSync((quint32) fi->fh);
+    return INSTANCE->sSync((quint32) fi->fh);
 }
 
 int s_release(const char *path, fuse_file_info *fi)
 {
-    Q_UNUSED(path);
-    return (QSimpleFuse::_instance)->sClose((quint32) fi->fh);
+    dropListedAttr(path);
+    return INSTANCE->sClose((quint32) fi->fh);
 }
 
 int s_fsync(const char *path, int datasync, fuse_file_info *fi)
@@ -249,7 +486,7 @@ int s_fsync(const char *path, int datasync, fuse_file_info *fi)
     Q_UNUSED(path);
     // We do not care about meta data being flushed here.
     Q_UNUSED(datasync);
-    return (QSimpleFuse::_instance)->sSync((quint32) fi->fh);
+    return INSTANCE->sSync((quint32) fi->fh);
 }
 
 int s_opendir(const char *path, fuse_file_info *fi)
@@ -258,25 +495,111 @@ int s_opendir(const char *path, fuse_file_info *fi)
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
     quint32 fhv = 0;
-    int ret_value = (QSimpleFuse::_instance)->sOpenDir(lPath, fhv);
+    int ret_value = INSTANCE->sOpenDir(lPath, fhv);
     fi->fh = (uint64_t) fhv;
     return ret_value;
 }
 
-int s_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-    fuse_file_info *fi)
+/* Keeps the attributes of a listed entry for the s_getattr call that usually follows.
+    The files with several links are not kept, as they can change through another path. */
+static void keepListedAttr(PersistentData *data, const QByteArray &path, const sAttr &attr, time_t now)
 {
-    Q_UNUSED(path);
-    Q_UNUSED(offset);
+    if ((!(attr.mst_mode & SF_MODE_DIRECTORY)) && (attr.mst_nlink > 1))
+        return;
+    QMutexLocker locker(&data->listedLock);
+    if (data->listed.count() >= LISTED_ATTR_MAX)
+    {
+        /* The expired entries go first, then all of them if none has expired */
+        double timeout = data->instance->mountOptions().attr_timeout;
+        QHash<QByteArray, ListedAttr>::iterator it = data->listed.begin();
+        while (it != data->listed.end())
+        {
+            if (difftime(now, it.value().listed) > timeout)
+                it = data->listed.erase(it);
+            else
+                ++it;
+        }
+        if (data->listed.count() >= LISTED_ATTR_MAX)
+            data->listed.clear();
+    }
+    ListedAttr &entry = data->listed[path];
+    entry.attr = attr;
+    entry.listed = now;
+    __atomic_store_n(&data->listedCount, data->listed.count(), __ATOMIC_RELAXED);
+}
+
+static bool isDotEntry(const char *name)
+{
+    return (strcmp(name, ".") == 0) || (strcmp(name, "..") == 0);
+}
+
+/* Lists a directory through its stream (sReadDirPlus or sReadDir) */
+static int readDirStream(const QByteArray &prefix, void *buf, fuse_fill_dir_t filler, quint32 fd)
+{
+    QSimpleFuse *instance = INSTANCE;
+    PersistentData *data = PERSDATA;
     int ret_value;
     char *name;
-    while (((ret_value = (QSimpleFuse::_instance)->sReadDir((quint32) fi->fh, name)) == 0) && name)
+    sAttr attr;
+    if ((ret_value = instance->sReadDirPlus(fd, name, attr)) == -ENOSYS)
     {
-        if (filler(buf, name, NULL, 0) != 0)
+        while (((ret_value = instance->sReadDir(fd, name)) == 0) && name)
+        {
+            if (filler(buf, name, NULL, 0) != 0)
+            {
+                dispLog("Warning: readdir filler:  buffer full\n");
+                return -ENOMEM;
+            }
+        }
+        return ret_value;
+    }
+    time_t now = time(NULL);
+    struct stat statbuf;
+    for (; (ret_value == 0) && name; ret_value = instance->sReadDirPlus(fd, name, attr))
+    {
+        makeStat(attr, data->def_stat, &statbuf);
+        if (filler(buf, name, &statbuf, 0) != 0)
         {
             dispLog("Warning: readdir filler:  buffer full\n");
             return -ENOMEM;
         }
+        if (!isDotEntry(name))
+            keepListedAttr(data, prefix + name, attr, now);
+    }
+    return ret_value;
+}
+
+int s_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+    fuse_file_info *fi)
+{
+    QSimpleFuse *instance = INSTANCE;
+    PersistentData *data = PERSDATA;
+    QByteArray prefix(path);
+    if (!prefix.endsWith('/'))
+        prefix += '/';
+    QList<sDirEntry> entries;
+    int ret_value = instance->sReadDirBatch((quint32) fi->fh, (quint64) offset, READDIR_BATCH, entries);
+    if (ret_value == -ENOSYS)
+        return readDirStream(prefix, buf, filler, (quint32) fi->fh);
+    /* FUSE asks again from the offset of the last entry once its buffer is full */
+    time_t now = time(NULL);
+    struct stat statbuf;
+    while ((ret_value == 0) && !entries.isEmpty())
+    {
+        for (int i = 0; i < entries.count(); ++i)
+        {
+            const sDirEntry &entry = entries.at(i);
+            bool known = entry.attr.mst_mode != 0;
+            if (known)
+                makeStat(entry.attr, data->def_stat, &statbuf);
+            if (filler(buf, entry.name.constData(), known ? &statbuf : NULL, (off_t) entry.next) != 0)
+                return 0;
+            if (known && !isDotEntry(entry.name.constData()))
+                keepListedAttr(data, prefix + entry.name, entry.attr, now);
+        }
+        quint64 cookie = entries.last().next;
+        entries.clear();
+        ret_value = instance->sReadDirBatch((quint32) fi->fh, cookie, READDIR_BATCH, entries);
     }
     return ret_value;
 }
@@ -284,7 +607,7 @@ int s_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 int s_releasedir(const char *path, fuse_file_info *fi)
 {
     Q_UNUSED(path);
-    return (QSimpleFuse::_instance)->sCloseDir((quint32) fi->fh);
+    return INSTANCE->sCloseDir((quint32) fi->fh);
 }
 
 int s_fsyncdir(const char *path, int datasync, fuse_file_info *fi)
@@ -297,20 +620,19 @@ int s_fsyncdir(const char *path, int datasync, fuse_file_info *fi)
 
 void *s_init(fuse_conn_info *conn)
 {
-    Q_UNUSED(conn);
-    (QSimpleFuse::_instance)->sInit();
-    PersistentData *data = new PersistentData;
+    /* The private data is given to fuse_new() by the instance, which owns it */
+    PersistentData *data = PERSDATA;
+    applyConnOptions(data->instance->mountOptions(), conn);
     memset(&data->def_stat, 0, sizeof(struct stat));
     data->def_stat.st_uid = geteuid();
     data->def_stat.st_gid = getegid();
+    data->instance->sInit();
     return data;
 }
 
 void s_destroy(void *userdata)
 {
-    PersistentData *data = (PersistentData*) userdata;
-    delete data;
-    (QSimpleFuse::_instance)->sDestroy();
+    ((PersistentData*) userdata)->instance->sDestroy();
 }
 
 int s_access(const char *path, int mask)
@@ -318,11 +640,12 @@ int s_access(const char *path, int mask)
     lString lPath = toLString(path);
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
-    return (QSimpleFuse::_instance)->sAccess(lPath, (quint8) mask);
+    return INSTANCE->sAccess(lPath, (quint8) mask);
 }
 
 int s_create(const char *path, mode_t mode, fuse_file_info *fi)
 {
+    dropListedAttr(path, true);
     lString lPath = toLString(path);
     if (lPath.str_len > STR_LEN_MAX)
         return -ENAMETOOLONG;
@@ -331,27 +654,27 @@ int s_create(const char *path, mode_t mode, fuse_file_info *fi)
         dispLog("Warning: s_mknod on \"%s\" with mode 0%o\n", path, mode);
         return -EPERM;
     }
-    int ret_value = (QSimpleFuse::_instance)->sMkFile(lPath, (quint16) ((mode & 0x1FF) | 0x8000));
+    int ret_value = INSTANCE->sMkFile(lPath, (quint16) ((mode & 0x1FF) | 0x8000));
     quint32 fhv = 0;
     if (ret_value == -EEXIST)
     {
-        ret_value = (QSimpleFuse::_instance)->sOpen(lPath, O_WRONLY | O_TRUNC, fhv);
+        ret_value = INSTANCE->sOpen(lPath, O_WRONLY | O_TRUNC, fhv);
         fi->fh = (uint64_t) fhv;
         return ret_value;
     }
     if (ret_value < 0)
         return ret_value;
-    ret_value = (QSimpleFuse::_instance)->sOpen(lPath, O_WRONLY, fhv);
+    ret_value = INSTANCE->sOpen(lPath, O_WRONLY, fhv);
     fi->fh = (uint64_t) fhv;
     return ret_value;
 }
 
 int s_ftruncate(const char *path, off_t offset, fuse_file_info *fi)
 {
-    Q_UNUSED(path);
+    dropListedAttr(path);
     if (offset < 0)
         return -EINVAL;
-    return (QSimpleFuse::_instance)->sFTruncate((quint32) fi->fh, (quint64) offset);
+    return INSTANCE->sFTruncate((quint32) fi->fh, (quint64) offset);
 }
 
 int s_fgetattr(const char *path, struct stat *statbuf, fuse_file_info *fi)
@@ -359,53 +682,233 @@ int s_fgetattr(const char *path, struct stat *statbuf, fuse_file_info *fi)
     Q_UNUSED(path);
     sAttr result;
     int ret_value;
-    if ((ret_value = (QSimpleFuse::_instance)->sFGetAttr((quint32) fi->fh, result)) < 0)
+    if ((ret_value = INSTANCE->sFGetAttr((quint32) fi->fh, result)) < 0)
         return ret_value;
-    PersistentData *data = PERSDATA;
-    *statbuf = data->def_stat;
-    statbuf->st_mode = (mode_t) result.mst_mode;
-    statbuf->st_nlink = (nlink_t) result.mst_nlink;
-    statbuf->st_size = (result.mst_mode & 0x4000) ? DIR_SIZE : ((off_t) result.mst_size);
-    statbuf->st_blocks = (statbuf->st_size + 0x01FF) >> 9; // really useful ???
-    statbuf->st_atim.tv_sec = result.mst_atime;
-    statbuf->st_mtim.tv_sec = result.mst_mtime;
-    statbuf->st_ctim.tv_sec = result.mst_mtime;
+    makeStat(result, PERSDATA->def_stat, statbuf);
     return 0;
 }
 
+/* Measured and traced operations, given to FUSE instead of the s_* functions */
+
+static int m_getattr(const char *path, struct stat *statbuf)
+{
+    OPERATION_SCOPE(SF_OP_GETATTR, path, 0, 0, 0);
+    return opScope.done(s_getattr(path, statbuf));
+}
+
+static int m_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    OPERATION_SCOPE(SF_OP_MKNOD, path, 0, 0, 0);
+    return opScope.done(s_mknod(path, mode, dev));
+}
+
+static int m_mkdir(const char *path, mode_t mode)
+{
+    OPERATION_SCOPE(SF_OP_MKDIR, path, 0, 0, 0);
+    return opScope.done(s_mkdir(path, mode));
+}
+
+static int m_unlink(const char *path)
+{
+    OPERATION_SCOPE(SF_OP_UNLINK, path, 0, 0, 0);
+    return opScope.done(s_unlink(path));
+}
+
+static int m_rmdir(const char *path)
+{
+    OPERATION_SCOPE(SF_OP_RMDIR, path, 0, 0, 0);
+    return opScope.done(s_rmdir(path));
+}
+
+static int m_rename(const char *path, const char *newpath)
+{
+    OPERATION_SCOPE(SF_OP_RENAME, path, 0, 0, 0);
+    return opScope.done(s_rename(path, newpath));
+}
+
+static int m_link(const char *path, const char *newpath)
+{
+    OPERATION_SCOPE(SF_OP_LINK, path, 0, 0, 0);
+    return opScope.done(s_link(path, newpath));
+}
+
+static int m_chmod(const char *path, mode_t mode)
+{
+    OPERATION_SCOPE(SF_OP_SETATTR, path, 0, 0, 0);
+    return opScope.done(s_chmod(path, mode));
+}
+
+static int m_chown(const char *path, uid_t uid, gid_t gid)
+{
+    OPERATION_SCOPE(SF_OP_SETATTR, path, 0, 0, 0);
+    return opScope.done(s_chown(path, uid, gid));
+}
+
+static int m_truncate(const char *path, off_t newsize)
+{
+    OPERATION_SCOPE(SF_OP_SETATTR, path, 0, (quint64) newsize, 0);
+    return opScope.done(s_truncate(path, newsize));
+}
+
+static int m_utime(const char *path, utimbuf *ubuf)
+{
+    OPERATION_SCOPE(SF_OP_SETATTR, path, 0, 0, 0);
+    return opScope.done(s_utime(path, ubuf));
+}
+
+static int m_open(const char *path, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_OPEN, path, 0, 0, 0);
+    opScope.done(s_open(path, fi));
+    opScope.setHandle(fi->fh);
+    return opScope.result();
+}
+
+static int m_read(const char *path, char *buf, size_t size, off_t offset, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_READ, path, fi->fh, (quint64) offset, (quint32) size);
+    return opScope.done(s_read(path, buf, size, offset, fi));
+}
+
+static int m_write(const char *path, const char *buf, size_t size, off_t offset, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_WRITE, path, fi->fh, (quint64) offset, (quint32) size);
+    return opScope.done(s_write(path, buf, size, offset, fi));
+}
+
+static int m_read_buf(const char *path, fuse_bufvec **bufp, size_t size, off_t offset, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_READ, path, fi->fh, (quint64) offset, (quint32) size);
+    int ret_value = s_read_buf(path, bufp, size, offset, fi);
+    /* The trace gives the number of bytes read, FUSE only expects 0 */
+    opScope.done((ret_value == 0) ? (int) fuse_buf_size(*bufp) : ret_value);
+    return ret_value;
+}
+
+static int m_write_buf(const char *path, fuse_bufvec *buf, off_t offset, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_WRITE, path, fi->fh, (quint64) offset, (quint32) fuse_buf_size(buf));
+    return opScope.done(s_write_buf(path, buf, offset, fi));
+}
+
+static int m_statvfs(const char *path, struct statvfs *statv)
+{
+    OPERATION_SCOPE(SF_OP_STATFS, path, 0, 0, 0);
+    return opScope.done(s_statvfs(path, statv));
+}
+
+static int m_flush(const char *path, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_FLUSH, path, fi->fh, 0, 0);
+    return opScope.done(s_flush(path, fi));
+}
+
+static int m_release(const char *path, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_RELEASE, path, fi->fh, 0, 0);
+    return opScope.done(s_release(path, fi));
+}
+
+static int m_fsync(const char *path, int datasync, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_FSYNC, path, fi->fh, 0, 0);
+    return opScope.done(s_fsync(path, datasync, fi));
+}
+
+static int m_opendir(const char *path, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_OPENDIR, path, 0, 0, 0);
+    opScope.done(s_opendir(path, fi));
+    opScope.setHandle(fi->fh);
+    return opScope.result();
+}
+
+static int m_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_READDIR, path, fi->fh, (quint64) offset, 0);
+    return opScope.done(s_readdir(path, buf, filler, offset, fi));
+}
+
+static int m_releasedir(const char *path, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_RELEASEDIR, path, fi->fh, 0, 0);
+    return opScope.done(s_releasedir(path, fi));
+}
+
+static int m_fsyncdir(const char *path, int datasync, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_FSYNCDIR, path, fi->fh, 0, 0);
+    return opScope.done(s_fsyncdir(path, datasync, fi));
+}
+
+static int m_access(const char *path, int mask)
+{
+    OPERATION_SCOPE(SF_OP_ACCESS, path, 0, 0, 0);
+    return opScope.done(s_access(path, mask));
+}
+
+static int m_create(const char *path, mode_t mode, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_CREATE, path, 0, 0, 0);
+    opScope.done(s_create(path, mode, fi));
+    opScope.setHandle(fi->fh);
+    return opScope.result();
+}
+
+static int m_ftruncate(const char *path, off_t offset, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_SETATTR, path, fi->fh, (quint64) offset, 0);
+    return opScope.done(s_ftruncate(path, offset, fi));
+}
+
+static int m_fgetattr(const char *path, struct stat *statbuf, fuse_file_info *fi)
+{
+    OPERATION_SCOPE(SF_OP_GETATTR, path, fi->fh, 0, 0);
+    return opScope.done(s_fgetattr(path, statbuf, fi));
+}
+
 fuse_operations s_oper;
+static pthread_once_t s_oper_once = PTHREAD_ONCE_INIT;
 
-void makeSimplifiedFuseOperations()
+static void fillSimplifiedFuseOperations()
 {
     memset(&s_oper, 0, sizeof(s_oper));
-    s_oper.getattr = s_getattr;
-    s_oper.mknod = s_mknod;
-    s_oper.mkdir = s_mkdir;
-    s_oper.unlink = s_unlink;
-    s_oper.rmdir = s_rmdir;
-    s_oper.rename = s_rename;
-    s_oper.link = s_link;
-    s_oper.chmod = s_chmod;
-    s_oper.chown = s_chown;
-    s_oper.truncate = s_truncate;
-    s_oper.utime = s_utime;
-    s_oper.open = s_open;
-    s_oper.read = s_read;
-    s_oper.write = s_write;
-    s_oper.statfs = s_statvfs;
-    s_oper.flush = s_flush;
-    s_oper.release = s_release;
-    s_oper.fsync = s_fsync;
-    s_oper.opendir = s_opendir;
-    s_oper.readdir = s_readdir;
-    s_oper.releasedir = s_releasedir;
-    s_oper.fsyncdir = s_fsyncdir;
+    s_oper.getattr = m_getattr;
+    s_oper.mknod = m_mknod;
+    s_oper.mkdir = m_mkdir;
+    s_oper.unlink = m_unlink;
+    s_oper.rmdir = m_rmdir;
+    s_oper.rename = m_rename;
+    s_oper.link = m_link;
+    s_oper.chmod = m_chmod;
+    s_oper.chown = m_chown;
+    s_oper.truncate = m_truncate;
+    s_oper.utime = m_utime;
+    s_oper.open = m_open;
+    s_oper.read = m_read;
+    s_oper.write = m_write;
+    s_oper.statfs = m_statvfs;
+    s_oper.flush = m_flush;
+    s_oper.release = m_release;
+    s_oper.fsync = m_fsync;
+    s_oper.opendir = m_opendir;
+    s_oper.readdir = m_readdir;
+    s_oper.releasedir = m_releasedir;
+    s_oper.fsyncdir = m_fsyncdir;
     s_oper.init = s_init;
     s_oper.destroy = s_destroy;
-    s_oper.access = s_access;
-    s_oper.create = s_create;
-    s_oper.ftruncate = s_ftruncate;
-    s_oper.fgetattr = s_fgetattr;
+    s_oper.access = m_access;
+    s_oper.create = m_create;
+    s_oper.ftruncate = m_ftruncate;
+    s_oper.fgetattr = m_fgetattr;
+    s_oper.read_buf = m_read_buf;
+    s_oper.write_buf = m_write_buf;
+}
+
+/* Fills the operation table shared by all the instances (only once) */
+void makeSimplifiedFuseOperations()
+{
+    pthread_once(&s_oper_once, fillSimplifiedFuseOperations);
 }
 
 fuse_operations *getSimplifiedFuseOperations()
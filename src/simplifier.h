@@ -12,16 +12,61 @@
 #endif
 
 #include <fuse.h>
+#include <qglobal.h>
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+
+#include "qsimplefuse.h"
+#include "opstats.h"
 
 #define STR_LEN_MAX 255
 
+#ifndef QT_NO_DEBUG
+#include <stdio.h>
+#define dispLog(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define dispLog(...) qt_noop()
+#endif
+
+/* Maximum number of listed entries whose attributes are kept */
+#define LISTED_ATTR_MAX 0x10000
+
+struct ListedAttr
+{
+    sAttr attr;
+    time_t listed; // When the entry was listed
+};
+
 struct PersistentData
 {
+    QSimpleFuse *instance;
     struct stat def_stat;
+    OpStats *stats; // NULL if the operations are not measured
+    OpTrace *trace; // NULL if the operations are not traced
+    QMutex listedLock;
+    QHash<QByteArray, ListedAttr> listed; // Attributes given by sReadDirPlus, used once by s_getattr
+    int listedCount; // Number of entries in listed, read without the lock
+
+    PersistentData() : listedCount(0) {}
 };
 
 #define PERSDATA ((PersistentData*) fuse_get_context()->private_data)
 
+lString toLString(const char *str);
+
+void makeStat(const sAttr &attr, const struct stat &def_stat, struct stat *statbuf);
+
+void makeStatvfs(quint64 bSize, quint64 bFree, struct statvfs *statv);
+
+void applyConnOptions(const sMountOptions &options, struct fuse_conn_info *conn);
+
+int readToBufvec(QSimpleFuse *instance, quint32 fd, quint32 size, quint64 offset, struct fuse_bufvec **bufp);
+
+void freeBufvec(struct fuse_bufvec *bufv);
+
+int writeFromBufvec(QSimpleFuse *instance, quint32 fd, struct fuse_bufvec *src, quint64 offset);
+
 void makeSimplifiedFuseOperations();
 
 fuse_operations *getSimplifiedFuseOperations();
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2015, Rémi Bazin <bazin.remi@gmail.com>
+ * All rights reserved.
+ * See LICENSE for licensing details.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sched.h>
+#include <qglobal.h>
+
+#include "workerpool.h"
+#include "simplifier.h"
+#include "opstats.h"
+
+WorkerPool::WorkerPool(fuse_session *se, quint32 maxThreads, quint32 maxIdleThreads, const QList<int> &cpus) :
+    se(se), ch(NULL), maxThreads(maxThreads), maxIdleThreads(maxIdleThreads), cpus(cpus), numWorkers(0), numAvailable(0), error(0)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    for (int i = 0; i < workers.count(); ++i)
+        delete workers.at(i);
+}
+
+/* Serves the requests until the session exits and returns 0 (or -errno on error) */
+int WorkerPool::run()
+{
+    /* The signals are meant for the other threads (see QSimpleFuse::mySignalHandler()) */
+    sigset_t allSignals;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_BLOCK, &allSignals, NULL);
+    ch = fuse_session_next_chan(se, NULL);
+    WorkerSlot *first = new WorkerSlot;
+    memset(first, 0, sizeof(WorkerSlot));
+    first->pool = this;
+    first->thread = pthread_self();
+    lock.lock();
+    workers.append(first);
+    first->started = monotonicNs();
+    first->stats.running = true;
+    ++numWorkers;
+    ++numAvailable;
+    lock.unlock();
+    work(first);
+    /* Stop the other workers (they never get cancelled while processing a request) */
+    lock.lock();
+    for (int i = 1; i < workers.count(); ++i)
+    {
+        if (workers.at(i)->stats.running)
+            pthread_cancel(workers.at(i)->thread);
+    }
+    lock.unlock();
+    for (int i = 1; i < workers.count(); ++i)
+    {
+        WorkerSlot *slot = workers.at(i);
+        if (slot->joinable)
+        {
+            pthread_join(slot->thread, NULL);
+            slot->joinable = false;
+        }
+        QMutexLocker locker(&lock);
+        if (slot->stats.running)
+            workerDone(slot);
+    }
+    lock.lock();
+    workerDone(first);
+    lock.unlock();
+    return error;
+}
+
+/* Returns the statistics of each worker (the first one never stops) */
+QList<sWorkerStats> WorkerPool::stats() const
+{
+    QMutexLocker locker(&lock);
+    QList<sWorkerStats> result;
+    quint64 now = monotonicNs();
+    for (int i = 0; i < workers.count(); ++i)
+    {
+        sWorkerStats stats = workers.at(i)->stats;
+        if (stats.running)
+            stats.alive_ns += now - workers.at(i)->started;
+        result.append(stats);
+    }
+    return result;
+}
+
+void *WorkerPool::workerThread(void *arg)
+{
+    WorkerSlot *slot = (WorkerSlot*) arg;
+    slot->pool->work(slot);
+    return NULL;
+}
+
+/* Starts a new worker, with the lock held */
+bool WorkerPool::startWorker()
+{
+    WorkerSlot *slot = NULL;
+    for (int i = 1; i < workers.count(); ++i)
+    {
+        if (!workers.at(i)->stats.running)
+        {
+            slot = workers.at(i);
+            break;
+        }
+    }
+    if (!slot)
+    {
+        slot = new WorkerSlot;
+        memset(slot, 0, sizeof(WorkerSlot));
+        slot->pool = this;
+        slot->index = workers.count();
+        workers.append(slot);
+    } else if (slot->joinable)
+    {
+        /* The previous thread of this slot is about to return */
+        pthread_join(slot->thread, NULL);
+        slot->joinable = false;
+    }
+    slot->started = monotonicNs();
+    slot->stats.running = true;
+    /* The new thread inherits the signal mask of this worker */
+    if (pthread_create(&slot->thread, NULL, workerThread, slot) != 0)
+    {
+#ifndef QT_NO_DEBUG
+        perror("pthread_create");
+#endif
+        slot->stats.running = false;
+        return false;
+    }
+    slot->joinable = true;
+    ++numWorkers;
+    ++numAvailable;
+    return true;
+}
+
+/* Accounts for the end of a worker, with the lock held */
+void WorkerPool::workerDone(WorkerSlot *slot)
+{
+    slot->stats.alive_ns += monotonicNs() - slot->started;
+    slot->stats.running = false;
+    --numWorkers;
+    --numAvailable;
+}
+
+void WorkerPool::work(WorkerSlot *slot)
+{
+    if (!cpus.isEmpty())
+    {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpus.at(slot->index % cpus.count()), &cpuSet);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuSet) != 0)
+            dispLog("Warning: could not pin worker %d to CPU %d\n", slot->index, cpus.at(slot->index % cpus.count()));
+    }
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char *mem = (char*) malloc(bufsize);
+    if (!mem)
+    {
+        lock.lock();
+        error = -ENOMEM;
+        if (slot->index)
+            workerDone(slot);
+        lock.unlock();
+        fuse_session_exit(se);
+        return;
+    }
+    bool idle = false;
+    pthread_cleanup_push(free, mem);
+    while (!fuse_session_exited(se))
+    {
+        fuse_chan *bufch = ch;
+        fuse_buf fbuf;
+        memset(&fbuf, 0, sizeof(fbuf));
+        fbuf.mem = mem;
+        fbuf.size = bufsize;
+        /* Only waiting for a request may be cancelled */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int res = fuse_session_receive_buf(se, &fbuf, &bufch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0)
+        {
+            if (res < 0)
+            {
+                lock.lock();
+                error = res;
+                lock.unlock();
+                fuse_session_exit(se);
+            }
+            break;
+        }
+        lock.lock();
+        if (fuse_session_exited(se))
+        {
+            lock.unlock();
+            break;
+        }
+        /* Make sure that someone is still waiting for the next request */
+        if ((--numAvailable == 0) && ((!maxThreads) || (numWorkers < maxThreads)))
+            startWorker();
+        lock.unlock();
+        quint64 begin = monotonicNs();
+        fuse_session_process_buf(se, &fbuf, bufch);
+        quint64 end = monotonicNs();
+        lock.lock();
+        slot->stats.busy_ns += end - begin;
+        ++slot->stats.requests;
+        ++numAvailable;
+        if (slot->index && (numAvailable > maxIdleThreads))
+        {
+            /* Too many idle workers (this slot may be reused and joined as soon as the lock is released) */
+            workerDone(slot);
+            lock.unlock();
+            idle = true;
+            break;
+        }
+        lock.unlock();
+    }
+    pthread_cleanup_pop(1);
+    if (slot->index && !idle)
+    {
+        QMutexLocker locker(&lock);
+        workerDone(slot);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2015, Rémi Bazin <bazin.remi@gmail.com>
+ * All rights reserved.
+ * See LICENSE for licensing details.
+ */
+
+#ifndef __WORKERPOOL_H__
+#define __WORKERPOOL_H__
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#include <fuse/fuse_lowlevel.h>
+#include <pthread.h>
+#include <QList>
+#include <QMutex>
+
+#include "qsimplefuse.h"
+
+class WorkerPool;
+
+struct WorkerSlot
+{
+    WorkerPool *pool;
+    int index;
+    pthread_t thread;
+    bool joinable; // the thread has been started and not joined yet
+    sWorkerStats stats;
+    quint64 started; // when the running thread started (in nanoseconds)
+};
+
+/* Serves the requests of a session with a pool of threads (same policy as fuse_session_loop_mt) */
+class WorkerPool
+{
+public:
+    WorkerPool(fuse_session *se, quint32 maxThreads, quint32 maxIdleThreads, const QList<int> &cpus);
+    ~WorkerPool();
+    int run();
+    QList<sWorkerStats> stats() const;
+private:
+    static void *workerThread(void *arg);
+    void work(WorkerSlot *slot);
+    bool startWorker();
+    void workerDone(WorkerSlot *slot);
+private:
+    fuse_session *se;
+    fuse_chan *ch;
+    quint32 maxThreads, maxIdleThreads;
+    QList<int> cpus;
+    mutable QMutex lock;
+    QList<WorkerSlot*> workers;
+    quint32 numWorkers, numAvailable;
+    int error;
+};
+
+#endif /* Not __WORKERPOOL_H__ */